@@ -0,0 +1,140 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+// main.cpp is a program rather than a library, so pull it in whole and keep
+// its main out of the way of the benchmark's.
+#define main databaseMain
+#include "main.cpp"
+#undef main
+
+// Microbenchmarks for Database::add, get and compact, parameterized by key
+// count, key length and value size, with and without --mmap reads.
+//
+// Results go to JSON for comparing commits with google-benchmark's
+// compare.py:
+//   database_bench --benchmark_out=before.json --benchmark_out_format=json
+//
+// Build: c++ -O2 database_bench.cpp -lbenchmark -lpthread -o database_bench
+
+// Makes count distinct keys of exactly len bytes.
+vector<string> benchKeys(size_t count, size_t len) {
+  vector<string> keys;
+  keys.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    string key = "user:" + to_string(i) + ":";
+    key.resize(max(len, key.size()), 'k');
+    keys.push_back(key);
+  }
+  return keys;
+}
+
+// A fresh log for one benchmark run, removed when it goes out of scope.
+struct BenchFile {
+  BenchFile() {
+    char path[] = "/tmp/database-bench-XXXXXX";
+    int fd = mkstemp(path);
+    ::close(fd);
+    ::unlink(path);
+    this->path = path;
+  }
+
+  ~BenchFile() { remove(this->path.c_str()); }
+
+  string path;
+};
+
+void databaseArgs(benchmark::internal::Benchmark *benchmark) {
+  benchmark->ArgNames({"keys", "key_len", "value_size", "mmap"})
+      ->ArgsProduct({{1000, 10000}, {16, 64}, {100, 1000}, {0, 1}});
+}
+
+void BM_DatabaseAdd(benchmark::State &state) {
+  BenchFile file;
+  Database db(state.range(3));
+  db.open(file.path);
+  vector<string> keys = benchKeys(state.range(0), state.range(1));
+  string value(state.range(2), 'v');
+
+  size_t next = 0;
+  for (auto _ : state) {
+    db.add(file.path, keys[next], value);
+    next = next + 1 == keys.size() ? 0 : next + 1;
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * (keys[0].size() + value.size()));
+}
+BENCHMARK(BM_DatabaseAdd)->Apply(databaseArgs);
+
+void BM_DatabaseGet(benchmark::State &state) {
+  BenchFile file;
+  Database db(state.range(3));
+  db.open(file.path);
+  vector<string> keys = benchKeys(state.range(0), state.range(1));
+  string value(state.range(2), 'v');
+  for (const string &key : keys) {
+    db.add(file.path, key, value);
+  }
+
+  // Random order, so the index lookups don't get cache locality for free.
+  vector<size_t> order(keys.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  shuffle(order.begin(), order.end(), mt19937_64(1));
+
+  size_t next = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(db.get(file.path, keys[order[next]]));
+    next = next + 1 == order.size() ? 0 : next + 1;
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * value.size());
+}
+BENCHMARK(BM_DatabaseGet)->Apply(databaseArgs);
+
+// Compacts a log where every key was written four times, so three quarters of
+// it is dead. Each iteration starts again from a copy of that log.
+void BM_DatabaseCompact(benchmark::State &state) {
+  BenchFile original;
+  {
+    Database db;
+    db.open(original.path);
+    vector<string> keys = benchKeys(state.range(0), state.range(1));
+    string value(state.range(2), 'v');
+    for (int round = 0; round < 4; round++) {
+      value[0] = 'a' + round;
+      for (const string &key : keys) {
+        db.add(original.path, key, value);
+      }
+    }
+  }
+  string contents = readFile(original.path);
+
+  BenchFile file;
+  for (auto _ : state) {
+    state.PauseTiming();
+    {
+      ofstream copy(file.path, ios::binary | ios::trunc);
+      copy << contents;
+    }
+    unique_ptr<Database> db(new Database(state.range(3)));
+    db->open(file.path);
+    state.ResumeTiming();
+
+    db->compact(file.path);
+
+    state.PauseTiming();
+    db.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0) * 4);
+  state.SetBytesProcessed(state.iterations() * contents.size());
+}
+BENCHMARK(BM_DatabaseCompact)->Apply(databaseArgs)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -1,161 +1,312 @@
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
-#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
 
+#include "../week7/log_record.h"
+
 using namespace std;
 
-// problems include escaping characters like spaces
-// if delete is the value of a key, then it's gonna get deleted
+// Logs are binary: an 8 byte file header, then records of
+// [crc]{4} [sequence]{8} [keyLength]{4} [valueLength]{4} [flags]{1} [key] [value]
+// where the CRC32C covers everything after itself. With the lengths up front a
+// read goes straight from the indexed offset to the value, and keys and values
+// can hold spaces and newlines. Logs from before were lines of "key value"
+// with deletes written as the value "deleted", open converts those. The
+// format, and the conversion, are the store server's, from log_record.h.
+
+string readFile(const string &filename) {
+  ifstream file(filename, ios::binary);
+  return string((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+}
+
+// Where a key's latest record is in its log.
+struct Location {
+  size_t offset;
+  size_t length;
+  bool deleted;
+};
+
+// A read-only mapping of a log file. The mapping is reserved larger than the
+// file so appends only force a remap once they outgrow it.
+struct Mapping {
+  int fd = -1;
+  char *data = nullptr;
+  size_t size = 0;
+  size_t capacity = 0;
+};
+
+const size_t MIN_MAPPING_SIZE = 1 << 20;
 
 class Database {
 public:
-  Database() {}
+  Database(bool useMmap = false) : useMmap(useMmap) {}
+
+  ~Database() {
+    for (auto &pair : this->mappings) {
+      unmap(pair.second);
+    }
+  }
 
   void open(const string &filename) {
     this->opened.insert(filename);
     if (this->hashindex.find(filename) == this->hashindex.end()) {
       ifstream file(filename);
       if (!file) {
-        ofstream createFile(filename);
+        ofstream createFile(filename, ios::binary);
         if (!createFile) {
           cerr << "Error: Unable to create file" << endl;
           return;
         }
+        createFile << LogFileHeader();
         createFile.close();
+      }
+      file.close();
 
-        file.open(filename);
-        if (!file) {
-          cerr << "Error: Unable to open file" << endl;
+      string contents = readFile(filename);
+      if (!IsLogFileHeader(contents.data(), contents.size())) {
+        uint64_t firstSequence = 0;
+        if (!ConvertTextLog(filename, filename + "_converted", &firstSequence) ||
+            rename((filename + "_converted").c_str(), filename.c_str()) != 0) {
+          cerr << "Error: Unable to convert text log" << endl;
           return;
         }
+        contents = readFile(filename);
       }
 
-      string line;
-      streampos position = 0;
-      while (getline(file, line)) {
-        istringstream lineStream(line);
-        string key, value;
-        if (lineStream >> key >> value) {
-          this->hashindex[filename][key] = position;
-        }
-        position = file.tellg();
+      auto &index = this->hashindex[filename];
+      uint64_t &sequence = this->nextSequence[filename];
+      size_t position = LOG_FILE_HEADER;
+      LogRecord record;
+      while (size_t length = ParseLogRecord(contents.data() + position,
+                                            contents.size() - position, &record)) {
+        index[string(record.key, record.keyLength)] = {
+            position, length, (record.flags & LOG_TOMBSTONE) != 0};
+        sequence = max(sequence, record.sequence + 1);
+        position += length;
       }
-      file.close();
+
+      // Anything after the last intact record was torn by a crash, the next
+      // add writes where it starts.
+      if (position < contents.size() && truncate(filename.c_str(), position) != 0) {
+        cerr << "Error: Unable to truncate torn record" << endl;
+      }
+    }
+
+    if (this->useMmap && this->mappings.find(filename) == this->mappings.end()) {
+      remap(filename);
     }
   }
 
   void add(const string &filename, const string &key, const string &value) {
+    append(filename, key, value, 0);
+  }
+
+  void deleteKey(const string &filename, const string &key) {
+    append(filename, key, "", LOG_TOMBSTONE);
+  }
+
+  string get(const string &filename, const string &key) {
     if (this->opened.find(filename) == this->opened.end()) {
       cerr << "Error: Open database first" << endl;
-      return;
+      return "";
+    }
+
+    auto &index = this->hashindex[filename];
+    auto entry = index.find(key);
+    if (entry == index.end() || entry->second.deleted) {
+      return "";
     }
 
-    fstream file(filename, ios::in | ios::out);
+    if (this->useMmap) {
+      return getMapped(filename, entry->second);
+    }
+
+    ifstream file(filename, ios::binary);
     if (!file) {
       cerr << "Error: File not found" << endl;
+      return "";
+    }
+
+    string buffer(entry->second.length, '\0');
+    file.seekg(entry->second.offset);
+    file.read(&buffer[0], buffer.size());
+
+    LogRecord record;
+    if (!file || ParseLogRecord(buffer.data(), buffer.size(), &record) == 0) {
+      cerr << "Error: Corrupt record" << endl;
+      return "";
+    }
+    return string(record.value, record.valueLength);
+  }
+
+  void close(const string &filename) {
+    this->hashindex[filename].clear();
+
+    auto mapping = this->mappings.find(filename);
+    if (mapping != this->mappings.end()) {
+      unmap(mapping->second);
+      this->mappings.erase(mapping);
+    }
+  }
+
+  void compact(const string &filename) {
+
+    if (this->opened.find(filename) == this->opened.end()) {
+      cerr << "Error: Open database first" << endl;
       return;
     }
 
-    file.seekg(0, ios::end);
-    this->hashindex[filename][key] = file.tellg();
-    file << key << " " << value << endl;
-    file.close();
+    string contents = readFile(filename);
+    unordered_map<string, Location> latest;
+    size_t position = LOG_FILE_HEADER;
+    LogRecord record;
+    while (size_t length = ParseLogRecord(contents.data() + position,
+                                          contents.size() - position, &record)) {
+      latest[string(record.key, record.keyLength)] = {
+          position, length, (record.flags & LOG_TOMBSTONE) != 0};
+      position += length;
+    }
+
+    ofstream new_file(filename + "_compacted", ios::binary);
+    new_file << LogFileHeader();
+
+    auto &index = this->hashindex[filename];
+    index.clear();
+    size_t offset = LOG_FILE_HEADER;
+    for (const auto &pair : latest) {
+      // Records keep their bytes, sequence number included.
+      if (pair.second.deleted) {
+        continue;
+      }
+      index[pair.first] = {offset, pair.second.length, false};
+      new_file.write(contents.data() + pair.second.offset, pair.second.length);
+      offset += pair.second.length;
+    }
+
+    new_file.close();
+    remove(filename.c_str());
+    rename((filename + "_compacted").c_str(), filename.c_str());
+
+    if (this->useMmap) {
+      remap(filename);
+    }
   }
 
-  void deleteKey(const string &filename, const string &key) {
+private:
+  void append(const string &filename, const string &key, const string &value,
+              uint8_t flags) {
     if (this->opened.find(filename) == this->opened.end()) {
       cerr << "Error: Open database first" << endl;
       return;
     }
 
-    fstream file(filename, ios::in | ios::out);
+    fstream file(filename, ios::in | ios::out | ios::binary);
     if (!file) {
       cerr << "Error: File not found" << endl;
       return;
     }
 
+    string record;
+    AppendLogRecord(&record, this->nextSequence[filename]++, flags, key, value);
     file.seekg(0, ios::end);
-    this->hashindex[filename][key] = file.tellg();
-    file << key << " deleted" << endl;
+    size_t offset = file.tellg();
+    file << record;
+    size_t end = file.tellp();
     file.close();
+
+    this->hashindex[filename][key] = {offset, record.size(),
+                                      (flags & LOG_TOMBSTONE) != 0};
+    growMapping(filename, end);
   }
 
-  string get(const string &filename, const string &key) {
-    if (this->opened.find(filename) == this->opened.end()) {
-      cerr << "Error: Open database first" << endl;
+  // Resolves the indexed offset straight to a pointer into the mapping.
+  string getMapped(const string &filename, const Location &location) {
+    const Mapping &mapping = this->mappings[filename];
+    if (location.offset + location.length > mapping.size) {
       return "";
     }
 
-    ifstream file(filename);
-    if (!file) {
-      cerr << "Error: File not found" << endl;
+    LogRecord record;
+    if (ParseLogRecord(mapping.data + location.offset, location.length,
+                       &record) == 0) {
+      cerr << "Error: Corrupt record" << endl;
       return "";
     }
+    return string(record.value, record.valueLength);
+  }
 
-    streampos position = this->hashindex[filename][key];
-    file.seekg(position);
-    string line;
+  // Remaps once the log has grown past the reserved mapping.
+  void growMapping(const string &filename, size_t end) {
+    auto mapping = this->mappings.find(filename);
+    if (mapping == this->mappings.end()) {
+      return;
+    }
 
-    getline(file, line);
-    istringstream lineStream(line);
-    string storedKey, value;
-    if (lineStream >> storedKey >> value) {
-      return value;
+    if (end > mapping->second.capacity) {
+      remap(filename);
+    } else {
+      mapping->second.size = end;
     }
-    file.close();
-    return "";
   }
 
-  void close(const string &filename) { this->hashindex[filename].clear(); }
-
-  void compact(const string &filename) {
-
-    if (this->opened.find(filename) == this->opened.end()) {
-      cerr << "Error: Open database first" << endl;
-      return;
+  void remap(const string &filename) {
+    auto existing = this->mappings.find(filename);
+    if (existing != this->mappings.end()) {
+      unmap(existing->second);
+      this->mappings.erase(existing);
     }
 
-    ifstream file(filename);
-    if (!file) {
-      cerr << "Error: File not found" << endl;
+    Mapping mapping;
+    mapping.fd = ::open(filename.c_str(), O_RDONLY);
+    if (mapping.fd < 0) {
+      cerr << "Error: Unable to map file" << endl;
       return;
     }
-    unordered_map<string, string> reduced;
 
-    string line;
-    while (getline(file, line)) {
-      istringstream lineStream(line);
-      string key, value;
-      if (lineStream >> key >> value) {
-        reduced[key] = value;
-      }
+    struct stat info;
+    fstat(mapping.fd, &info);
+    mapping.size = info.st_size;
+    mapping.capacity = max(MIN_MAPPING_SIZE, mapping.size * 2);
+
+    // Reads stop at size, the pages past the end of the file are only there
+    // so later appends become visible without another mmap call.
+    void *data = mmap(nullptr, mapping.capacity, PROT_READ, MAP_SHARED,
+                      mapping.fd, 0);
+    if (data == MAP_FAILED) {
+      cerr << "Error: Unable to map file" << endl;
+      ::close(mapping.fd);
+      return;
     }
-    file.close();
+    mapping.data = static_cast<char *>(data);
 
-    fstream new_file(filename + "_compacted", ios::out);
+    this->mappings[filename] = mapping;
+  }
 
-    for (const auto &pair : reduced) {
-      if (pair.second == "deleted") {
-        continue;
-      }
-      this->hashindex[filename][pair.first] = new_file.tellg();
-      new_file << pair.first << " " << pair.second << endl;
+  void unmap(Mapping &mapping) {
+    if (mapping.data) {
+      munmap(mapping.data, mapping.capacity);
+    }
+    if (mapping.fd >= 0) {
+      ::close(mapping.fd);
     }
-
-    new_file.close();
-    remove(filename.c_str());
-    rename((filename + "_compacted").c_str(), filename.c_str());
   }
 
-private:
+  bool useMmap;
   unordered_set<string> opened;
-  unordered_map<string, unordered_map<string, streampos>> hashindex;
+  unordered_map<string, unordered_map<string, Location>> hashindex;
+  unordered_map<string, uint64_t> nextSequence;
+  unordered_map<string, Mapping> mappings;
 };
 
-int main() {
-  Database db;
+int main(int argc, char **argv) {
+  Database db(argc > 1 && string(argv[1]) == "--mmap");
   int running = 1;
   string command;
   string dbFile;
@@ -186,4 +337,5 @@ int main() {
       db.compact(dbFile);
     }
   }
+  return 0;
 }
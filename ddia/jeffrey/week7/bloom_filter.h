@@ -0,0 +1,116 @@
+#ifndef BLOOM_FILTER_H_
+#define BLOOM_FILTER_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// A blocked Bloom filter. Every key sets all of its bits inside one 512-bit
+// block, so a lookup costs one cache line however many probes it takes, at
+// the price of a slightly higher false positive rate than a plain filter of
+// the same size (about 1.2% instead of 0.8% at 10 bits per key).
+//
+// Serialized it is the blocks followed by one byte holding the number of
+// probes. The hash is part of the format, filters are written to disk.
+class BloomFilter {
+    public: static const size_t BLOCK_BITS = 512;
+    static const size_t BLOCK_WORDS = BLOCK_BITS / 64;
+
+    // FNV-1a with a final mix, so every bit of the result depends on every
+    // byte of the key.
+    static uint64_t Hash(const char * data, size_t size) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ static_cast < uint8_t > (data[i])) * 0x100000001b3ULL;
+        }
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ULL;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    static uint64_t Hash(const std::string & key) {
+        return Hash(key.data(), key.size());
+    }
+
+    // Serializes a filter holding the keys with these hashes.
+    static std::string Build(const std::vector < uint64_t > & hashes, int bitsPerKey) {
+        size_t blocks = std::max < size_t > (1, (hashes.size() * bitsPerKey + BLOCK_BITS - 1) / BLOCK_BITS);
+        int probes = std::min(30, std::max(1, static_cast < int > (std::lround(bitsPerKey * 0.69))));
+
+        std::vector < uint64_t > words(blocks * BLOCK_WORDS, 0);
+        for (uint64_t hash: hashes) {
+            uint64_t * block = & words[BlockFor(hash, blocks) * BLOCK_WORDS];
+            uint32_t bit = static_cast < uint32_t > (hash);
+            uint32_t delta = Delta(hash);
+            for (int i = 0; i < probes; ++i) {
+                block[(bit % BLOCK_BITS) / 64] |= 1ULL << (bit % 64);
+                bit += delta;
+            }
+        }
+
+        std::string data(reinterpret_cast < const char * > (words.data()), words.size() * sizeof(uint64_t));
+        data.push_back(static_cast < char > (probes));
+        return data;
+    }
+
+    // An empty filter, which matches every key.
+    BloomFilter() {}
+
+    // Loads a serialized filter. One that doesn't parse matches every key.
+    explicit BloomFilter(const std::string & data) {
+        if (data.size() < BLOCK_WORDS * sizeof(uint64_t) + 1 ||
+            (data.size() - 1) % (BLOCK_WORDS * sizeof(uint64_t)) != 0) {
+            return;
+        }
+        this -> words.resize((data.size() - 1) / sizeof(uint64_t));
+        memcpy(this -> words.data(), data.data(), data.size() - 1);
+        this -> probes = static_cast < uint8_t > (data.back());
+    }
+
+    bool Empty() const {
+        return this -> words.empty();
+    }
+
+    // False only if the key was certainly not added.
+    bool MayContain(uint64_t hash) const {
+        if (this -> words.empty()) {
+            return true;
+        }
+        const uint64_t * block = & this -> words[BlockFor(hash, this -> words.size() / BLOCK_WORDS) * BLOCK_WORDS];
+        uint32_t bit = static_cast < uint32_t > (hash);
+        uint32_t delta = Delta(hash);
+        for (int i = 0; i < this -> probes; ++i) {
+            if (!(block[(bit % BLOCK_BITS) / 64] & (1ULL << (bit % 64)))) {
+                return false;
+            }
+            bit += delta;
+        }
+        return true;
+    }
+
+    size_t Bytes() const {
+        return this -> words.size() * sizeof(uint64_t);
+    }
+
+    private:
+    // Maps the top half of the hash onto [0, blocks) without a division.
+    static size_t BlockFor(uint64_t hash, size_t blocks) {
+        return static_cast < size_t > (((hash >> 32) * blocks) >> 32);
+    }
+
+    // Double hashing: each probe steps by this from the low half of the hash.
+    static uint32_t Delta(uint64_t hash) {
+        return static_cast < uint32_t > ((hash >> 17) | (hash << 47)) | 1;
+    }
+
+    std::vector < uint64_t > words;
+    int probes = 0;
+};
+
+#endif // BLOOM_FILTER_H_
@@ -0,0 +1,440 @@
+#ifndef IO_BACKEND_H_
+#define IO_BACKEND_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// How the log touches its segments on the request path: reads of records
+// the index points at, appends from the log writer and the fdatasyncs that
+// make them durable. Scans at open, hints and compaction stay on plain
+// pread/pwrite, they run in the background and read or write in big chunks.
+
+// One read of a batch, length bytes at offset in fd.
+struct IoRead {
+    int fd;
+    off_t offset;
+    size_t length;
+};
+
+// Called once for each read of a batch with the index of the read and its
+// bytes, or nullptr if it failed or came up short. The bytes are only valid
+// during the call.
+typedef std::function < void(size_t index, const char * data) > ReadDone;
+
+class IoBackend {
+    public: virtual ~IoBackend() {}
+
+    // Reads everything in reads, with as many in flight at once as the
+    // backend allows, calling done for each in no particular order.
+    virtual void ReadAll(const std::vector < IoRead > & reads, const ReadDone & done) = 0;
+
+    // Writes all of data at offset, then fdatasyncs if sync is set.
+    virtual bool Write(int fd, const char * data, size_t length, off_t offset, bool sync) = 0;
+
+    virtual bool Sync(int fd) = 0;
+};
+
+// One blocking system call per read, write and sync.
+class BlockingIo final: public IoBackend {
+    public: void ReadAll(const std::vector < IoRead > & reads, const ReadDone & done) override {
+        // Each thread reads into its own buffer at an explicit offset, so
+        // concurrent readers never share a seek position.
+        thread_local std::string buffer;
+        for (size_t i = 0; i < reads.size(); ++i) {
+            buffer.resize(reads[i].length);
+            ssize_t bytesRead = pread(reads[i].fd, & buffer[0], reads[i].length, reads[i].offset);
+            done(i, bytesRead == static_cast < ssize_t > (reads[i].length) ? buffer.data() : nullptr);
+        }
+    }
+
+    bool Write(int fd, const char * data, size_t length, off_t offset, bool sync) override {
+        size_t written = 0;
+        while (written < length) {
+            ssize_t result = pwrite(fd, data + written, length - written, offset + written);
+            if (result <= 0) {
+                return false;
+            }
+            written += result;
+        }
+        return !sync || this -> Sync(fd);
+    }
+
+    bool Sync(int fd) override {
+        return fdatasync(fd) == 0;
+    }
+};
+
+// A synced append is a linked write and fdatasync, two entries that have to
+// be submitted together.
+const unsigned URING_MIN_DEPTH = 2;
+
+// Reads that fit a slot go into the ring's registered buffers.
+const size_t URING_SLOT_BYTES = 16 << 10;
+// The kernel takes at most this much in one read or write.
+const size_t URING_MAX_IO_BYTES = 1 << 30;
+
+// An io_uring instance driven straight through the system calls. Submission
+// and completion rings are shared with the kernel, so the heads and tails
+// the other side moves are read with acquire and ours published with
+// release. Not thread safe, every thread gets its own.
+//
+// It owns depth slots of URING_SLOT_BYTES, registered with the kernel when
+// it allows so reads into them skip mapping the pages on every call.
+class UringRing {
+    public: static std::unique_ptr < UringRing > Create(unsigned depth) {
+        std::unique_ptr < UringRing > ring(new UringRing());
+        io_uring_params params;
+        memset( & params, 0, sizeof(params));
+        ring -> fd = syscall(__NR_io_uring_setup, depth, & params);
+        // IORING_OP_READ and IORING_OP_WRITE came with this feature, in 5.6.
+        if (ring -> fd < 0 || !(params.features & IORING_FEAT_RW_CUR_POS) || !ring -> Map(params)) {
+            return nullptr;
+        }
+        ring -> depth = params.sq_entries;
+
+        ring -> slotsBytes = static_cast < size_t > (ring -> depth) * URING_SLOT_BYTES;
+        void * slots = mmap(nullptr, ring -> slotsBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slots == MAP_FAILED) {
+            return nullptr;
+        }
+        ring -> slots = static_cast < char * > (slots);
+        std::vector < iovec > buffers(ring -> depth);
+        for (unsigned i = 0; i < ring -> depth; ++i) {
+            buffers[i] = {
+                ring -> Slot(i),
+                URING_SLOT_BYTES
+            };
+        }
+        // Fails under a tight RLIMIT_MEMLOCK, the slots then take plain reads.
+        ring -> fixedBuffers = syscall(__NR_io_uring_register, ring -> fd, IORING_REGISTER_BUFFERS,
+            buffers.data(), ring -> depth) == 0;
+        return ring;
+    }
+
+    ~UringRing() {
+        if (this -> slots) {
+            munmap(this -> slots, this -> slotsBytes);
+        }
+        if (this -> sqes) {
+            munmap(this -> sqes, this -> sqesBytes);
+        }
+        if (this -> cqRing && this -> cqRing != this -> sqRing) {
+            munmap(this -> cqRing, this -> cqRingBytes);
+        }
+        if (this -> sqRing) {
+            munmap(this -> sqRing, this -> sqRingBytes);
+        }
+        if (this -> fd >= 0) {
+            close(this -> fd);
+        }
+    }
+
+    // Queues one operation. Never more than depth may be queued before
+    // their completions are reaped; once depth are waiting to be submitted
+    // the submission ring is full, and this returns false without queueing.
+    bool Prepare(uint8_t opcode, int fd, const void * address, size_t length, off_t offset,
+        uint64_t userData, uint8_t flags = 0, uint16_t bufferIndex = 0) {
+        if (this -> unsubmitted >= this -> depth) {
+            return false;
+        }
+        unsigned tail = * this -> sqTail;
+        unsigned index = tail & * this -> sqMask;
+        io_uring_sqe * sqe = & this -> sqes[index];
+        memset(sqe, 0, sizeof( * sqe));
+        sqe -> opcode = opcode;
+        sqe -> flags = flags;
+        sqe -> fd = fd;
+        sqe -> addr = reinterpret_cast < uint64_t > (address);
+        sqe -> len = static_cast < uint32_t > (length);
+        sqe -> off = offset;
+        sqe -> buf_index = bufferIndex;
+        sqe -> user_data = userData;
+        if (opcode == IORING_OP_FSYNC) {
+            sqe -> fsync_flags = IORING_FSYNC_DATASYNC;
+        }
+        this -> sqArray[index] = index;
+        __atomic_store_n(this -> sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++this -> unsubmitted;
+        return true;
+    }
+
+    // Submits what was prepared and calls done with the user data and result
+    // of count completions, waiting for them as needed.
+    bool Complete(unsigned count, const std::function < void(uint64_t userData, int result) > & done) {
+        while (count > 0) {
+            unsigned head = * this -> cqHead;
+            unsigned tail = __atomic_load_n(this -> cqTail, __ATOMIC_ACQUIRE);
+            for (; head != tail && count > 0; ++head, --count) {
+                const io_uring_cqe & cqe = this -> cqes[head & * this -> cqMask];
+                done(cqe.user_data, cqe.res);
+            }
+            __atomic_store_n(this -> cqHead, head, __ATOMIC_RELEASE);
+            if (count > 0 && !this -> Enter(count)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    char * Slot(unsigned index) {
+        return this -> slots + static_cast < size_t > (index) * URING_SLOT_BYTES;
+    }
+
+    unsigned depth = 0;
+    bool fixedBuffers = false;
+
+    private: UringRing() {}
+
+    bool Map(const io_uring_params & params) {
+        this -> sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        this -> cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) {
+            this -> sqRingBytes = this -> cqRingBytes = std::max(this -> sqRingBytes, this -> cqRingBytes);
+        }
+
+        void * sq = mmap(nullptr, this -> sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            this -> fd, IORING_OFF_SQ_RING);
+        if (sq == MAP_FAILED) {
+            return false;
+        }
+        this -> sqRing = static_cast < char * > (sq);
+        if (single) {
+            this -> cqRing = this -> sqRing;
+        } else {
+            void * cq = mmap(nullptr, this -> cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                this -> fd, IORING_OFF_CQ_RING);
+            if (cq == MAP_FAILED) {
+                return false;
+            }
+            this -> cqRing = static_cast < char * > (cq);
+        }
+        this -> sqesBytes = params.sq_entries * sizeof(io_uring_sqe);
+        void * sqes = mmap(nullptr, this -> sqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            this -> fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+        this -> sqes = static_cast < io_uring_sqe * > (sqes);
+
+        this -> sqTail = reinterpret_cast < unsigned * > (this -> sqRing + params.sq_off.tail);
+        this -> sqMask = reinterpret_cast < unsigned * > (this -> sqRing + params.sq_off.ring_mask);
+        this -> sqArray = reinterpret_cast < unsigned * > (this -> sqRing + params.sq_off.array);
+        this -> cqHead = reinterpret_cast < unsigned * > (this -> cqRing + params.cq_off.head);
+        this -> cqTail = reinterpret_cast < unsigned * > (this -> cqRing + params.cq_off.tail);
+        this -> cqMask = reinterpret_cast < unsigned * > (this -> cqRing + params.cq_off.ring_mask);
+        this -> cqes = reinterpret_cast < io_uring_cqe * > (this -> cqRing + params.cq_off.cqes);
+        return true;
+    }
+
+    // Hands the kernel whatever is unsubmitted and waits until at least
+    // count completions are waiting.
+    bool Enter(unsigned count) {
+        while (true) {
+            int submitted = syscall(__NR_io_uring_enter, this -> fd, this -> unsubmitted, count,
+                IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (submitted >= 0) {
+                this -> unsubmitted -= submitted;
+                if (this -> unsubmitted == 0) {
+                    return true;
+                }
+            } else if (errno != EINTR) {
+                return false;
+            }
+        }
+    }
+
+    int fd = -1;
+    unsigned unsubmitted = 0;
+
+    char * sqRing = nullptr;
+    size_t sqRingBytes = 0;
+    char * cqRing = nullptr;
+    size_t cqRingBytes = 0;
+    io_uring_sqe * sqes = nullptr;
+    size_t sqesBytes = 0;
+    char * slots = nullptr;
+    size_t slotsBytes = 0;
+
+    unsigned * sqTail = nullptr;
+    unsigned * sqMask = nullptr;
+    unsigned * sqArray = nullptr;
+    unsigned * cqHead = nullptr;
+    unsigned * cqTail = nullptr;
+    unsigned * cqMask = nullptr;
+    io_uring_cqe * cqes = nullptr;
+};
+
+// Reads of a batch go to the kernel up to depth at a time with one system
+// call, into registered buffers when they fit. An append is a write linked
+// to an fdatasync, so both cost one submission and the sync only runs once
+// the write has landed; that takes a depth of at least URING_MIN_DEPTH.
+// Threads without a ring of their own, because the kernel refused one, fall
+// back to blocking calls, and so do appends on a ring too shallow for them.
+class UringIo final: public IoBackend {
+    public: explicit UringIo(unsigned depth): depth(depth) {}
+
+    // Whether this kernel, and whatever sandbox we run in, can set up a ring.
+    static bool Available(unsigned depth) {
+        return UringRing::Create(depth) != nullptr;
+    }
+
+    void ReadAll(const std::vector < IoRead > & reads, const ReadDone & done) override {
+        UringRing * ring = this -> Ring();
+        if (!ring) {
+            this -> blocking.ReadAll(reads, done);
+            return;
+        }
+
+        thread_local std::vector < std::string > large;
+        for (size_t start = 0; start < reads.size(); start += ring -> depth) {
+            size_t count = std::min < size_t > (ring -> depth, reads.size() - start);
+            large.resize(std::max(large.size(), count));
+            for (size_t i = 0; i < count; ++i) {
+                const IoRead & read = reads[start + i];
+                if (read.length <= URING_SLOT_BYTES) {
+                    if (ring -> fixedBuffers) {
+                        ring -> Prepare(IORING_OP_READ_FIXED, read.fd, ring -> Slot(i), read.length, read.offset, i, 0, i);
+                    } else {
+                        ring -> Prepare(IORING_OP_READ, read.fd, ring -> Slot(i), read.length, read.offset, i);
+                    }
+                } else {
+                    large[i].resize(std::min(read.length, URING_MAX_IO_BYTES));
+                    ring -> Prepare(IORING_OP_READ, read.fd, & large[i][0], large[i].size(), read.offset, i);
+                }
+            }
+
+            std::vector < bool > finished(count);
+            bool ok = ring -> Complete(count, [ & ](uint64_t i, int result) {
+                const IoRead & read = reads[start + i];
+                bool whole = result >= 0 && static_cast < size_t > (result) == read.length;
+                const char * data = read.length <= URING_SLOT_BYTES ? ring -> Slot(i) : large[i].data();
+                finished[i] = true;
+                done(start + i, whole ? data : nullptr);
+            });
+            if (!ok) {
+                // The ring is in an unknown state, give it up and read
+                // whatever hasn't finished the blocking way.
+                this -> DropRing();
+                std::vector < IoRead > rest;
+                std::vector < size_t > indexes;
+                for (size_t i = start; i < reads.size(); ++i) {
+                    if (i >= start + count || !finished[i - start]) {
+                        rest.push_back(reads[i]);
+                        indexes.push_back(i);
+                    }
+                }
+                this -> blocking.ReadAll(rest, [ & ](size_t index, const char * data) {
+                    done(indexes[index], data);
+                });
+                return;
+            }
+        }
+    }
+
+    bool Write(int fd, const char * data, size_t length, off_t offset, bool sync) override {
+        UringRing * ring = this -> Ring();
+        if (!ring || ring -> depth < URING_MIN_DEPTH) {
+            return this -> blocking.Write(fd, data, length, offset, sync);
+        }
+
+        size_t written = 0;
+        bool synced = !sync;
+        while (written < length || !synced) {
+            size_t chunk = std::min(length - written, URING_MAX_IO_BYTES);
+            bool last = written + chunk == length;
+            unsigned count = 0;
+            if (chunk > 0) {
+                // A short write fails the linked sync with -ECANCELED, the
+                // next round writes the rest and tries the sync again.
+                ring -> Prepare(IORING_OP_WRITE, fd, data + written, chunk, offset + written, 0,
+                    last && sync ? IOSQE_IO_LINK : 0);
+                ++count;
+            }
+            if (last && sync) {
+                ring -> Prepare(IORING_OP_FSYNC, fd, nullptr, 0, 0, 1);
+                ++count;
+            }
+
+            bool failed = false;
+            bool ok = ring -> Complete(count, [ & ](uint64_t userData, int result) {
+                if (userData == 0) {
+                    failed = failed || result <= 0;
+                    written += result > 0 ? result : 0;
+                } else if (result == 0) {
+                    synced = true;
+                } else if (result != -ECANCELED) {
+                    failed = true;
+                }
+            });
+            if (!ok) {
+                this -> DropRing();
+                return false;
+            }
+            if (failed) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool Sync(int fd) override {
+        UringRing * ring = this -> Ring();
+        if (!ring) {
+            return this -> blocking.Sync(fd);
+        }
+        ring -> Prepare(IORING_OP_FSYNC, fd, nullptr, 0, 0, 0);
+        int synced = -1;
+        if (!ring -> Complete(1, [ & ](uint64_t, int result) {
+                synced = result;
+            })) {
+            this -> DropRing();
+            return false;
+        }
+        return synced == 0;
+    }
+
+    private: struct ThreadRing {
+        std::unique_ptr < UringRing > ring;
+        // Setting up failed once, don't try again on every call.
+        bool refused = false;
+    };
+
+    UringRing * Ring() {
+        ThreadRing & thread = ThreadRingState();
+        if (!thread.ring && !thread.refused) {
+            thread.ring = UringRing::Create(this -> depth);
+            thread.refused = !thread.ring;
+        }
+        return thread.ring.get();
+    }
+
+    void DropRing() {
+        ThreadRing & thread = ThreadRingState();
+        thread.ring.reset();
+        thread.refused = true;
+    }
+
+    // There is only ever one backend, so the rings can be per thread rather
+    // than per thread and backend.
+    static ThreadRing & ThreadRingState() {
+        thread_local ThreadRing thread;
+        return thread;
+    }
+
+    const unsigned depth;
+    BlockingIo blocking;
+};
+
+#endif
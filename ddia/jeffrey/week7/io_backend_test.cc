@@ -0,0 +1,101 @@
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "io_backend.h"
+
+// Checks that appends through the io_uring backend land and sync at the
+// smallest ring depths. A synced append needs its write and fdatasync in the
+// ring together, so depth 1 has to fall back to blocking calls rather than
+// lose the write, and depth 2 has to fit both.
+//
+// Exits 1 if any check fails, 0 otherwise, also when the kernel won't set up
+// a ring at all.
+
+static int failures = 0;
+
+static void Check(bool ok, const std::string & what) {
+    if (!ok) {
+        std::cerr << "FAIL: " << what << std::endl;
+        ++failures;
+    }
+}
+
+static std::string ReadBack(int fd, size_t length, off_t offset) {
+    std::string data(length, '\0');
+    ssize_t read = pread(fd, & data[0], length, offset);
+    data.resize(read > 0 ? read : 0);
+    return data;
+}
+
+static void CheckDepth(unsigned depth, const std::string & directory) {
+    std::string label = "depth " + std::to_string(depth);
+    std::string path = directory + "/segment-" + std::to_string(depth);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        Check(false, label + ": open " + path);
+        return;
+    }
+
+    UringIo io(depth);
+    std::string first(100, 'a');
+    std::string second(URING_SLOT_BYTES + 1, 'b');
+    std::string third = "unsynced";
+    Check(io.Write(fd, first.data(), first.size(), 0, true), label + ": synced write");
+    Check(io.Write(fd, second.data(), second.size(), first.size(), true), label + ": large synced write");
+    Check(io.Write(fd, third.data(), third.size(), first.size() + second.size(), false), label + ": write");
+    Check(io.Sync(fd), label + ": sync");
+
+    Check(ReadBack(fd, first.size(), 0) == first, label + ": first record on disk");
+    Check(ReadBack(fd, second.size(), first.size()) == second, label + ": second record on disk");
+    Check(ReadBack(fd, third.size(), first.size() + second.size()) == third, label + ": third record on disk");
+
+    std::vector < IoRead > reads = {
+        {fd, 0, first.size()},
+        {fd, static_cast < off_t > (first.size()), second.size()},
+        {fd, static_cast < off_t > (first.size() + second.size()), third.size()}
+    };
+    const std::string * expected[] = {& first, & second, & third};
+    std::vector < bool > seen(reads.size());
+    io.ReadAll(reads, [ & ](size_t index, const char * data) {
+        seen[index] = true;
+        Check(data && std::string(data, reads[index].length) == * expected[index],
+            label + ": read " + std::to_string(index));
+    });
+    for (size_t i = 0; i < seen.size(); ++i) {
+        Check(seen[i], label + ": read " + std::to_string(i) + " finished");
+    }
+
+    close(fd);
+    unlink(path.c_str());
+}
+
+int main() {
+    if (!UringIo::Available(URING_MIN_DEPTH)) {
+        std::cout << "io_uring is not available here, nothing to check" << std::endl;
+        return 0;
+    }
+
+    char directory[] = "/tmp/io_backend_test.XXXXXX";
+    if (!mkdtemp(directory)) {
+        std::cerr << "can't make a temporary directory" << std::endl;
+        return 1;
+    }
+    // Each depth runs on a thread of its own, rings are per thread.
+    for (unsigned depth: {1u, 2u, 64u}) {
+        std::thread checker(CheckDepth, depth, std::string(directory));
+        checker.join();
+    }
+    rmdir(directory);
+
+    if (failures > 0) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "io_backend_test: all checks passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,137 @@
+#ifndef LATENCY_HISTOGRAM_H_
+#define LATENCY_HISTOGRAM_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Latencies in microseconds, bucketed like an HDR histogram: exact below
+// HISTOGRAM_SUB_BUCKETS, then every power of two split into half that many
+// linear buckets, so any value is off by less than 1%. That keeps a recorder
+// at 26KB, small enough for the server to have one per thread per method.
+const int HISTOGRAM_SUB_BUCKET_BITS = 8;
+const uint64_t HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+const uint64_t HISTOGRAM_HALF_BUCKETS = HISTOGRAM_SUB_BUCKETS / 2;
+// Up to 2^32 us, about 71 minutes. Anything slower counts as that.
+const int HISTOGRAM_MAX_BITS = 32;
+const size_t HISTOGRAM_BUCKETS = HISTOGRAM_SUB_BUCKETS +
+    (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS) * HISTOGRAM_HALF_BUCKETS;
+
+inline size_t HistogramBucket(uint64_t value) {
+    value = std::min < uint64_t > (value, (1ULL << HISTOGRAM_MAX_BITS) - 1);
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - (HISTOGRAM_SUB_BUCKET_BITS - 1);
+    return HISTOGRAM_SUB_BUCKETS + (shift - 1) * HISTOGRAM_HALF_BUCKETS +
+        ((value >> shift) - HISTOGRAM_HALF_BUCKETS);
+}
+
+// The largest value that lands in bucket.
+inline uint64_t HistogramValue(size_t bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    size_t shift = (bucket - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_HALF_BUCKETS + 1;
+    uint64_t top = (bucket - HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_HALF_BUCKETS + HISTOGRAM_HALF_BUCKETS;
+    return ((top + 1) << shift) - 1;
+}
+
+// Counts merged from recorders, owned by one thread.
+struct Histogram {
+    Histogram(): counts(HISTOGRAM_BUCKETS, 0) {}
+
+    uint64_t Percentile(double percentile) const {
+        uint64_t rank = std::max < uint64_t > (1, std::ceil(percentile / 100 * this -> total));
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+            seen += this -> counts[bucket];
+            if (seen >= rank) {
+                return HistogramValue(bucket);
+            }
+        }
+        return 0;
+    }
+
+    double Mean() const {
+        return this -> total == 0 ? 0 : static_cast < double > (this -> sum) / this -> total;
+    }
+
+    void Add(const Histogram & other) {
+        for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+            this -> counts[bucket] += other.counts[bucket];
+        }
+        this -> total += other.total;
+        this -> sum += other.sum;
+        this -> errors += other.errors;
+    }
+
+    std::vector < uint64_t > counts;
+    uint64_t total = 0;
+    // Of the recorded values, for the mean.
+    uint64_t sum = 0;
+    uint64_t errors = 0;
+};
+
+// Where one thread records one operation's latencies. Counts are atomics
+// bumped by that thread and read or drained by another, neither ever waits.
+class HistogramRecorder {
+    public: HistogramRecorder(): counts(new std::atomic < uint64_t > [HISTOGRAM_BUCKETS]) {
+        for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+            this -> counts[bucket].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void Record(uint64_t micros, bool ok) {
+        size_t bucket = HistogramBucket(micros);
+        this -> counts[bucket].fetch_add(1, std::memory_order_relaxed);
+        this -> sum.fetch_add(micros, std::memory_order_relaxed);
+        if (bucket > this -> highest.load(std::memory_order_relaxed)) {
+            this -> highest.store(bucket, std::memory_order_relaxed);
+        }
+        if (!ok) {
+            this -> errors.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Moves everything recorded since the last drain into histogram. Only
+    // the buckets up to the highest one ever used need looking at.
+    void Drain(Histogram * histogram) {
+        size_t highest = this -> highest.load(std::memory_order_relaxed);
+        for (size_t bucket = 0; bucket <= highest; ++bucket) {
+            uint64_t count = this -> counts[bucket].exchange(0, std::memory_order_relaxed);
+            histogram -> counts[bucket] += count;
+            histogram -> total += count;
+        }
+        histogram -> sum += this -> sum.exchange(0, std::memory_order_relaxed);
+        histogram -> errors += this -> errors.exchange(0, std::memory_order_relaxed);
+    }
+
+    // Adds everything recorded so far to histogram, leaving it recorded.
+    void Read(Histogram * histogram) const {
+        size_t highest = this -> highest.load(std::memory_order_relaxed);
+        for (size_t bucket = 0; bucket <= highest; ++bucket) {
+            uint64_t count = this -> counts[bucket].load(std::memory_order_relaxed);
+            histogram -> counts[bucket] += count;
+            histogram -> total += count;
+        }
+        histogram -> sum += this -> sum.load(std::memory_order_relaxed);
+        histogram -> errors += this -> errors.load(std::memory_order_relaxed);
+    }
+
+    private: std::unique_ptr < std::atomic < uint64_t > [] > counts;
+    std::atomic < size_t > highest {
+        0
+    };
+    std::atomic < uint64_t > sum {
+        0
+    };
+    std::atomic < uint64_t > errors {
+        0
+    };
+};
+
+#endif // LATENCY_HISTOGRAM_H_
@@ -0,0 +1,221 @@
+#ifndef LOG_RECORD_H_
+#define LOG_RECORD_H_
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// The on-disk format of a log segment. A segment starts with a file header,
+// [magic]{4} [version]{4}, followed by records:
+//
+// [crc]{4} [sequence]{8} [keyLength]{4} [valueLength]{4} [flags]{1} [key] [value]
+//
+// The CRC32C covers everything after itself. Lengths come first so a reader
+// that knows where a record starts finds the value at
+// LOG_RECORD_HEADER + keyLength without looking for separators, and recovery
+// steps from one record to the next the same way. Sequence numbers grow by
+// one per record for the life of the log and survive compaction.
+//
+// Logs written before this format were lines of "key value", with deletes
+// written as the value "deleted". ConvertTextLog turns one into a segment.
+
+const uint32_t LOG_MAGIC = 0x474f4c4a;
+const uint32_t LOG_VERSION = 1;
+const size_t LOG_FILE_HEADER = 8;
+const size_t LOG_RECORD_HEADER = 21;
+
+// The record is a delete, it has no value.
+const uint8_t LOG_TOMBSTONE = 1;
+// More records of the same write follow. Recovery drops a write whose last
+// record never made it to disk, so a WriteBatch is all or nothing.
+const uint8_t LOG_CONTINUED = 2;
+
+struct LogRecord {
+    uint64_t sequence;
+    uint8_t flags;
+    // Both point into the parsed buffer.
+    const char * key;
+    uint32_t keyLength;
+    const char * value;
+    uint32_t valueLength;
+};
+
+// Slicing-by-8 tables for CRC32C (Castagnoli): slices[k][b] is the CRC of
+// byte b followed by k zero bytes.
+struct Crc32cTables {
+    Crc32cTables() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                value = (value >> 1) ^ (value & 1 ? 0x82f63b78 : 0);
+            }
+            this -> slices[0][i] = value;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int slice = 1; slice < 8; ++slice) {
+                uint32_t previous = this -> slices[slice - 1][i];
+                this -> slices[slice][i] = (previous >> 8) ^ this -> slices[0][previous & 0xff];
+            }
+        }
+    }
+
+    uint32_t slices[8][256];
+};
+
+// Eight independent table lookups per 8 bytes rather than a chain of eight
+// dependent ones.
+inline uint32_t Crc32cSoftware(const char * data, size_t size, uint32_t crc) {
+    static const Crc32cTables tables;
+    const auto & slices = tables.slices;
+    const uint8_t * next = reinterpret_cast < const uint8_t * > (data);
+    crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (size >= 8) {
+        uint64_t word;
+        memcpy( & word, next, 8);
+        word ^= crc;
+        crc = slices[7][word & 0xff] ^ slices[6][(word >> 8) & 0xff] ^
+            slices[5][(word >> 16) & 0xff] ^ slices[4][(word >> 24) & 0xff] ^
+            slices[3][(word >> 32) & 0xff] ^ slices[2][(word >> 40) & 0xff] ^
+            slices[1][(word >> 48) & 0xff] ^ slices[0][word >> 56];
+        next += 8;
+        size -= 8;
+    }
+#endif
+    while (size > 0) {
+        crc = slices[0][(crc ^ * next++) & 0xff] ^ (crc >> 8);
+        --size;
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+// The SSE4.2 crc32 instruction, 8 bytes at a time.
+__attribute__((target("sse4.2"))) inline uint32_t Crc32cHardware(const char * data, size_t size, uint32_t crc) {
+    uint64_t value = ~crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy( & word, data, 8);
+        value = _mm_crc32_u64(value, word);
+        data += 8;
+        size -= 8;
+    }
+    uint32_t tail = value;
+    while (size > 0) {
+        tail = _mm_crc32_u8(tail, static_cast < uint8_t > ( * data++));
+        --size;
+    }
+    return ~tail;
+}
+#endif
+
+// CRC32C (Castagnoli) of `size` bytes, continuing from `crc`. Every read and
+// every replayed record checks one, so it takes the crc32 instruction where
+// the CPU has it and slicing-by-8 elsewhere.
+inline uint32_t Crc32c(const char * data, size_t size, uint32_t crc = 0) {
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) {
+        return Crc32cHardware(data, size, crc);
+    }
+#endif
+    return Crc32cSoftware(data, size, crc);
+}
+
+inline std::string LogFileHeader() {
+    std::string header(LOG_FILE_HEADER, '\0');
+    memcpy( & header[0], & LOG_MAGIC, 4);
+    memcpy( & header[4], & LOG_VERSION, 4);
+    return header;
+}
+
+// Whether `data` starts with a file header of the current version.
+inline bool IsLogFileHeader(const char * data, size_t size) {
+    uint32_t magic, version;
+    if (size < LOG_FILE_HEADER) {
+        return false;
+    }
+    memcpy( & magic, data, 4);
+    memcpy( & version, data + 4, 4);
+    return magic == LOG_MAGIC && version == LOG_VERSION;
+}
+
+// Appends one record to `out` and returns its size.
+inline size_t AppendLogRecord(std::string * out, uint64_t sequence, uint8_t flags,
+    const std::string & key,
+        const std::string & value) {
+    uint32_t keyLength = key.size();
+    uint32_t valueLength = flags & LOG_TOMBSTONE ? 0 : value.size();
+    size_t start = out -> size();
+    out -> resize(start + LOG_RECORD_HEADER);
+    char * header = & ( * out)[start];
+    memcpy(header + 4, & sequence, 8);
+    memcpy(header + 12, & keyLength, 4);
+    memcpy(header + 16, & valueLength, 4);
+    header[20] = flags;
+    out -> append(key);
+    out -> append(value, 0, valueLength);
+    uint32_t crc = Crc32c(out -> data() + start + 4, out -> size() - start - 4);
+    memcpy( & ( * out)[start], & crc, 4);
+    return out -> size() - start;
+}
+
+// Parses the record at the start of `data`. Returns its total size, or 0 if
+// `size` bytes don't hold a whole record or its checksum doesn't match.
+inline size_t ParseLogRecord(const char * data, size_t size, LogRecord * record) {
+    if (size < LOG_RECORD_HEADER) {
+        return 0;
+    }
+    uint32_t crc;
+    memcpy( & crc, data, 4);
+    memcpy( & record -> sequence, data + 4, 8);
+    memcpy( & record -> keyLength, data + 12, 4);
+    memcpy( & record -> valueLength, data + 16, 4);
+    record -> flags = data[20];
+    size_t total = LOG_RECORD_HEADER + static_cast < size_t > (record -> keyLength) + record -> valueLength;
+    if (total > size || Crc32c(data + 4, total - 4) != crc) {
+        return 0;
+    }
+    record -> key = data + LOG_RECORD_HEADER;
+    record -> value = record -> key + record -> keyLength;
+    return total;
+}
+
+// Rewrites a text log as a segment at `to`, numbering the records from
+// `sequence` on and leaving the next free number there. Lines without a
+// space, like a torn last line, are skipped as the text format always did.
+inline bool ConvertTextLog(const std::string & from,
+    const std::string & to,
+        uint64_t * sequence) {
+    std::ifstream input(from);
+    std::ofstream output(to, std::ios::binary | std::ios::trunc);
+    if (!input || !output) {
+        return false;
+    }
+
+    std::string buffer = LogFileHeader();
+    std::string line;
+    while (std::getline(input, line)) {
+        size_t space = line.find(' ');
+        if (space == std::string::npos || space == 0) {
+            continue;
+        }
+        std::string value = line.substr(space + 1);
+        AppendLogRecord( & buffer, ( * sequence) ++, value == "deleted" ? LOG_TOMBSTONE : 0,
+            line.substr(0, space), value);
+        if (buffer.size() >= 1 << 20) {
+            output.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+    output.write(buffer.data(), buffer.size());
+    output.flush();
+    return static_cast < bool > (output);
+}
+
+#endif // LOG_RECORD_H_
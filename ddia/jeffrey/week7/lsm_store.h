@@ -0,0 +1,1398 @@
+#ifndef LSM_STORE_H_
+#define LSM_STORE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "bloom_filter.h"
+#include "log_record.h"
+#include "span_trace.h"
+
+// An LSM-tree engine for the store. Writes go to a write-ahead log and a
+// sorted in-memory memtable. A full memtable is frozen and flushed by a
+// background thread into an immutable, sorted SSTable file, and runs of
+// similarly sized SSTables are merged (size-tiered) so reads only have to
+// look at a handful of them. Everything lives in one directory per database:
+//
+//   MANIFEST       live tables newest first, the first unflushed WAL, next id
+//   wal-<id>.log   write-ahead logs of the memtables not flushed yet
+//   <id>.sst       sorted tables
+//
+// WAL and SSTable records share one layout:
+// [crc]{4} [keyLength]{4} [valueLength]{4} [deleted]{1} [key]{keyLength} [value]{valueLength}
+// where crc is the CRC32C of everything after it. A WAL starts with
+// LSM_WAL_MAGIC; WALs without it and tables with an older magic are from
+// before records had a crc, and are read in the old layout without one.
+// An SSTable is its records in key order, then a sparse index holding the
+// first key and offset of every block of about LSM_BLOCK_BYTES, then a Bloom
+// filter of its keys, then a footer. Tables from before there were filters
+// have a shorter footer ending in LSM_TABLE_MAGIC_V1 and are read without one.
+
+const size_t LSM_RECORD_HEADER = 13;
+const size_t LSM_UNCHECKED_RECORD_HEADER = 9;
+const size_t LSM_BLOCK_BYTES = 4096;
+const size_t LSM_WRITE_BUFFER = 1 << 20;
+const uint64_t LSM_TABLE_MAGIC_V1 = 0x4c534d5461626c65ULL;
+const uint64_t LSM_TABLE_MAGIC_V2 = 0x4c534d5461626c32ULL;
+const uint64_t LSM_TABLE_MAGIC = 0x4c534d5461626c33ULL;
+const uint64_t LSM_WAL_MAGIC = 0x4c534d57414c3033ULL;
+
+// One set or delete, as handed to a storage engine.
+struct Mutation {
+    std::string key;
+    std::string value;
+    bool deleted;
+};
+
+// Called with whether the write was committed.
+typedef std::function < void(bool ok) > WriteDone;
+
+struct LsmOptions {
+    // A memtable is frozen and flushed once it holds this many bytes.
+    size_t memtableBytes;
+    // How many tables of the same tier are merged into one.
+    size_t fanout;
+    // fdatasync the WAL before a write returns.
+    bool syncWrites;
+    // If above 0, fdatasync the WAL in the background this often instead.
+    int syncIntervalMs;
+    // Bloom filter bits per key in new tables, 0 to write tables without one.
+    int bloomBitsPerKey;
+};
+
+// Table reads the Bloom filters saved, and reads they let through for keys
+// the table turned out not to have.
+struct FilterStats {
+    uint64_t negatives;
+    uint64_t falsePositives;
+};
+
+// The size of an LsmStore and the merges it has done. memoryBytes is an
+// estimate of the memtables, the sparse indexes and the Bloom filters.
+struct LsmStats {
+    uint64_t records;
+    uint64_t memoryBytes;
+    uint64_t tables;
+    uint64_t tableBytes;
+    uint64_t merges;
+    double mergeSeconds;
+};
+
+// Charged per memtable entry or sparse index entry on top of its key and
+// value, roughly what the tree node or the vector element costs.
+const size_t LSM_ENTRY_OVERHEAD = 80;
+
+inline void AppendLsmRecord(std::string * out,
+    const std::string & key,
+        const std::string & value,
+            bool deleted) {
+    size_t start = out -> size();
+    uint32_t crc = 0;
+    uint32_t keyLength = key.size();
+    uint32_t valueLength = deleted ? 0 : value.size();
+    char flag = deleted ? 1 : 0;
+    out -> append(reinterpret_cast < const char * > ( & crc), sizeof(crc));
+    out -> append(reinterpret_cast < const char * > ( & keyLength), sizeof(keyLength));
+    out -> append(reinterpret_cast < const char * > ( & valueLength), sizeof(valueLength));
+    out -> append( & flag, 1);
+    out -> append(key);
+    if (!deleted) {
+        out -> append(value);
+    }
+    crc = Crc32c(out -> data() + start + sizeof(crc), out -> size() - start - sizeof(crc));
+    memcpy( & ( * out)[start], & crc, sizeof(crc));
+}
+
+// Parses the record at the start of `data`, in the old layout without a crc
+// unless `checked`. Returns its total size, or 0 if `size` bytes don't hold a
+// whole record or its crc doesn't match.
+inline size_t ParseLsmRecord(const char * data, size_t size, bool checked,
+    const char ** key, size_t * keyLength,
+        const char ** value, size_t * valueLength,
+            bool * deleted) {
+    size_t header = checked ? LSM_RECORD_HEADER : LSM_UNCHECKED_RECORD_HEADER;
+    if (size < header) {
+        return 0;
+    }
+    // The lengths and the deleted flag follow the crc, if there is one.
+    const char * fields = data + header - LSM_UNCHECKED_RECORD_HEADER;
+    uint32_t lengths[2];
+    memcpy(lengths, fields, sizeof(lengths));
+    size_t total = header + static_cast < size_t > (lengths[0]) + lengths[1];
+    if (size < total) {
+        return 0;
+    }
+    if (checked) {
+        uint32_t crc;
+        memcpy( & crc, data, sizeof(crc));
+        if (crc != Crc32c(data + sizeof(crc), total - sizeof(crc))) {
+            return 0;
+        }
+    }
+    * deleted = fields[8] != 0;
+    * key = data + header;
+    * keyLength = lengths[0];
+    * value = * key + lengths[0];
+    * valueLength = lengths[1];
+    return total;
+}
+
+inline bool WriteFully(int fd, const char * data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+struct LsmValue {
+    std::string value;
+    bool deleted;
+};
+
+// The sorted in-memory part of the tree. The active memtable is only touched
+// under the store's state lock; once frozen it is never modified again.
+struct Memtable {
+    void Put(const Mutation & mutation) {
+        auto found = this -> entries.find(mutation.key);
+        if (found != this -> entries.end()) {
+            this -> bytes -= found -> first.size() + found -> second.value.size();
+        }
+        this -> entries[mutation.key] = {
+            mutation.deleted ? std::string() : mutation.value,
+            mutation.deleted
+        };
+        this -> bytes += mutation.key.size() + (mutation.deleted ? 0 : mutation.value.size());
+    }
+
+    std::map < std::string, LsmValue > entries;
+    size_t bytes = 0;
+};
+
+// Walks records in key order. Tombstones are visible, the merging iterator
+// decides what to do with them.
+class LsmIterator {
+    public: virtual ~LsmIterator() {}
+    virtual bool Valid() const = 0;
+    virtual const std::string & key() const = 0;
+    virtual const std::string & value() const = 0;
+    virtual bool deleted() const = 0;
+    virtual void Next() = 0;
+    // False if reading the underlying file failed.
+    virtual bool ok() const {
+        return true;
+    }
+};
+
+class MemtableIterator final: public LsmIterator {
+    public: MemtableIterator(std::shared_ptr < const Memtable > memtable,
+        const std::string & start): memtable(memtable),
+    position(memtable -> entries.lower_bound(start)) {}
+
+    bool Valid() const override {
+        return this -> position != this -> memtable -> entries.end();
+    }
+    const std::string & key() const override {
+        return this -> position -> first;
+    }
+    const std::string & value() const override {
+        return this -> position -> second.value;
+    }
+    bool deleted() const override {
+        return this -> position -> second.deleted;
+    }
+    void Next() override {
+        ++this -> position;
+    }
+
+    private: std::shared_ptr < const Memtable > memtable;
+    std::map < std::string, LsmValue > ::const_iterator position;
+};
+
+// An immutable sorted table on disk. Only the sparse index is kept in memory;
+// a lookup reads the one block that can hold the key. The file is unlinked
+// once the table has been merged away and the last reader lets go of it.
+class SSTable {
+    public: ~SSTable() {
+        close(this -> fd);
+        if (this -> obsolete.load()) {
+            unlink(this -> path.c_str());
+        }
+    }
+
+    static std::shared_ptr < SSTable > Open(const std::string & path, uint64_t id) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return nullptr;
+        }
+        auto table = std::shared_ptr < SSTable > (new SSTable(path, id, fd));
+
+        // [dataEnd]{8} [indexCount]{8} [recordCount]{8} [filterBytes]{8} [magic]{8},
+        // the oldest footer is the same without filterBytes.
+        struct stat info;
+        uint64_t footer[5];
+        size_t footerSize = 0;
+        if (fstat(fd, & info) != 0) {
+            return nullptr;
+        }
+        size_t tail = std::min < size_t > (info.st_size, sizeof(footer));
+        if (pread(fd, reinterpret_cast < char * > (footer) + sizeof(footer) - tail, tail, info.st_size - tail) ==
+            static_cast < ssize_t > (tail)) {
+            if (tail == sizeof(footer) && (footer[4] == LSM_TABLE_MAGIC || footer[4] == LSM_TABLE_MAGIC_V2)) {
+                footerSize = sizeof(footer);
+            } else if (tail >= 4 * sizeof(uint64_t) && footer[4] == LSM_TABLE_MAGIC_V1) {
+                footerSize = 4 * sizeof(uint64_t);
+                std::copy(footer + 1, footer + 4, footer);
+                footer[3] = 0;
+            }
+        }
+        if (footerSize == 0 || footer[0] + footer[3] + footerSize > static_cast < uint64_t > (info.st_size)) {
+            return nullptr;
+        }
+        table -> fileSize = info.st_size;
+        table -> checked = footer[4] == LSM_TABLE_MAGIC;
+        table -> dataEnd = footer[0];
+        table -> recordCount = footer[2];
+
+        std::string index(info.st_size - footerSize - footer[3] - table -> dataEnd, '\0');
+        std::string filter(footer[3], '\0');
+        if (pread(fd, & index[0], index.size(), table -> dataEnd) != static_cast < ssize_t > (index.size()) ||
+            pread(fd, & filter[0], filter.size(), table -> dataEnd + index.size()) != static_cast < ssize_t > (filter.size())) {
+            return nullptr;
+        }
+        table -> filter = BloomFilter(filter);
+        size_t position = 0;
+        for (uint64_t i = 0; i < footer[1]; ++i) {
+            uint32_t keyLength;
+            uint64_t offset;
+            if (position + sizeof(keyLength) > index.size()) {
+                return nullptr;
+            }
+            memcpy( & keyLength, index.data() + position, sizeof(keyLength));
+            position += sizeof(keyLength);
+            if (position + keyLength + sizeof(offset) > index.size()) {
+                return nullptr;
+            }
+            std::string key = index.substr(position, keyLength);
+            position += keyLength;
+            memcpy( & offset, index.data() + position, sizeof(offset));
+            position += sizeof(offset);
+            table -> index.push_back({
+                key,
+                offset
+            });
+        }
+        return table;
+    }
+
+    // Writes every record of `source` into a new table at `path`, with a
+    // filter of bitsPerKey unless that is 0. The table only appears under its
+    // name once it is complete and synced.
+    static std::shared_ptr < SSTable > Write(const std::string & path, uint64_t id,
+        LsmIterator & source, bool dropTombstones, int bitsPerKey) {
+        std::string temporary = path + ".tmp";
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return nullptr;
+        }
+
+        std::string buffer;
+        std::string index;
+        std::vector < uint64_t > hashes;
+        uint64_t indexCount = 0;
+        uint64_t recordCount = 0;
+        uint64_t offset = 0;
+        uint64_t blockStart = 0;
+        bool ok = true;
+        for (; source.Valid() && ok; source.Next()) {
+            if (dropTombstones && source.deleted()) {
+                continue;
+            }
+            if (recordCount == 0 || offset - blockStart >= LSM_BLOCK_BYTES) {
+                uint32_t keyLength = source.key().size();
+                index.append(reinterpret_cast < const char * > ( & keyLength), sizeof(keyLength));
+                index.append(source.key());
+                index.append(reinterpret_cast < const char * > ( & offset), sizeof(offset));
+                ++indexCount;
+                blockStart = offset;
+            }
+            if (bitsPerKey > 0) {
+                hashes.push_back(BloomFilter::Hash(source.key()));
+            }
+            size_t before = buffer.size();
+            AppendLsmRecord( & buffer, source.key(), source.value(), source.deleted());
+            offset += buffer.size() - before;
+            ++recordCount;
+            if (buffer.size() >= LSM_WRITE_BUFFER) {
+                ok = WriteFully(fd, buffer.data(), buffer.size());
+                buffer.clear();
+            }
+        }
+
+        std::string filter = bitsPerKey > 0 ? BloomFilter::Build(hashes, bitsPerKey) : "";
+        uint64_t footer[5] = {
+            offset,
+            indexCount,
+            recordCount,
+            filter.size(),
+            LSM_TABLE_MAGIC
+        };
+        buffer.append(index);
+        buffer.append(filter);
+        buffer.append(reinterpret_cast < const char * > (footer), sizeof(footer));
+        ok = ok && source.ok() && WriteFully(fd, buffer.data(), buffer.size()) && fdatasync(fd) == 0;
+        close(fd);
+        if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+            unlink(temporary.c_str());
+            return nullptr;
+        }
+        return Open(path, id);
+    }
+
+    // Returns false if the table could not be read. `found` says whether the
+    // table has a record for the key, which may be a tombstone.
+    bool Get(const std::string & key, std::string * value, bool * deleted, bool * found) const {
+        * found = false;
+        size_t block = this -> BlockFor(key);
+        if (block == this -> index.size()) {
+            return true;
+        }
+
+        thread_local std::string buffer;
+        uint64_t start = this -> index[block].second;
+        uint64_t end = block + 1 < this -> index.size() ? this -> index[block + 1].second : this -> dataEnd;
+        buffer.resize(end - start);
+        if (pread(this -> fd, & buffer[0], buffer.size(), start) != static_cast < ssize_t > (buffer.size())) {
+            return false;
+        }
+
+        // The block holds whole records only, so one that doesn't parse is
+        // corrupt.
+        size_t position = 0;
+        const char * recordKey;
+        const char * recordValue;
+        size_t keyLength, valueLength;
+        bool recordDeleted;
+        while (position < buffer.size()) {
+            size_t size = ParseLsmRecord(buffer.data() + position, buffer.size() - position, this -> checked, &
+                recordKey, & keyLength, & recordValue, & valueLength, & recordDeleted);
+            if (size == 0) {
+                return false;
+            }
+            int order = key.compare(0, std::string::npos, recordKey, keyLength);
+            if (order == 0) {
+                * found = true;
+                * deleted = recordDeleted;
+                value -> assign(recordValue, valueLength);
+                return true;
+            }
+            if (order < 0) {
+                break;
+            }
+            position += size;
+        }
+        return true;
+    }
+
+    // The block whose first key is the greatest one <= key, or index.size()
+    // if the key sorts before the whole table.
+    size_t BlockFor(const std::string & key) const {
+        auto after = std::upper_bound(this -> index.begin(), this -> index.end(), key,
+            [](const std::string & key,
+                const std::pair < std::string, uint64_t > & entry) {
+                return key < entry.first;
+            });
+        if (after == this -> index.begin()) {
+            return this -> index.size();
+        }
+        return after - this -> index.begin() - 1;
+    }
+
+    const std::string path;
+    const uint64_t id;
+    const int fd;
+    size_t fileSize = 0;
+    uint64_t dataEnd = 0;
+    uint64_t recordCount = 0;
+    // Whether records carry a crc, tables from before they did don't.
+    bool checked = false;
+    std::vector < std::pair < std::string, uint64_t >> index;
+    // Empty for tables written without one, then it matches every key.
+    BloomFilter filter;
+    std::atomic < bool > obsolete;
+
+    private: SSTable(const std::string & path, uint64_t id, int fd): path(path),
+    id(id),
+    fd(fd),
+    obsolete(false) {}
+};
+
+// Reads a table front to back, a block at a time.
+class SSTableIterator final: public LsmIterator {
+    public: SSTableIterator(std::shared_ptr < SSTable > table,
+        const std::string & start): table(table) {
+        size_t block = table -> BlockFor(start);
+        this -> offset = table -> index.empty() ? table -> dataEnd :
+            table -> index[block == table -> index.size() ? 0 : block].second;
+        this -> Next();
+        while (this -> Valid() && this -> currentKey < start) {
+            this -> Next();
+        }
+    }
+
+    bool Valid() const override {
+        return this -> valid;
+    }
+    const std::string & key() const override {
+        return this -> currentKey;
+    }
+    const std::string & value() const override {
+        return this -> currentValue;
+    }
+    bool deleted() const override {
+        return this -> currentDeleted;
+    }
+    bool ok() const override {
+        return this -> readOk;
+    }
+
+    void Next() override {
+        const char * key;
+        const char * value;
+        size_t keyLength, valueLength;
+        size_t size;
+        while ((size = ParseLsmRecord(this -> buffer.data() + this -> position,
+                this -> buffer.size() - this -> position, this -> table -> checked, & key, & keyLength, & value, &
+                valueLength, & this -> currentDeleted)) == 0 && this -> Fill()) {}
+        if (size == 0 && this -> position < this -> buffer.size()) {
+            // Bytes left at the end of the data that aren't a whole record,
+            // or a record whose crc doesn't match.
+            this -> readOk = false;
+        }
+        this -> valid = size != 0;
+        if (this -> valid) {
+            this -> currentKey.assign(key, keyLength);
+            this -> currentValue.assign(value, valueLength);
+            this -> position += size;
+        }
+    }
+
+    private:
+    // Keeps the unparsed tail and reads the next chunk after it. Returns
+    // false once the data section is exhausted.
+    bool Fill() {
+        this -> buffer.erase(0, this -> position);
+        this -> position = 0;
+        if (this -> offset >= this -> table -> dataEnd) {
+            return false;
+        }
+        size_t chunk = std::min < uint64_t > (LSM_WRITE_BUFFER, this -> table -> dataEnd - this -> offset);
+        size_t existing = this -> buffer.size();
+        this -> buffer.resize(existing + chunk);
+        if (pread(this -> table -> fd, & this -> buffer[existing], chunk, this -> offset) != static_cast < ssize_t > (chunk)) {
+            this -> readOk = false;
+            this -> buffer.resize(existing);
+            return false;
+        }
+        this -> offset += chunk;
+        return true;
+    }
+
+    std::shared_ptr < SSTable > table;
+    std::string buffer;
+    size_t position = 0;
+    uint64_t offset;
+    bool valid = false;
+    bool readOk = true;
+    std::string currentKey;
+    std::string currentValue;
+    bool currentDeleted = false;
+};
+
+// Merges sources that are each sorted by key. Sources come newest first, and
+// when several hold the same key only the newest record is produced.
+class MergingIterator final: public LsmIterator {
+    public: MergingIterator(std::vector < std::unique_ptr < LsmIterator >> sources): sources(std::move(sources)) {
+        for (size_t i = 0; i < this -> sources.size(); ++i) {
+            if (this -> sources[i] -> Valid()) {
+                this -> heap.push(i);
+            }
+        }
+        this -> Settle();
+    }
+
+    bool Valid() const override {
+        return this -> current < this -> sources.size();
+    }
+    const std::string & key() const override {
+        return this -> sources[this -> current] -> key();
+    }
+    const std::string & value() const override {
+        return this -> sources[this -> current] -> value();
+    }
+    bool deleted() const override {
+        return this -> sources[this -> current] -> deleted();
+    }
+    bool ok() const override {
+        for (const auto & source: this -> sources) {
+            if (!source -> ok()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void Next() override {
+        // Step every source sitting on the current key past it.
+        std::string key = this -> key();
+        this -> sources[this -> current] -> Next();
+        if (this -> sources[this -> current] -> Valid()) {
+            this -> heap.push(this -> current);
+        }
+        while (!this -> heap.empty() && this -> sources[this -> heap.top()] -> key() == key) {
+            size_t source = this -> heap.top();
+            this -> heap.pop();
+            this -> sources[source] -> Next();
+            if (this -> sources[source] -> Valid()) {
+                this -> heap.push(source);
+            }
+        }
+        this -> Settle();
+    }
+
+    private: void Settle() {
+        if (this -> heap.empty()) {
+            this -> current = this -> sources.size();
+            return;
+        }
+        this -> current = this -> heap.top();
+        this -> heap.pop();
+    }
+
+    struct Later {
+        const MergingIterator * self;
+        // Smallest key first, and the newest source among equal keys.
+        bool operator()(size_t a, size_t b) const {
+            int order = self -> sources[a] -> key().compare(self -> sources[b] -> key());
+            return order != 0 ? order > 0 : a > b;
+        }
+    };
+
+    std::vector < std::unique_ptr < LsmIterator >> sources;
+    std::priority_queue < size_t, std::vector < size_t > , Later > heap {
+        Later {
+            this
+        }
+    };
+    size_t current;
+};
+
+// What Scan hands out: live records with start <= key < end.
+class RangeIterator final: public LsmIterator {
+    public: RangeIterator(std::unique_ptr < LsmIterator > source,
+        const std::string & end): source(std::move(source)),
+    end(end) {
+        this -> SkipTombstones();
+    }
+
+    bool Valid() const override {
+        return this -> source -> Valid() && (this -> end.empty() || this -> source -> key() < this -> end);
+    }
+    const std::string & key() const override {
+        return this -> source -> key();
+    }
+    const std::string & value() const override {
+        return this -> source -> value();
+    }
+    bool deleted() const override {
+        return false;
+    }
+    bool ok() const override {
+        return this -> source -> ok();
+    }
+    void Next() override {
+        this -> source -> Next();
+        this -> SkipTombstones();
+    }
+
+    private: void SkipTombstones() {
+        while (this -> source -> Valid() && this -> source -> deleted()) {
+            this -> source -> Next();
+        }
+    }
+
+    std::unique_ptr < LsmIterator > source;
+    std::string end;
+};
+
+// Tables newest first.
+typedef std::vector < std::shared_ptr < SSTable >> TableList;
+
+class LsmStore {
+    public: ~LsmStore() {
+        // Writes still queued are committed first, they may have to wait for
+        // the background thread to flush.
+        {
+            absl::MutexLock lock( & this -> queueMutex);
+            this -> writerStopping = true;
+        }
+        this -> writer.join();
+        {
+            absl::MutexLock lock( & this -> backgroundMutex);
+            this -> stopping = true;
+        }
+        this -> background.join();
+        if (this -> walFd >= 0) {
+            fdatasync(this -> walFd);
+            close(this -> walFd);
+        }
+    }
+
+    // Opens the database in directory `path`, creating it if needed, and
+    // replays the WALs of the memtables that were never flushed.
+    static std::shared_ptr < LsmStore > Open(const std::string & path, LsmOptions options) {
+        if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+            return nullptr;
+        }
+        struct stat info;
+        if (stat(path.c_str(), & info) != 0 || !S_ISDIR(info.st_mode)) {
+            return nullptr;
+        }
+
+        auto store = std::shared_ptr < LsmStore > (new LsmStore(path, options));
+        if (!store -> Recover()) {
+            return nullptr;
+        }
+        store -> background = std::thread( & LsmStore::BackgroundLoop, store.get());
+        store -> writer = std::thread( & LsmStore::WriteLoop, store.get());
+        return store;
+    }
+
+    // Returns false if a table could not be read. `value` is left empty for
+    // keys that don't exist or were deleted.
+    bool Get(const std::string & key, std::string * value) {
+        value -> clear();
+        std::shared_ptr < const Memtable > immutable;
+        std::shared_ptr < const TableList > tables;
+        ScopedSpan lookup("memtable lookup");
+        {
+            absl::ReaderMutexLock lock( & this -> stateMutex);
+            auto found = this -> memtable -> entries.find(key);
+            if (found != this -> memtable -> entries.end()) {
+                if (!found -> second.deleted) {
+                    * value = found -> second.value;
+                }
+                return true;
+            }
+            immutable = this -> immutable;
+            tables = this -> tables;
+        }
+
+        if (immutable) {
+            auto found = immutable -> entries.find(key);
+            if (found != immutable -> entries.end()) {
+                if (!found -> second.deleted) {
+                    * value = found -> second.value;
+                }
+                return true;
+            }
+        }
+        lookup.End();
+
+        // A key none of the filters may hold is answered without any reads.
+        uint64_t hash = BloomFilter::Hash(key);
+        for (const auto & table: * tables) {
+            if (!table -> filter.MayContain(hash)) {
+                ++this -> filterNegatives;
+                continue;
+            }
+            bool deleted, found;
+            ScopedSpan read("sstable read");
+            if (!table -> Get(key, value, & deleted, & found)) {
+                return false;
+            }
+            if (!found && !table -> filter.Empty()) {
+                ++this -> filterFalsePositives;
+            }
+            if (found) {
+                if (deleted) {
+                    value -> clear();
+                }
+                return true;
+            }
+        }
+        return true;
+    }
+
+    FilterStats GetFilterStats() const {
+        return {
+            this -> filterNegatives.load(),
+            this -> filterFalsePositives.load()
+        };
+    }
+
+    LsmStats GetStats() {
+        LsmStats stats = {
+            0,
+            0,
+            0,
+            0,
+            this -> merges.load(),
+            this -> mergeMicros.load() / 1e6
+        };
+        std::shared_ptr < const Memtable > immutable;
+        std::shared_ptr < const TableList > tables;
+        {
+            absl::ReaderMutexLock lock( & this -> stateMutex);
+            stats.records += this -> memtable -> entries.size();
+            stats.memoryBytes += this -> memtable -> bytes + this -> memtable -> entries.size() * LSM_ENTRY_OVERHEAD;
+            immutable = this -> immutable;
+            tables = this -> tables;
+        }
+        if (immutable) {
+            stats.records += immutable -> entries.size();
+            stats.memoryBytes += immutable -> bytes + immutable -> entries.size() * LSM_ENTRY_OVERHEAD;
+        }
+        for (const auto & table: * tables) {
+            stats.records += table -> recordCount;
+            ++stats.tables;
+            stats.tableBytes += table -> fileSize;
+            stats.memoryBytes += table -> filter.Bytes();
+            for (const auto & entry: table -> index) {
+                stats.memoryBytes += entry.first.size() + LSM_ENTRY_OVERHEAD;
+            }
+        }
+        return stats;
+    }
+
+    // Queues the mutations to be applied together and in order, and returns
+    // straight away. The writer thread commits whatever has queued up as one
+    // WAL write and at most one fdatasync, then updates the memtable and calls
+    // done, so concurrent writers share the sync.
+    void Submit(std::vector < Mutation > mutations, WriteDone done) {
+        absl::MutexLock lock( & this -> queueMutex);
+        this -> queue.push_back({
+            std::move(mutations),
+            std::move(done)
+        });
+    }
+
+    // Submits the mutations and waits for them to be committed.
+    bool Write(std::vector < Mutation > mutations) {
+        absl::Notification committed;
+        bool ok = false;
+        this -> Submit(std::move(mutations), [ & ](bool written) {
+            ok = written;
+            committed.Notify();
+        });
+        committed.WaitForNotification();
+        return ok;
+    }
+
+    // Live records with start <= key < end (end empty for no bound), as of
+    // the moment of the call.
+    std::unique_ptr < LsmIterator > Scan(const std::string & start,
+        const std::string & end) {
+        std::vector < std::unique_ptr < LsmIterator >> sources;
+        std::shared_ptr < const Memtable > immutable;
+        std::shared_ptr < const TableList > tables;
+        {
+            // The active memtable keeps changing, so the range is copied out.
+            absl::ReaderMutexLock lock( & this -> stateMutex);
+            auto snapshot = std::make_shared < Memtable > ();
+            auto first = this -> memtable -> entries.lower_bound(start);
+            auto last = end.empty() ? this -> memtable -> entries.end() : this -> memtable -> entries.lower_bound(end);
+            if (end.empty() || start < end) {
+                snapshot -> entries.insert(first, last);
+            }
+            sources.emplace_back(new MemtableIterator(snapshot, start));
+            immutable = this -> immutable;
+            tables = this -> tables;
+        }
+        if (immutable) {
+            sources.emplace_back(new MemtableIterator(immutable, start));
+        }
+        for (const auto & table: * tables) {
+            sources.emplace_back(new SSTableIterator(table, start));
+        }
+        return std::unique_ptr < LsmIterator > (new RangeIterator(
+            std::unique_ptr < LsmIterator > (new MergingIterator(std::move(sources))), end));
+    }
+
+    // Has the background thread flush the memtable and merge every table
+    // into one, dropping tombstones and overwritten records. Returns once it
+    // has been asked, without waiting for either. The memtable is left for
+    // later if the previous one is still being flushed.
+    bool CompactAll() {
+        {
+            absl::MutexLock writeLock( & this -> writeMutex);
+            bool empty;
+            {
+                absl::ReaderMutexLock lock( & this -> stateMutex);
+                empty = this -> memtable -> entries.empty();
+            }
+            bool flushing;
+            {
+                absl::MutexLock lock( & this -> backgroundMutex);
+                flushing = this -> flushing;
+            }
+            if (!empty && !flushing && !this -> Rotate()) {
+                return false;
+            }
+        }
+
+        absl::MutexLock lock( & this -> backgroundMutex);
+        if (this -> stopping) {
+            return false;
+        }
+        this -> mergeAllWanted = true;
+        return true;
+    }
+
+    private: LsmStore(const std::string & path, LsmOptions options): path(path),
+    options(options),
+    memtable(std::make_shared < Memtable > ()),
+    tables(std::make_shared < TableList > ()) {}
+
+    std::string TablePath(uint64_t id) const {
+        return this -> path + "/" + std::to_string(id) + ".sst";
+    }
+
+    std::string WalPath(uint64_t id) const {
+        return this -> path + "/wal-" + std::to_string(id) + ".log";
+    }
+
+    bool Recover() {
+        std::ifstream manifest(this -> path + "/MANIFEST");
+        std::string line;
+        auto tables = std::make_shared < TableList > ();
+        while (std::getline(manifest, line)) {
+            std::istringstream lineStream(line);
+            std::string kind;
+            uint64_t id;
+            if (!(lineStream >> kind >> id)) {
+                continue;
+            }
+            if (kind == "next") {
+                this -> nextId = std::max(this -> nextId.load(), id);
+            } else if (kind == "wal") {
+                this -> firstWal = id;
+            } else if (kind == "table") {
+                auto table = SSTable::Open(this -> TablePath(id), id);
+                if (!table) {
+                    return false;
+                }
+                tables -> push_back(table);
+            }
+        }
+        this -> tables = tables;
+
+        // Collect the WALs that weren't flushed yet, and drop leftovers of
+        // flushes and merges that never made it into the MANIFEST.
+        std::vector < uint64_t > wals;
+        DIR * directory = opendir(this -> path.c_str());
+        if (!directory) {
+            return false;
+        }
+        while (dirent * entry = readdir(directory)) {
+            std::string name = entry -> d_name;
+            unsigned long long id;
+            char rest;
+            if (sscanf(name.c_str(), "wal-%llu.lo%c", & id, & rest) == 2) {
+                this -> nextId = std::max < uint64_t > (this -> nextId.load(), id + 1);
+                if (id >= this -> firstWal) {
+                    wals.push_back(id);
+                } else {
+                    unlink(this -> WalPath(id).c_str());
+                }
+            } else if (sscanf(name.c_str(), "%llu.ss%c", & id, & rest) == 2 ||
+                sscanf(name.c_str(), "%llu.sst.tm%c", & id, & rest) == 2) {
+                this -> nextId = std::max < uint64_t > (this -> nextId.load(), id + 1);
+                bool live = std::any_of(tables -> begin(), tables -> end(), [id](const std::shared_ptr < SSTable > & table) {
+                    return table -> id == id;
+                });
+                if (!live || name.find(".tmp") != std::string::npos) {
+                    unlink((this -> path + "/" + name).c_str());
+                }
+            }
+        }
+        closedir(directory);
+        std::sort(wals.begin(), wals.end());
+
+        // Replay them oldest first, and keep appending to the newest one
+        // unless it is in the old layout without crcs.
+        size_t validSize = 0;
+        bool checked = true;
+        for (uint64_t id: wals) {
+            validSize = this -> Replay(this -> WalPath(id), & checked);
+        }
+        if (wals.empty() || !checked) {
+            this -> walId = this -> nextId++;
+            validSize = 0;
+        } else {
+            this -> walId = wals.back();
+        }
+        this -> walFd = open(this -> WalPath(this -> walId).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (this -> walFd < 0 || ftruncate(this -> walFd, validSize) != 0) {
+            return false;
+        }
+        if (validSize == 0) {
+            if (!WriteFully(this -> walFd, reinterpret_cast < const char * > ( & LSM_WAL_MAGIC), sizeof(LSM_WAL_MAGIC))) {
+                return false;
+            }
+            validSize = sizeof(LSM_WAL_MAGIC);
+        }
+        this -> walBytes = validSize;
+        this -> firstWal = wals.empty() ? this -> walId : wals.front();
+        return this -> WriteManifest( * tables);
+    }
+
+    // Loads a WAL into the memtable and returns how many bytes of it were
+    // its magic and whole records, 0 if it doesn't have a whole magic.
+    // `checked` says whether it had the magic or is in the old layout. A torn
+    // record at the end is what a crash in the middle of a write leaves
+    // behind; it and anything after it is ignored and later overwritten, so
+    // replay also stops at the first record whose crc doesn't match.
+    size_t Replay(const std::string & walPath, bool * checked) {
+        std::ifstream wal(walPath, std::ios::binary);
+        std::string contents((std::istreambuf_iterator < char > (wal)), std::istreambuf_iterator < char > ());
+        uint64_t magic = 0;
+        memcpy( & magic, contents.data(), std::min(contents.size(), sizeof(magic)));
+        * checked = magic == LSM_WAL_MAGIC || contents.size() < sizeof(magic);
+        if (contents.size() < sizeof(magic)) {
+            return 0;
+        }
+        size_t position = * checked ? sizeof(magic) : 0;
+        const char * key;
+        const char * value;
+        size_t keyLength, valueLength;
+        bool deleted;
+        while (size_t size = ParseLsmRecord(contents.data() + position, contents.size() - position, * checked, &
+                key, & keyLength, & value, & valueLength, & deleted)) {
+            this -> memtable -> Put({
+                std::string(key, keyLength),
+                std::string(value, valueLength),
+                deleted
+            });
+            position += size;
+        }
+        return position;
+    }
+
+    // Atomically replaces the MANIFEST. Called with stateMutex held for
+    // writing, or before the store is shared.
+    bool WriteManifest(const TableList & tables) {
+        std::string temporary = this -> path + "/MANIFEST.tmp";
+        {
+            std::ofstream manifest(temporary, std::ios::trunc);
+            manifest << "next " << this -> nextId.load() << "\n";
+            manifest << "wal " << this -> firstWal << "\n";
+            for (const auto & table: tables) {
+                manifest << "table " << table -> id << "\n";
+            }
+            if (!manifest) {
+                return false;
+            }
+        }
+        int fd = open(temporary.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            fdatasync(fd);
+            close(fd);
+        }
+        return rename(temporary.c_str(), (this -> path + "/MANIFEST").c_str()) == 0;
+    }
+
+    // Freezes the memtable and switches to a new WAL for its successor, the
+    // background thread flushes it. Called with writeMutex held.
+    bool Rotate() {
+        if (!this -> WaitForFlush()) {
+            return false;
+        }
+
+        uint64_t newWal = this -> nextId++;
+        int newFd = open(this -> WalPath(newWal).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (newFd < 0) {
+            return false;
+        }
+        if (!WriteFully(newFd, reinterpret_cast < const char * > ( & LSM_WAL_MAGIC), sizeof(LSM_WAL_MAGIC))) {
+            close(newFd);
+            unlink(this -> WalPath(newWal).c_str());
+            return false;
+        }
+        fdatasync(this -> walFd);
+        close(this -> walFd);
+        this -> walFd = newFd;
+        this -> walId = newWal;
+        this -> walBytes = sizeof(LSM_WAL_MAGIC);
+
+        {
+            absl::WriterMutexLock lock( & this -> stateMutex);
+            this -> immutable = this -> memtable;
+            this -> immutableWalLimit = newWal;
+            this -> memtable = std::make_shared < Memtable > ();
+        }
+        absl::MutexLock lock( & this -> backgroundMutex);
+        this -> flushing = true;
+        return true;
+    }
+
+    struct QueuedWrite {
+        std::vector < Mutation > mutations;
+        WriteDone done;
+    };
+
+    void WriteLoop() {
+        while (true) {
+            std::vector < QueuedWrite > batch;
+            {
+                absl::MutexLock lock( & this -> queueMutex);
+                auto ready = [this]() {
+                    this -> queueMutex.AssertHeld();
+                    return !this -> queue.empty() || this -> writerStopping;
+                };
+                this -> queueMutex.Await(absl::Condition( & ready));
+                if (this -> queue.empty()) {
+                    return;
+                }
+                batch.swap(this -> queue);
+            }
+            bool ok = this -> Commit(batch);
+            for (QueuedWrite & write: batch) {
+                if (write.done) {
+                    write.done(ok);
+                }
+            }
+        }
+    }
+
+    // Appends the batch to the WAL, then applies it to the memtable. Blocks
+    // while the memtable is full and the previous one is still being flushed.
+    bool Commit(std::vector < QueuedWrite > & batch) {
+        absl::MutexLock writeLock( & this -> writeMutex);
+        if (this -> walBroken) {
+            return false;
+        }
+
+        std::string buffer;
+        size_t count = 0;
+        for (const QueuedWrite & write: batch) {
+            for (const Mutation & mutation: write.mutations) {
+                AppendLsmRecord( & buffer, mutation.key, mutation.value, mutation.deleted);
+            }
+            count += write.mutations.size();
+        }
+        {
+            ScopedSpan append("wal append", buffer.size());
+            if (!WriteFully(this -> walFd, buffer.data(), buffer.size())) {
+                // Replay stops at the first torn record, so a partial one
+                // left here would hide every write after it.
+                this -> walBroken = ftruncate(this -> walFd, this -> walBytes) != 0;
+                return false;
+            }
+        }
+        this -> walBytes += buffer.size();
+        if (this -> options.syncWrites) {
+            ScopedSpan flush("wal flush");
+            if (fdatasync(this -> walFd) != 0) {
+                return false;
+            }
+        }
+        this -> walDirty.store(true);
+
+        bool full;
+        {
+            ScopedSpan insert("memtable insert", count);
+            absl::WriterMutexLock lock( & this -> stateMutex);
+            for (const QueuedWrite & write: batch) {
+                for (const Mutation & mutation: write.mutations) {
+                    this -> memtable -> Put(mutation);
+                }
+            }
+            full = this -> memtable -> bytes >= this -> options.memtableBytes;
+        }
+        if (full) {
+            return this -> Rotate();
+        }
+        return true;
+    }
+
+    // Waits until no frozen memtable is left. False if the store is closing
+    // or flushing failed.
+    bool WaitForFlush() {
+        absl::MutexLock lock( & this -> backgroundMutex);
+        auto done = [this]() {
+            this -> backgroundMutex.AssertHeld();
+            return !this -> flushing || this -> stopping || this -> flushFailed;
+        };
+        this -> backgroundMutex.Await(absl::Condition( & done));
+        return !this -> flushing;
+    }
+
+    void BackgroundLoop() {
+        int waitMs = this -> options.syncIntervalMs > 0 ? this -> options.syncIntervalMs : 1000;
+        while (true) {
+            bool flush;
+            {
+                absl::MutexLock lock( & this -> backgroundMutex);
+                auto work = [this]() {
+                    this -> backgroundMutex.AssertHeld();
+                    return this -> stopping || (this -> flushing && !this -> flushFailed) || this -> mergeAllWanted;
+                };
+                this -> backgroundMutex.AwaitWithTimeout(absl::Condition( & work), absl::Milliseconds(waitMs));
+                if (this -> stopping) {
+                    return;
+                }
+                // A failed flush is retried on the next round.
+                this -> flushFailed = false;
+                flush = this -> flushing;
+            }
+
+            // Writers may be holding writeMutex while they wait on a flush,
+            // so only sync if it's free and try again next round otherwise.
+            if (this -> options.syncIntervalMs > 0 && this -> walDirty.load() && this -> writeMutex.TryLock()) {
+                this -> walDirty.store(false);
+                fdatasync(this -> walFd);
+                this -> writeMutex.Unlock();
+            }
+
+            bool mergeAll;
+            {
+                bool flushed = flush ? this -> Flush() : true;
+                absl::MutexLock lock( & this -> backgroundMutex);
+                if (flush) {
+                    this -> flushing = !flushed;
+                    this -> flushFailed = !flushed;
+                }
+                // CompactAll's memtable goes into the merge, so that waits
+                // for its flush.
+                mergeAll = this -> mergeAllWanted && !this -> flushing;
+                if (mergeAll) {
+                    this -> mergeAllWanted = false;
+                }
+            }
+
+            absl::MutexLock mergeLock( & this -> mergeMutex);
+            if (mergeAll) {
+                std::shared_ptr < const TableList > tables;
+                {
+                    absl::ReaderMutexLock lock( & this -> stateMutex);
+                    tables = this -> tables;
+                }
+                if (tables -> size() > 1) {
+                    this -> Merge( * tables, true);
+                }
+            }
+            while (true) {
+                std::shared_ptr < const TableList > tables;
+                {
+                    absl::ReaderMutexLock lock( & this -> stateMutex);
+                    tables = this -> tables;
+                }
+                size_t first, count;
+                if (!this -> FindRun( * tables, & first, & count)) {
+                    break;
+                }
+                TableList run(tables -> begin() + first, tables -> begin() + first + count);
+                if (!this -> Merge(run, first + count == tables -> size())) {
+                    break;
+                }
+            }
+        }
+    }
+
+    // Writes the frozen memtable out as the newest table, then forgets the
+    // WALs it came from.
+    bool Flush() {
+        ScopedSpan span("flush memtable");
+        std::shared_ptr < const Memtable > immutable;
+        uint64_t walLimit;
+        {
+            absl::ReaderMutexLock lock( & this -> stateMutex);
+            immutable = this -> immutable;
+            walLimit = this -> immutableWalLimit;
+        }
+
+        uint64_t id = this -> nextId++;
+        MemtableIterator source(immutable, "");
+        auto table = SSTable::Write(this -> TablePath(id), id, source, false, this -> options.bloomBitsPerKey);
+        if (!table) {
+            return false;
+        }
+
+        uint64_t oldFirstWal;
+        {
+            absl::MutexLock mergeLock( & this -> mergeMutex);
+            absl::WriterMutexLock lock( & this -> stateMutex);
+            auto tables = std::make_shared < TableList > ();
+            tables -> push_back(table);
+            tables -> insert(tables -> end(), this -> tables -> begin(), this -> tables -> end());
+            oldFirstWal = this -> firstWal;
+            this -> firstWal = walLimit;
+            if (!this -> WriteManifest( * tables)) {
+                this -> firstWal = oldFirstWal;
+                table -> obsolete.store(true);
+                return false;
+            }
+            this -> tables = tables;
+            this -> immutable = nullptr;
+        }
+
+        for (uint64_t wal = oldFirstWal; wal < walLimit; ++wal) {
+            unlink(this -> WalPath(wal).c_str());
+        }
+        return true;
+    }
+
+    // Tables are grouped into tiers by size: tier t holds tables of up to
+    // memtableBytes * fanout^t bytes.
+    size_t Tier(const SSTable & table) const {
+        size_t tier = 0;
+        size_t limit = this -> options.memtableBytes;
+        while (table.fileSize > limit && tier < 32) {
+            limit *= this -> options.fanout;
+            ++tier;
+        }
+        return tier;
+    }
+
+    // Finds the first run of at least `fanout` adjacent tables in one tier.
+    bool FindRun(const TableList & tables, size_t * first, size_t * count) const {
+        size_t runStart = 0;
+        for (size_t i = 1; i <= tables.size(); ++i) {
+            if (i == tables.size() || this -> Tier( * tables[i]) != this -> Tier( * tables[runStart])) {
+                if (i - runStart >= this -> options.fanout) {
+                    * first = runStart;
+                    * count = i - runStart;
+                    return true;
+                }
+                runStart = i;
+            }
+        }
+        return false;
+    }
+
+    // Merges adjacent tables into one that takes their place in the list.
+    // Tombstones can only be dropped when nothing older is left underneath.
+    // Called with mergeMutex held, so meanwhile the list only changes by
+    // flushes adding tables in front.
+    bool Merge(const TableList & run, bool includesOldest) {
+        auto start = std::chrono::steady_clock::now();
+        ScopedSpan span("compact merge", run.size());
+        std::vector < std::unique_ptr < LsmIterator >> sources;
+        for (const auto & table: run) {
+            sources.emplace_back(new SSTableIterator(table, ""));
+        }
+        MergingIterator source(std::move(sources));
+
+        uint64_t id = this -> nextId++;
+        auto merged = SSTable::Write(this -> TablePath(id), id, source, includesOldest, this -> options.bloomBitsPerKey);
+        if (!merged) {
+            return false;
+        }
+
+        absl::WriterMutexLock lock( & this -> stateMutex);
+        auto tables = std::make_shared < TableList > ();
+        for (const auto & table: * this -> tables) {
+            if (table == run.front()) {
+                tables -> push_back(merged);
+            }
+            if (std::find(run.begin(), run.end(), table) == run.end()) {
+                tables -> push_back(table);
+            }
+        }
+        if (!this -> WriteManifest( * tables)) {
+            merged -> obsolete.store(true);
+            return false;
+        }
+        this -> tables = tables;
+        for (const auto & table: run) {
+            table -> obsolete.store(true);
+        }
+        ++this -> merges;
+        this -> mergeMicros += std::chrono::duration_cast < std::chrono::microseconds > (
+            std::chrono::steady_clock::now() - start).count();
+        return true;
+    }
+
+    const std::string path;
+    const LsmOptions options;
+    std::atomic < uint64_t > nextId {
+        1
+    };
+
+    // Writes waiting for the writer thread.
+    absl::Mutex queueMutex;
+    std::vector < QueuedWrite > queue;
+    bool writerStopping = false;
+    std::thread writer;
+
+    // Serializes the writer and WAL rotation.
+    absl::Mutex writeMutex;
+    int walFd = -1;
+    uint64_t walId = 0;
+    // Whole records in the WAL, where a failed append is cut back to.
+    size_t walBytes = 0;
+    // Set if a failed append couldn't be cut back, every later write fails.
+    bool walBroken = false;
+    std::atomic < bool > walDirty {
+        false
+    };
+
+    // Guards what readers look at, and the MANIFEST.
+    absl::Mutex stateMutex;
+    std::shared_ptr < Memtable > memtable;
+    std::shared_ptr < const Memtable > immutable;
+    // WALs below this one are all in `immutable` or already flushed.
+    uint64_t immutableWalLimit = 0;
+    std::shared_ptr < const TableList > tables;
+    // WALs below this one are flushed.
+    uint64_t firstWal = 0;
+
+    // Only one merge at a time, and flushes don't publish in the middle of one.
+    absl::Mutex mergeMutex;
+
+    absl::Mutex backgroundMutex;
+    bool flushing = false;
+    bool flushFailed = false;
+    bool stopping = false;
+    // Set by CompactAll until the background thread merges every table.
+    bool mergeAllWanted = false;
+    std::thread background;
+
+    std::atomic < uint64_t > filterNegatives {
+        0
+    };
+    std::atomic < uint64_t > filterFalsePositives {
+        0
+    };
+    std::atomic < uint64_t > merges {
+        0
+    };
+    std::atomic < uint64_t > mergeMicros {
+        0
+    };
+};
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef SERVER_STATS_H_
+#define SERVER_STATS_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+#include "latency_histogram.h"
+
+// The unary RPCs whose latency GetStats reports.
+enum StatsMethod {
+    STATS_OPEN,
+    STATS_GET_KEY,
+    STATS_SET_KEY,
+    STATS_DELETE_KEY,
+    STATS_MULTI_GET,
+    STATS_WRITE_BATCH,
+    STATS_COMPACT,
+    STATS_CLOSE,
+    STATS_METHODS
+};
+
+const char * const STATS_METHOD_NAMES[STATS_METHODS] = {
+    "Open",
+    "GetKey",
+    "SetKey",
+    "DeleteKey",
+    "MultiGet",
+    "WriteBatch",
+    "Compact",
+    "Close"
+};
+
+// What one thread has recorded. Only that thread writes to it while GetStats
+// may read it at any time, so it is all relaxed atomics. A recorder is only
+// allocated once the thread first serves its method.
+struct ThreadStats {
+    ThreadStats() {
+        for (auto & latency: this -> latencies) {
+            latency.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~ThreadStats() {
+        for (auto & latency: this -> latencies) {
+            delete latency.load(std::memory_order_relaxed);
+        }
+    }
+
+    std::array < std::atomic < HistogramRecorder * > , STATS_METHODS > latencies;
+    std::atomic < uint64_t > bytesRead {
+        0
+    };
+    std::atomic < uint64_t > bytesWritten {
+        0
+    };
+};
+
+// What every thread that served requests recorded, merged.
+struct StatsSnapshot {
+    std::array < Histogram, STATS_METHODS > latencies;
+    uint64_t bytesRead = 0;
+    uint64_t bytesWritten = 0;
+};
+
+// The server's counters. Each thread records into a ThreadStats of its own
+// without taking any lock; the mutex only guards handing them out and
+// merging them on Read. A thread that exits hands its ThreadStats back for
+// the next new thread to carry on with, so gRPC growing and shrinking its
+// thread pool neither loses counts nor leaks.
+class ServerStats {
+    public: static ServerStats & Get() {
+        // Never destroyed, so threads exiting after main can still hand back.
+        static ServerStats * stats = new ServerStats();
+        return * stats;
+    }
+
+    void RecordLatency(StatsMethod method, std::chrono::steady_clock::time_point start, bool ok) {
+        uint64_t micros = std::chrono::duration_cast < std::chrono::microseconds > (
+            std::chrono::steady_clock::now() - start).count();
+        ThreadStats & local = this -> Local();
+        HistogramRecorder * recorder = local.latencies[method].load(std::memory_order_acquire);
+        if (!recorder) {
+            recorder = new HistogramRecorder();
+            local.latencies[method].store(recorder, std::memory_order_release);
+        }
+        recorder -> Record(micros, ok);
+    }
+
+    void AddBytesRead(uint64_t bytes) {
+        this -> Local().bytesRead.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void AddBytesWritten(uint64_t bytes) {
+        this -> Local().bytesWritten.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    // Adds up what every thread has recorded so far.
+    void Read(StatsSnapshot * snapshot) {
+        absl::MutexLock lock( & this -> mutex);
+        for (const auto & stats: this -> threads) {
+            for (int method = 0; method < STATS_METHODS; ++method) {
+                HistogramRecorder * recorder = stats -> latencies[method].load(std::memory_order_acquire);
+                if (recorder) {
+                    recorder -> Read( & snapshot -> latencies[method]);
+                }
+            }
+            snapshot -> bytesRead += stats -> bytesRead.load(std::memory_order_relaxed);
+            snapshot -> bytesWritten += stats -> bytesWritten.load(std::memory_order_relaxed);
+        }
+    }
+
+    private: ServerStats() {}
+
+    // Holds a thread's ThreadStats and hands it back when the thread exits.
+    struct Lease {
+        ~Lease() {
+            if (this -> stats) {
+                ServerStats::Get().Release(this -> stats);
+            }
+        }
+
+        ThreadStats * stats = nullptr;
+    };
+
+    ThreadStats & Local() {
+        thread_local Lease lease;
+        if (!lease.stats) {
+            lease.stats = this -> Acquire();
+        }
+        return * lease.stats;
+    }
+
+    ThreadStats * Acquire() {
+        absl::MutexLock lock( & this -> mutex);
+        if (!this -> unused.empty()) {
+            ThreadStats * stats = this -> unused.back();
+            this -> unused.pop_back();
+            return stats;
+        }
+        this -> threads.emplace_back(new ThreadStats());
+        return this -> threads.back().get();
+    }
+
+    void Release(ThreadStats * stats) {
+        absl::MutexLock lock( & this -> mutex);
+        this -> unused.push_back(stats);
+    }
+
+    absl::Mutex mutex;
+    std::vector < std::unique_ptr < ThreadStats >> threads;
+    // Of threads that have exited.
+    std::vector < ThreadStats * > unused;
+};
+
+#endif // SERVER_STATS_H_
@@ -0,0 +1,398 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/strings/str_format.h"
+#include "latency_histogram.h"
+#include "store_client.h"
+
+// A YCSB-style load generator. Loads a key space, then runs a mix of reads,
+// updates, inserts, scans, read-modify-writes and deletes from many threads
+// over a configurable number of connections, printing throughput and latency
+// percentiles of every operation each interval and for the whole run.
+//
+// The workload presets are YCSB's core workloads:
+//   A  50% read, 50% update, zipfian         (session store)
+//   B  95% read, 5% update, zipfian          (photo tagging)
+//   C  100% read, zipfian                    (user profile cache)
+//   D  95% read, 5% insert, latest           (user status updates)
+//   E  95% scan, 5% insert, zipfian          (threaded conversations)
+//   F  50% read, 50% read-modify-write, zipf (user database)
+// and any proportion flag set overrides its preset. Scans need a server
+// running --engine=lsm, the log engine answers them with errors.
+
+ABSL_FLAG(std::string, target, "localhost:50051", "Server address");
+ABSL_FLAG(std::string, filename, "bench", "Database file to run against");
+ABSL_FLAG(std::string, workload, "A", "YCSB core workload, A to F, that sets the operation mix and distribution");
+ABSL_FLAG(double, read_proportion, -1, "Share of reads, overriding the workload's");
+ABSL_FLAG(double, update_proportion, -1, "Share of updates of existing keys, overriding the workload's");
+ABSL_FLAG(double, insert_proportion, -1, "Share of inserts of new keys, overriding the workload's");
+ABSL_FLAG(double, scan_proportion, -1, "Share of scans, overriding the workload's");
+ABSL_FLAG(double, rmw_proportion, -1, "Share of read-modify-writes, overriding the workload's");
+ABSL_FLAG(double, delete_proportion, -1, "Share of deletes, overriding the workload's");
+ABSL_FLAG(std::string, distribution, "", "Which keys get picked: zipfian, uniform or latest, empty for the workload's");
+ABSL_FLAG(double, zipf_theta, 0.99, "Skew of the zipfian and latest distributions");
+ABSL_FLAG(int, threads, 8, "Client threads, each with one request in flight");
+ABSL_FLAG(int, connections, 0, "Channels the threads are spread over, 0 for one per thread");
+ABSL_FLAG(int, keys, 100000, "Keys loaded before the run");
+ABSL_FLAG(int, value_size, 100, "Bytes per value");
+ABSL_FLAG(int, max_scan_length, 100, "Scans read a uniformly chosen number of keys up to this");
+ABSL_FLAG(bool, load, true, "Bulk load the keys before the run, turn off to run against a loaded file");
+ABSL_FLAG(int, seconds, 10, "How long the run lasts");
+ABSL_FLAG(int, interval, 1, "Seconds between reports");
+
+enum Operation {
+    READ,
+    UPDATE,
+    INSERT,
+    SCAN,
+    READ_MODIFY_WRITE,
+    DELETE,
+    OPERATIONS
+};
+
+const char * const OPERATION_NAMES[OPERATIONS] = {
+    "read",
+    "update",
+    "insert",
+    "scan",
+    "rmw",
+    "delete"
+};
+
+struct Workload {
+    double proportions[OPERATIONS];
+    std::string distribution;
+};
+
+bool PresetWorkload(const std::string & name, Workload * workload) {
+    const std::vector < std::pair < std::string, Workload >> presets = {
+        { "A", { { 0.5, 0.5, 0, 0, 0, 0 }, "zipfian" } },
+        { "B", { { 0.95, 0.05, 0, 0, 0, 0 }, "zipfian" } },
+        { "C", { { 1, 0, 0, 0, 0, 0 }, "zipfian" } },
+        { "D", { { 0.95, 0, 0.05, 0, 0, 0 }, "latest" } },
+        { "E", { { 0, 0, 0.05, 0.95, 0, 0 }, "zipfian" } },
+        { "F", { { 0.5, 0, 0, 0, 0.5, 0 }, "zipfian" } }
+    };
+    for (const auto & preset: presets) {
+        if (preset.first == name) {
+            * workload = preset.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+// YCSB's zipfian generator (Gray et al., "Quickly generating billion-record
+// synthetic databases"): item 0 is the most popular, item i is picked in
+// proportion to 1 / (i + 1)^theta.
+class Zipfian {
+    public: Zipfian(uint64_t items, double theta): items(items),
+    theta(theta),
+    alpha(1 / (1 - theta)),
+    zetaN(Zeta(items, theta)),
+    eta((1 - std::pow(2.0 / items, 1 - theta)) / (1 - Zeta(2, theta) / this -> zetaN)) {}
+
+    uint64_t Next(std::mt19937_64 & random) const {
+        double u = std::uniform_real_distribution < double > (0, 1)(random);
+        double uz = u * this -> zetaN;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + std::pow(0.5, this -> theta)) {
+            return 1;
+        }
+        return std::min < uint64_t > (this -> items - 1,
+            this -> items * std::pow(this -> eta * u - this -> eta + 1, this -> alpha));
+    }
+
+    private: static double Zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; ++i) {
+            sum += 1 / std::pow(i, theta);
+        }
+        return sum;
+    }
+
+    const uint64_t items;
+    const double theta;
+    const double alpha;
+    const double zetaN;
+    const double eta;
+};
+
+// FNV-1a over the bytes of a key number, how YCSB scatters both the key
+// names and the popular zipfian items over the key space.
+uint64_t Scatter(uint64_t value) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < 8; ++i) {
+        hash ^= (value >> (i * 8)) & 0xff;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Keys are named by a hash of their number so inserts don't all land at the
+// end of the key order.
+std::string KeyName(uint64_t number) {
+    return absl::StrFormat("user%020u", Scatter(number));
+}
+
+// Picks key numbers among those inserted so far. Zipfian picks are scattered
+// so the hot keys aren't neighbours, latest favours the newest keys. The
+// zipfian spans the loaded keys, inserts made during the run are reached by
+// wrapping onto them.
+class KeyChooser {
+    public: KeyChooser(const std::string & distribution, uint64_t keys, double theta): distribution(distribution),
+    zipfian(std::max < uint64_t > (keys, 2), theta) {}
+
+    uint64_t Next(std::mt19937_64 & random, uint64_t inserted) const {
+        if (this -> distribution == "uniform") {
+            return std::uniform_int_distribution < uint64_t > (0, inserted - 1)(random);
+        }
+        uint64_t rank = this -> zipfian.Next(random);
+        if (this -> distribution == "latest") {
+            return inserted - 1 - rank % inserted;
+        }
+        return Scatter(rank) % inserted;
+    }
+
+    private: const std::string distribution;
+    const Zipfian zipfian;
+};
+
+// Every connection gets a channel with an id of its own, so gRPC doesn't
+// share one HTTP/2 connection between them.
+std::unique_ptr < StoreClient > Connect(const std::string & target, int id) {
+    grpc::ChannelArguments args;
+    args.SetInt("grpc.channel_id", id);
+    return std::unique_ptr < StoreClient > (new StoreClient(
+        grpc::CreateCustomChannel(target, grpc::InsecureChannelCredentials(), args)));
+}
+
+void PrintHeader() {
+    std::cout << absl::StrFormat("%8s %-8s %12s %10s %10s %10s %10s %8s", "time", "op", "ops/s", "p50 us",
+        "p99 us", "p99.9 us", "max us", "errors") << std::endl;
+}
+
+void PrintRow(const std::string & time, Operation operation, const Histogram & histogram, double seconds) {
+    std::cout << absl::StrFormat("%8s %-8s %12.0f %10d %10d %10d %10d %8d", time, OPERATION_NAMES[operation],
+        histogram.total / seconds, histogram.Percentile(50), histogram.Percentile(99),
+        histogram.Percentile(99.9), histogram.Percentile(100), histogram.errors) << std::endl;
+}
+
+int main(int argc, char ** argv) {
+    absl::ParseCommandLine(argc, argv);
+    const std::string target = absl::GetFlag(FLAGS_target);
+    const std::string filename = absl::GetFlag(FLAGS_filename);
+    const int threads = std::max(1, absl::GetFlag(FLAGS_threads));
+    const int connections = absl::GetFlag(FLAGS_connections) > 0 ?
+        std::min(absl::GetFlag(FLAGS_connections), threads) : threads;
+    const uint64_t keys = std::max(1, absl::GetFlag(FLAGS_keys));
+    const int valueSize = std::max(0, absl::GetFlag(FLAGS_value_size));
+    const int maxScanLength = std::max(1, absl::GetFlag(FLAGS_max_scan_length));
+    const int interval = std::max(1, absl::GetFlag(FLAGS_interval));
+
+    Workload workload;
+    if (!PresetWorkload(absl::GetFlag(FLAGS_workload), & workload)) {
+        std::cerr << "--workload must be one of A to F" << std::endl;
+        return 1;
+    }
+    const double overrides[OPERATIONS] = {
+        absl::GetFlag(FLAGS_read_proportion),
+        absl::GetFlag(FLAGS_update_proportion),
+        absl::GetFlag(FLAGS_insert_proportion),
+        absl::GetFlag(FLAGS_scan_proportion),
+        absl::GetFlag(FLAGS_rmw_proportion),
+        absl::GetFlag(FLAGS_delete_proportion)
+    };
+    double proportionSum = 0;
+    for (int operation = 0; operation < OPERATIONS; ++operation) {
+        if (overrides[operation] >= 0) {
+            workload.proportions[operation] = overrides[operation];
+        }
+        proportionSum += workload.proportions[operation];
+    }
+    if (proportionSum <= 0) {
+        std::cerr << "The operation proportions add up to nothing" << std::endl;
+        return 1;
+    }
+    if (!absl::GetFlag(FLAGS_distribution).empty()) {
+        workload.distribution = absl::GetFlag(FLAGS_distribution);
+    }
+    if (workload.distribution != "zipfian" && workload.distribution != "uniform" && workload.distribution != "latest") {
+        std::cerr << "--distribution must be zipfian, uniform or latest" << std::endl;
+        return 1;
+    }
+    const double theta = absl::GetFlag(FLAGS_zipf_theta);
+    if (theta <= 0 || theta >= 1) {
+        std::cerr << "--zipf_theta must be between 0 and 1" << std::endl;
+        return 1;
+    }
+
+    std::vector < std::unique_ptr < StoreClient >> clients;
+    for (int i = 0; i < connections; ++i) {
+        clients.push_back(Connect(target, i));
+    }
+    if (clients[0] -> Open(filename) != "ok") {
+        std::cerr << "Could not open " << filename << std::endl;
+        return 1;
+    }
+
+    std::mt19937_64 loadRandom(1);
+    std::string loadValue(valueSize, 'v');
+    if (absl::GetFlag(FLAGS_load)) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t next = 0;
+        std::string status = clients[0] -> BulkLoad(filename, [ & ](std::string * key, std::string * value) {
+            if (next == keys) {
+                return false;
+            }
+            * key = KeyName(next++);
+            for (char & byte: loadValue) {
+                byte = 'a' + loadRandom() % 26;
+            }
+            * value = loadValue;
+            return true;
+        });
+        std::chrono::duration < double > elapsed = std::chrono::steady_clock::now() - start;
+        if (status != "ok") {
+            std::cerr << "Loading " << filename << " failed" << std::endl;
+            return 1;
+        }
+        std::cout << absl::StrFormat("loaded %d keys in %.2fs", keys, elapsed.count()) << std::endl;
+    }
+
+    std::cout << absl::StrFormat("workload %s:", absl::GetFlag(FLAGS_workload));
+    for (int operation = 0; operation < OPERATIONS; ++operation) {
+        if (workload.proportions[operation] > 0) {
+            std::cout << absl::StrFormat(" %.0f%% %s", 100 * workload.proportions[operation] / proportionSum,
+                OPERATION_NAMES[operation]);
+        }
+    }
+    std::cout << absl::StrFormat(", %s over %d keys, %d threads on %d connections", workload.distribution, keys,
+        threads, connections) << std::endl;
+
+    const KeyChooser chooser(workload.distribution, keys, theta);
+    // Keys below this are in the file. Inserts take the next number and bump
+    // it once they are acknowledged, so readers rarely pick a key that is
+    // still in flight.
+    std::atomic < uint64_t > nextInsert(keys);
+    std::atomic < uint64_t > inserted(keys);
+    std::atomic < bool > running(true);
+    std::vector < std::array < HistogramRecorder, OPERATIONS >> recorders(threads);
+    std::vector < std::thread > workers;
+
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([ & , t]() {
+            StoreClient & client = * clients[t % connections];
+            std::array < HistogramRecorder, OPERATIONS > & recorder = recorders[t];
+            std::mt19937_64 random(t + 2);
+            std::discrete_distribution < int > pick(workload.proportions, workload.proportions + OPERATIONS);
+            std::string value(valueSize, 'v');
+            std::string read;
+            for (char & byte: value) {
+                byte = 'a' + random() % 26;
+            }
+
+            while (running.load(std::memory_order_relaxed)) {
+                Operation operation = static_cast < Operation > (pick(random));
+                // A few bytes change per write, so values aren't all the same.
+                if (valueSize > 0) {
+                    value[random() % valueSize] = 'a' + random() % 26;
+                }
+                auto start = std::chrono::steady_clock::now();
+                bool ok = true;
+                switch (operation) {
+                case READ:
+                    ok = client.GetKey(filename, KeyName(chooser.Next(random, inserted.load())), & read) == "ok";
+                    break;
+                case UPDATE:
+                    ok = client.SetKey(filename, KeyName(chooser.Next(random, inserted.load())), value) == "ok";
+                    break;
+                case INSERT: {
+                    uint64_t number = nextInsert.fetch_add(1);
+                    ok = client.SetKey(filename, KeyName(number), value) == "ok";
+                    uint64_t expected = inserted.load();
+                    while (expected <= number && !inserted.compare_exchange_weak(expected, number + 1)) {}
+                    break;
+                }
+                case SCAN: {
+                    int length = std::uniform_int_distribution < int > (1, maxScanLength)(random);
+                    ok = client.Scan(filename, KeyName(chooser.Next(random, inserted.load())), "", length,
+                        [](const std::string &, const std::string &) {}) == "ok";
+                    break;
+                }
+                case READ_MODIFY_WRITE: {
+                    std::string key = KeyName(chooser.Next(random, inserted.load()));
+                    ok = client.GetKey(filename, key, & read) == "ok" &&
+                        client.SetKey(filename, key, value) == "ok";
+                    break;
+                }
+                case DELETE:
+                    ok = client.DeleteKey(filename, KeyName(chooser.Next(random, inserted.load()))) == "ok";
+                    break;
+                default:
+                    break;
+                }
+                auto micros = std::chrono::duration_cast < std::chrono::microseconds > (
+                    std::chrono::steady_clock::now() - start).count();
+                recorder[operation].Record(micros, ok);
+            }
+        });
+    }
+
+    PrintHeader();
+    std::array < Histogram, OPERATIONS > totals;
+    auto start = std::chrono::steady_clock::now();
+    auto last = start;
+    const int seconds = std::max(1, absl::GetFlag(FLAGS_seconds));
+    for (int elapsed = interval; elapsed < seconds + interval; elapsed += interval) {
+        std::this_thread::sleep_until(start + std::chrono::seconds(std::min(elapsed, seconds)));
+        if (elapsed >= seconds) {
+            running.store(false);
+            for (auto & worker: workers) {
+                worker.join();
+            }
+        }
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration < double > intervalSeconds = now - last;
+        last = now;
+
+        for (int operation = 0; operation < OPERATIONS; ++operation) {
+            Histogram histogram;
+            for (auto & recorder: recorders) {
+                recorder[operation].Drain( & histogram);
+            }
+            if (histogram.total > 0) {
+                PrintRow(absl::StrFormat("%ds", std::min(elapsed, seconds)), static_cast < Operation > (operation),
+                    histogram, intervalSeconds.count());
+            }
+            totals[operation].Add(histogram);
+        }
+    }
+
+    std::chrono::duration < double > runSeconds = last - start;
+    std::cout << std::endl;
+    PrintHeader();
+    uint64_t total = 0;
+    for (int operation = 0; operation < OPERATIONS; ++operation) {
+        if (totals[operation].total > 0) {
+            PrintRow("total", static_cast < Operation > (operation), totals[operation], runSeconds.count());
+            total += totals[operation].total;
+        }
+    }
+    std::cout << absl::StrFormat("%.0f ops/s over %.1fs", total / runSeconds.count(), runSeconds.count()) << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,273 @@
+#ifndef STORE_CLIENT_H_
+#define STORE_CLIENT_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+#include "jeffreystore.grpc.pb.h"
+
+using grpc::Channel;
+using grpc::ClientContext;
+using grpc::Status;
+using jeffreystore::Store;
+using jeffreystore::OpenRequest;
+using jeffreystore::OpenResponse;
+using jeffreystore::GetRequest;
+using jeffreystore::GetResponse;
+using jeffreystore::SetRequest;
+using jeffreystore::SetResponse;
+using jeffreystore::DeleteRequest;
+using jeffreystore::DeleteResponse;
+using jeffreystore::CloseRequest;
+using jeffreystore::CloseResponse;
+using jeffreystore::MultiGetRequest;
+using jeffreystore::MultiGetResponse;
+using jeffreystore::WriteBatchRequest;
+using jeffreystore::WriteBatchResponse;
+using jeffreystore::WriteOperation;
+using jeffreystore::KeyValue;
+using jeffreystore::BulkLoadRequest;
+using jeffreystore::BulkLoadResponse;
+using jeffreystore::ScanRequest;
+using jeffreystore::ScanResponse;
+using jeffreystore::StatsRequest;
+using jeffreystore::StatsResponse;
+using jeffreystore::TraceRequest;
+using jeffreystore::TraceResponse;
+
+const size_t BULK_LOAD_MESSAGE_BYTES = 1 << 20;
+
+class StoreClient {
+    public: StoreClient(std::shared_ptr < Channel > channel): stub_(Store::NewStub(channel)) {}
+
+    std::string Open(const std::string & filename) {
+        OpenRequest request;
+        OpenResponse response;
+        ClientContext context;
+
+        request.set_filename(filename);
+        Status status = stub_ -> Open( & context, request, & response);
+
+        return response.status();
+    }
+
+    std::string GetKey(const std::string & filename,
+        const std::string & key) {
+        GetRequest request;
+        GetResponse response;
+        ClientContext context;
+
+        request.set_filename(filename);
+        request.set_key(key);
+
+        Status status = stub_ -> GetKey( & context, request, & response);
+
+        return response.value();
+    }
+
+    // Like GetKey, but returns the status, "ok" once the value is read into
+    // `value` ("" for a missing key), anything else if the read or the RPC
+    // failed.
+    std::string GetKey(const std::string & filename,
+        const std::string & key,
+            std::string * value) {
+        GetRequest request;
+        GetResponse response;
+        ClientContext context;
+
+        request.set_filename(filename);
+        request.set_key(key);
+
+        Status status = stub_ -> GetKey( & context, request, & response);
+        * value = response.value();
+
+        return response.status();
+    }
+
+    std::string SetKey(const std::string & filename,
+        const std::string & key,
+            const std::string & value) {
+        SetRequest request;
+        SetResponse response;
+        ClientContext context;
+
+        request.set_filename(filename);
+        request.set_key(key);
+        request.set_value(value);
+
+        Status status = stub_ -> SetKey( & context, request, & response);
+
+        return response.status();
+    }
+
+    std::string DeleteKey(const std::string & filename,
+        const std::string & key) {
+        DeleteRequest request;
+        DeleteResponse response;
+        ClientContext context;
+
+        request.set_filename(filename);
+        request.set_key(key);
+
+        Status status = stub_ -> DeleteKey( & context, request, & response);
+
+        return response.status();
+    }
+
+    std::string Close(const std::string & filename) {
+        CloseRequest request;
+        CloseResponse response;
+        ClientContext context;
+
+        request.set_filename(filename);
+        Status status = stub_ -> Close( & context, request, & response);
+
+        return response.status();
+    }
+
+    std::vector < std::string > MultiGet(const std::string & filename,
+        const std::vector < std::string > & keys) {
+        MultiGetRequest request;
+        MultiGetResponse response;
+        ClientContext context;
+
+        request.set_filename(filename);
+        for (const std::string & key: keys) {
+            request.add_keys(key);
+        }
+
+        Status status = stub_ -> MultiGet( & context, request, & response);
+
+        return std::vector < std::string > (response.values().begin(), response.values().end());
+    }
+
+    std::string WriteBatch(const std::string & filename,
+        const std::vector < WriteOperation > & operations) {
+        WriteBatchRequest request;
+        WriteBatchResponse response;
+        ClientContext context;
+
+        request.set_filename(filename);
+        for (const WriteOperation & operation: operations) {
+            * request.add_operations() = operation;
+        }
+
+        Status status = stub_ -> WriteBatch( & context, request, & response);
+
+        return response.status();
+    }
+
+    // Streams every record `next` produces, until it returns false, in
+    // messages of about BULK_LOAD_MESSAGE_BYTES.
+    std::string BulkLoad(const std::string & filename,
+        std::function < bool(std::string * key, std::string * value) > next) {
+        BulkLoadResponse response;
+        ClientContext context;
+        std::unique_ptr < grpc::ClientWriter < BulkLoadRequest >> writer(stub_ -> BulkLoad( & context, & response));
+
+        BulkLoadRequest request;
+        request.set_filename(filename);
+        size_t messageBytes = 0;
+        bool sent = false;
+        std::string key, value;
+        while (next( & key, & value)) {
+            KeyValue * record = request.add_records();
+            record -> set_key(key);
+            record -> set_value(value);
+            messageBytes += key.size() + value.size();
+            if (messageBytes >= BULK_LOAD_MESSAGE_BYTES) {
+                if (!writer -> Write(request)) {
+                    break;
+                }
+                request.Clear();
+                messageBytes = 0;
+                sent = true;
+            }
+        }
+        if (request.records_size() > 0 || !sent) {
+            writer -> Write(request);
+        }
+        writer -> WritesDone();
+        Status status = writer -> Finish();
+
+        return response.status();
+    }
+
+    // Calls `each` for every record with start <= key < end in key order,
+    // end empty for no bound and limit 0 for no limit.
+    std::string Scan(const std::string & filename,
+        const std::string & start,
+            const std::string & end,
+                uint64_t limit,
+                std::function < void(const std::string & key, const std::string & value) > each) {
+        ScanRequest request;
+        ScanResponse response;
+        ClientContext context;
+
+        request.set_filename(filename);
+        request.set_start(start);
+        request.set_end(end);
+        request.set_limit(limit);
+        std::unique_ptr < grpc::ClientReader < ScanResponse >> reader(stub_ -> Scan( & context, request));
+
+        std::string result = "not ok";
+        while (reader -> Read( & response)) {
+            result = response.status();
+            for (const KeyValue & record: response.records()) {
+                each(record.key(), record.value());
+            }
+        }
+        Status status = reader -> Finish();
+
+        return status.ok() ? result : "not ok";
+    }
+
+    // Scans every key starting with `prefix`.
+    std::string ScanPrefix(const std::string & filename,
+        const std::string & prefix,
+            uint64_t limit,
+            std::function < void(const std::string & key, const std::string & value) > each) {
+        // The first key past the prefix: drop trailing 0xff bytes and bump
+        // the last remaining one. Nothing is past a prefix of only 0xff.
+        std::string end = prefix;
+        while (!end.empty() && static_cast < unsigned char > (end.back()) == 0xff) {
+            end.pop_back();
+        }
+        if (!end.empty()) {
+            end.back() = static_cast < char > (static_cast < unsigned char > (end.back()) + 1);
+        }
+        return this -> Scan(filename, prefix, end, limit, each);
+    }
+
+    // The server's latencies and counters since it started, with the file
+    // counters of `filename` or of every opened file if it is empty.
+    StatsResponse GetStats(const std::string & filename) {
+        StatsRequest request;
+        StatsResponse response;
+        ClientContext context;
+
+        request.set_filename(filename);
+        Status status = stub_ -> GetStats( & context, request, & response);
+
+        return response;
+    }
+
+    // Has the server write its latest spans to `path`, on the server.
+    std::string DumpTrace(const std::string & path) {
+        TraceRequest request;
+        TraceResponse response;
+        ClientContext context;
+
+        request.set_path(path);
+        Status status = stub_ -> DumpTrace( & context, request, & response);
+
+        return response.status();
+    }
+
+    private: std::unique_ptr < Store::Stub > stub_;
+};
+
+#endif
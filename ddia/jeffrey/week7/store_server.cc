@@ -1,19 +1,41 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <sstream>
+#include <thread>
 #include <unordered_map>
-#include <unordered_set>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/strings/str_format.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
 #include <grpcpp/ext/proto_server_reflection_plugin.h>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/health_check_service_interface.h>
 #include "jeffreystore.grpc.pb.h"
+#include "io_backend.h"
+#include "log_record.h"
+#include "lsm_store.h"
+#include "server_stats.h"
+#include "span_trace.h"
+#include "value_cache.h"
 
 using grpc::Server;
 using grpc::ServerBuilder;
@@ -28,176 +50,2799 @@ using jeffreystore::SetRequest;
 using jeffreystore::SetResponse;
 using jeffreystore::DeleteRequest;
 using jeffreystore::DeleteResponse;
+using jeffreystore::CompactRequest;
+using jeffreystore::CompactResponse;
+using jeffreystore::CloseRequest;
+using jeffreystore::CloseResponse;
+using jeffreystore::MultiGetRequest;
+using jeffreystore::MultiGetResponse;
+using jeffreystore::WriteBatchRequest;
+using jeffreystore::WriteBatchResponse;
+using jeffreystore::WriteOperation;
+using jeffreystore::KeyValue;
+using jeffreystore::BulkLoadRequest;
+using jeffreystore::BulkLoadResponse;
+using jeffreystore::ScanRequest;
+using jeffreystore::ScanResponse;
+using jeffreystore::StatsRequest;
+using jeffreystore::StatsResponse;
+using jeffreystore::MethodStats;
+using jeffreystore::LatencyBucket;
+using jeffreystore::FileStats;
+using jeffreystore::TraceRequest;
+using jeffreystore::TraceResponse;
 
 ABSL_FLAG(uint16_t, port, 50051, "Server port for the service");
+ABSL_FLAG(bool, mmap, false, "Serve GetKey from a memory mapping of each log instead of pread");
+ABSL_FLAG(bool, async, false, "Serve RPCs from completion queues instead of the synchronous thread pool");
+ABSL_FLAG(int, pollers, 0, "Completion queues and polling threads for --async, 0 for one per core");
+ABSL_FLAG(int, workers, 4, "With --async, threads that serve Open, Close and Compact so they never hold up a poller");
+ABSL_FLAG(std::string, durability, "none",
+    "When commits reach the disk: none, batch (fdatasync before acknowledging) or every-N-ms");
+ABSL_FLAG(uint64_t, segment_bytes, 64 << 20, "Start a new log segment once the active one holds this many bytes");
+ABSL_FLAG(double, compact_ratio, 0.5, "Compact a sealed log segment once this share of it is overwritten or deleted records");
+ABSL_FLAG(std::string, engine, "log", "Storage engine: log (hash-indexed append-only log) or lsm (memtable and SSTables)");
+ABSL_FLAG(uint64_t, memtable_bytes, 4 << 20, "With --engine=lsm, flush the memtable to an SSTable at this size");
+ABSL_FLAG(int, lsm_fanout, 4, "With --engine=lsm, merge this many SSTables of similar size into one");
+ABSL_FLAG(int, bloom_bits_per_key, 10, "With --engine=lsm, Bloom filter bits per key in each SSTable, 0 for none");
+ABSL_FLAG(uint64_t, cache_bytes, 0, "Cache up to this many bytes of values in front of GetKey and MultiGet, 0 for no cache");
+ABSL_FLAG(std::string, io, "blocking",
+    "How the log reads records, appends and syncs: blocking (pread, pwrite, fdatasync) or io_uring");
+ABSL_FLAG(int, io_uring_depth, 64,
+    "With --io=io_uring, operations each thread keeps in flight at once, at least 2 for an append and its sync");
+ABSL_FLAG(int, trace_spans, 0,
+    "Record the phases of requests into a ring of this many spans per thread for DumpTrace, 0 for no tracing");
 
-// Logic and data behind the server's behavior.
+// Where a record lives: the segment of the log holding it, the byte offset of
+// the record and its length including the header, so a lookup is a single
+// pread. Deleted keys keep their entry until compaction drops the tombstone,
+// but reading them never has to touch the segment.
+struct IndexEntry {
+    uint32_t segment;
+    bool deleted;
+    off_t offset;
+    size_t length;
+};
+
+// Compaction moving a key to the copy it made of its record, or dropping a
+// key whose record was a tombstone nothing older needs anymore.
+struct IndexMove {
+    std::string key;
+    IndexEntry from;
+    IndexEntry to;
+    bool erase;
+};
+
+const size_t MIN_MAPPING_SIZE = 1 << 20;
+
+// A read-only mapping of a log segment. It is reserved larger than the file so
+// appends only need a remap once they outgrow it, and readers hold a
+// shared_ptr to it so a remap never unmaps bytes that are still being copied out.
+class LogMapping {
+    public: LogMapping(int fd, size_t size): capacity(std::max(MIN_MAPPING_SIZE, size * 2)) {
+        void * mapped = mmap(nullptr, this -> capacity, PROT_READ, MAP_SHARED, fd, 0);
+        this -> data = mapped == MAP_FAILED ? nullptr : static_cast < const char * > (mapped);
+    }
+
+    ~LogMapping() {
+        if (this -> data) {
+            munmap(const_cast < char * > (this -> data), this -> capacity);
+        }
+    }
+
+    const char * data;
+    size_t capacity;
+};
+
+const size_t INDEX_SHARDS = 64;
+// What an entry of the index costs on top of the heap block of a long key:
+// the hash node with its next pointer and cached hash, and malloc's header.
+const size_t INDEX_NODE_BYTES = sizeof(std::pair < const std::string, IndexEntry >) + 3 * sizeof(void * );
+// Keys up to this long live inside their std::string (libstdc++).
+const size_t INDEX_INLINE_KEY = 15;
+
+// The key -> IndexEntry map of one log, striped over independently locked
+// shards so lookups of different keys never contend and GetKey only ever
+// takes a reader lock.
+class ShardedIndex {
+    public: bool Find(const std::string & key, IndexEntry * entry) const {
+        const Shard & shard = this -> ShardFor(key);
+        absl::ReaderMutexLock lock( & shard.mutex);
+        auto found = shard.entries.find(key);
+        if (found == shard.entries.end()) {
+            return false;
+        }
+        * entry = found -> second;
+        return true;
+    }
+
+    // Returns whether the key had an entry, which is then in `replaced`.
+    bool Put(const std::string & key, IndexEntry entry, IndexEntry * replaced) {
+        Shard & shard = this -> ShardFor(key);
+        absl::WriterMutexLock lock( & shard.mutex);
+        auto inserted = shard.entries.insert({
+            key,
+            entry
+        });
+        if (inserted.second) {
+            shard.keyBytes += KeyBytes(key);
+            return false;
+        }
+        * replaced = inserted.first -> second;
+        inserted.first -> second = entry;
+        return true;
+    }
+
+    // Applies all entries while holding every shard they touch, so readers
+    // see either none or all of them. The entries they replace are added to
+    // `replaced`.
+    void PutAll(const std::vector < std::pair < std::string, IndexEntry >> & entries,
+        std::vector < IndexEntry > * replaced) {
+        std::vector < size_t > shardIndexes;
+        for (const auto & entry: entries) {
+            shardIndexes.push_back(this -> ShardIndex(entry.first));
+        }
+        std::vector < size_t > locked(shardIndexes);
+        std::sort(locked.begin(), locked.end());
+        locked.erase(std::unique(locked.begin(), locked.end()), locked.end());
+
+        // Always lock in shard order so two batches can't deadlock.
+        for (size_t index: locked) {
+            this -> shards[index].mutex.WriterLock();
+        }
+        for (size_t i = 0; i < entries.size(); ++i) {
+            Shard & shard = this -> shards[shardIndexes[i]];
+            auto inserted = shard.entries.insert(entries[i]);
+            if (inserted.second) {
+                shard.keyBytes += KeyBytes(entries[i].first);
+            } else {
+                replaced -> push_back(inserted.first -> second);
+                inserted.first -> second = entries[i].second;
+            }
+        }
+        for (size_t index: locked) {
+            this -> shards[index].mutex.WriterUnlock();
+        }
+    }
+
+    // Applies compaction's moves a shard at a time. A move only happens if
+    // the key still has the entry that was copied, anything written since
+    // wins. Returns the bytes of copies that were stale by then.
+    size_t MoveAll(const std::vector < IndexMove > & moves) {
+        std::array < std::vector < const IndexMove * > , INDEX_SHARDS > byShard;
+        for (const IndexMove & move: moves) {
+            byShard[ShardIndex(move.key)].push_back( & move);
+        }
+
+        size_t stale = 0;
+        for (size_t index = 0; index < INDEX_SHARDS; ++index) {
+            if (byShard[index].empty()) {
+                continue;
+            }
+            Shard & shard = this -> shards[index];
+            absl::WriterMutexLock lock( & shard.mutex);
+            for (const IndexMove * move: byShard[index]) {
+                auto found = shard.entries.find(move -> key);
+                bool current = found != shard.entries.end() &&
+                    found -> second.segment == move -> from.segment &&
+                    found -> second.offset == move -> from.offset;
+                if (!current) {
+                    stale += move -> erase ? 0 : move -> to.length;
+                } else if (move -> erase) {
+                    shard.keyBytes -= KeyBytes(move -> key);
+                    shard.entries.erase(found);
+                } else {
+                    found -> second = move -> to;
+                }
+            }
+        }
+        return stale;
+    }
+
+    // How many keys the index holds and an estimate of the memory it takes.
+    void Measure(size_t * keys, size_t * bytes) const {
+        * keys = 0;
+        * bytes = 0;
+        for (const Shard & shard: this -> shards) {
+            absl::ReaderMutexLock lock( & shard.mutex);
+            * keys += shard.entries.size();
+            * bytes += shard.entries.size() * INDEX_NODE_BYTES +
+                shard.entries.bucket_count() * sizeof(void * ) + shard.keyBytes;
+        }
+    }
+
+    private: struct Shard {
+        mutable absl::Mutex mutex;
+        std::unordered_map < std::string, IndexEntry > entries;
+        // Heap bytes of the keys in entries.
+        size_t keyBytes = 0;
+    };
+
+    static size_t KeyBytes(const std::string & key) {
+        return key.size() > INDEX_INLINE_KEY ? key.size() + 1 : 0;
+    }
+
+    static size_t ShardIndex(const std::string & key) {
+        return std::hash < std::string > ()(key) % INDEX_SHARDS;
+    }
+
+    const Shard & ShardFor(const std::string & key) const {
+        return this -> shards[ShardIndex(key)];
+    }
+
+    Shard & ShardFor(const std::string & key) {
+        return this -> shards[ShardIndex(key)];
+    }
+
+    std::array < Shard, INDEX_SHARDS > shards;
+};
+
+// How hard the log writer works to make a commit survive a crash: not at all,
+// an fdatasync before every batch is acknowledged, or an fdatasync at most
+// every intervalMs with writes acknowledged as soon as they are written.
+struct Durability {
+    enum Mode {
+        NONE,
+        BATCH,
+        INTERVAL
+    };
+    Mode mode;
+    int intervalMs;
+};
+
+// Parses --durability: "none", "batch" or "every-N-ms".
+bool ParseDurability(const std::string & text, Durability * durability) {
+    if (text == "none") {
+        * durability = {
+            Durability::NONE,
+            0
+        };
+        return true;
+    }
+    if (text == "batch") {
+        * durability = {
+            Durability::BATCH,
+            0
+        };
+        return true;
+    }
+    const std::string prefix = "every-";
+    const std::string suffix = "-ms";
+    if (text.size() <= prefix.size() + suffix.size() ||
+        text.compare(0, prefix.size(), prefix) != 0 ||
+        text.compare(text.size() - suffix.size(), suffix.size(), suffix) != 0) {
+        return false;
+    }
+    std::string digits = text.substr(prefix.size(), text.size() - prefix.size() - suffix.size());
+    if (digits.size() > 9 || !std::all_of(digits.begin(), digits.end(), ::isdigit) || std::stoi(digits) == 0) {
+        return false;
+    }
+    * durability = {
+        Durability::INTERVAL,
+        std::stoi(digits)
+    };
+    return true;
+}
+
+// Called by the log writer once an append is committed, or has failed.
+typedef std::function < void(bool ok) > AppendDone;
+
+// One record waiting for the log writer. A record without `done` is written
+// as one unit with the records queued after it, up to the next one with a
+// `done`.
+struct PendingAppend {
+    std::string key;
+    std::string value;
+    bool deleted;
+    AppendDone done;
+};
+
+struct LogOptions {
+    bool useMmap;
+    // Reads of records that aren't mapped, appends and syncs go through it.
+    IoBackend * io;
+    Durability durability;
+    // The active segment is sealed once it holds this many bytes.
+    size_t segmentBytes;
+    // Sealed segments with at least this share of dead bytes get compacted.
+    double compactRatio;
+};
+
+// Hint files start with [magic]{4} [version]{4} [count]{8} [coveredBytes]{8}
+// [nextSequence]{8}, then one [keyLength]{4} [length]{4} [offset]{8}
+// [deleted]{1} [key] per key.
+const uint32_t HINT_MAGIC = 0x544e4948;
+const uint32_t HINT_VERSION = 2;
+const size_t HINT_HEADER_BYTES = 32;
+const size_t HINT_ENTRY_BYTES = 17;
+
+// How often the compactor looks for segments worth compacting.
+const int COMPACT_CHECK_MS = 1000;
+const size_t COMPACT_BUFFER_BYTES = 1 << 20;
+
+// One file of a log, named <log>.<first>-<last>. New segments get the next
+// number as both first and last; compaction writes what is live in a run of
+// sealed segments into one file covering their whole range, so after a crash
+// a segment whose range lies inside another's is a leftover of a finished
+// compaction. Only the newest segment takes appends.
+//
+// Next to a segment there may be a hint file, <segment>.hint, listing where
+// the last record of each key in the first coveredBytes of the segment is,
+// so opening the log reads the hint and only replays the records after it.
+// Segments are in the binary format of log_record.h.
+class Segment {
+    public: Segment(uint32_t id, int fd,
+        const std::string & path, uint64_t first, uint64_t last): id(id),
+    fd(fd),
+    path(path),
+    first(first),
+    last(last),
+    size(0),
+    deadBytes(0),
+    hintedBytes(0) {}
+
+    ~Segment() {
+        close(this -> fd);
+    }
+
+    // Records that the segment now ends at `end`, remapping it once the
+    // appends have outgrown the reserved mapping.
+    void Extend(size_t end, bool useMmap) {
+        this -> size.store(end);
+        std::shared_ptr < LogMapping > mapping = std::atomic_load( & this -> mapping);
+        if (mapping && end > mapping -> capacity) {
+            this -> Remap(useMmap);
+        }
+    }
+
+    void Remap(bool useMmap) {
+        if (!useMmap) {
+            return;
+        }
+        auto mapping = std::make_shared < LogMapping > (this -> fd, this -> size.load());
+        std::atomic_store( & this -> mapping, mapping -> data ? mapping : nullptr);
+    }
+
+    // The share of the segment that is overwritten or deleted records.
+    double DeadRatio() const {
+        size_t size = this -> size.load();
+        return size == 0 ? 0 : static_cast < double > (this -> deadBytes.load()) / size;
+    }
+
+    // Identifies the segment in index entries, never reused while the log is open.
+    const uint32_t id;
+    const int fd;
+    const std::string path;
+    const uint64_t first;
+    const uint64_t last;
+    std::atomic < size_t > size;
+    std::atomic < size_t > deadBytes;
+    // How much of the segment its hint file covers.
+    std::atomic < size_t > hintedBytes;
+    // Only accessed through std::atomic_load / std::atomic_store.
+    std::shared_ptr < LogMapping > mapping;
+};
+
+// The size of a log and the compactions it has done.
+struct LogStats {
+    size_t keys;
+    size_t indexBytes;
+    size_t segments;
+    size_t bytes;
+    size_t deadBytes;
+    uint64_t compactions;
+    double compactionSeconds;
+};
+
+// The segments of a log by id, replaced as a whole whenever one comes or goes.
+typedef std::map < uint32_t, std::shared_ptr < Segment >> SegmentMap;
+
+std::string SegmentPath(const std::string & filename, uint64_t first, uint64_t last) {
+    return filename + "." + std::to_string(first) + "-" + std::to_string(last);
+}
+
+// An opened log: its segments, the mapping of each when running with --mmap
+// and the index. Readers only ever touch the atomics and the index.
+//
+// Writers never touch the files themselves. They queue their records with
+// Submit and a single log-writer thread drains the queue, turning everything
+// that piled up into one write to the active segment and at most one
+// fdatasync before calling each record's done callback. It seals the active
+// segment and starts the next one once it reaches segmentBytes. Those writes
+// and syncs, and the reads of records that aren't mapped, go through the
+// IoBackend of the options.
+//
+// A compactor thread rewrites sealed segments whose dead-byte ratio reaches
+// compactRatio, keeping only the records the index still points at, while
+// reads and writes go on. The new segment is published first, then the
+// index entries move over to it and only then do the old segments go away,
+// so a reader always finds its record in one or the other.
+class LogFile {
+    public: ~LogFile() {
+        this -> Stop();
+        if (this -> writer.joinable()) {
+            this -> writer.join();
+        }
+        if (this -> compactor.joinable()) {
+            this -> compactor.join();
+        }
+    }
+
+    // Opens every segment of a log, building the index by scanning each of
+    // them oldest first, and starts the first segment if there is none. A log
+    // written before there were segments is taken over as segment 0-0, and
+    // segments still in the text format are converted on the way.
+    static std::shared_ptr < LogFile > Open(const std::string & filename, LogOptions options) {
+        ScopedSpan span("open log");
+        auto log = std::shared_ptr < LogFile > (new LogFile(filename, options));
+
+        std::vector < std::pair < uint64_t, uint64_t >> ranges = log -> ListSegments();
+        struct stat info;
+        if (ranges.empty() && stat(filename.c_str(), & info) == 0 && S_ISREG(info.st_mode)) {
+            if (rename(filename.c_str(), SegmentPath(filename, 0, 0).c_str()) != 0) {
+                return nullptr;
+            }
+            ranges.push_back({
+                0,
+                0
+            });
+        }
+
+        for (const auto & range: ranges) {
+            if (!log -> ConvertSegment(SegmentPath(filename, range.first, range.second))) {
+                return nullptr;
+            }
+            std::shared_ptr < Segment > segment = log -> OpenSegment(range.first, range.second);
+            if (!segment) {
+                return nullptr;
+            }
+            log -> Publish({
+                segment
+            }, {});
+            size_t end;
+            {
+                ScopedSpan replay("replay segment", segment -> size.load());
+                if (!log -> Replay( * segment, & end)) {
+                    return nullptr;
+                }
+            }
+            // Only the newest segment was being appended to, so only its tail
+            // can be a write torn by a crash; appends go where it starts.
+            // Sealed segments are never shortened.
+            bool newest = & range == & ranges.back();
+            if (newest && end < segment -> size.load()) {
+                if (ftruncate(segment -> fd, end) != 0) {
+                    return nullptr;
+                }
+                segment -> size.store(end);
+            } else if (end < segment -> size.load()) {
+                std::cerr << absl::StrFormat("%s: skipped %d unreadable bytes at offset %d", segment -> path,
+                    segment -> size.load() - end, end) << std::endl;
+                segment -> deadBytes += segment -> size.load() - end;
+            }
+            log -> active = segment;
+            log -> nextNumber = range.second + 1;
+        }
+        if (!log -> active) {
+            log -> active = log -> OpenSegment(0, 0);
+            if (!log -> active) {
+                return nullptr;
+            }
+            log -> Publish({
+                log -> active
+            }, {});
+            log -> nextNumber = 1;
+        }
+
+        log -> writer = std::thread( & LogFile::WriteLoop, log.get());
+        log -> compactor = std::thread( & LogFile::CompactLoop, log.get());
+        return log;
+    }
+
+    // Queues records for the log writer. Returns false if the file has been
+    // closed, in which case the caller should look the file up again.
+    bool Submit(std::vector < PendingAppend > & records) {
+        absl::MutexLock lock( & this -> queueMutex);
+        if (this -> stopping) {
+            return false;
+        }
+        for (auto & record: records) {
+            this -> queue.push_back(std::move(record));
+        }
+        records.clear();
+        return true;
+    }
+
+    // Reads the current value of a key, "" if it is not in the index or
+    // deleted. Returns false only if the log could not be read or the record
+    // fails its checksum.
+    bool Get(const std::string & key, std::string * value) {
+        while (true) {
+            IndexEntry entry;
+            bool indexed;
+            {
+                ScopedSpan span("index lookup");
+                indexed = this -> hashindex.Find(key, & entry);
+            }
+            if (!indexed || entry.deleted) {
+                value -> clear();
+                return true;
+            }
+
+            std::shared_ptr < const SegmentMap > segments = std::atomic_load( & this -> segments);
+            auto found = segments -> find(entry.segment);
+            if (found == segments -> end()) {
+                // Compaction dropped the segment after we found the entry,
+                // the index points at the copy by now.
+                continue;
+            }
+            const Segment & segment = * found -> second;
+
+            std::shared_ptr < LogMapping > mapping = std::atomic_load( & segment.mapping);
+            if (mapping) {
+                // The offset resolves straight to the page cache, no copy until the reply.
+                if (entry.offset + entry.length > segment.size.load()) {
+                    return false;
+                }
+                // Page faults land here, there is no separate read.
+                ScopedSpan span("parse mapped", entry.length);
+                return ParseValue(mapping -> data + entry.offset, entry.length, value);
+            }
+
+            bool ok = false;
+            ScopedSpan span("read", entry.length);
+            this -> options.io -> ReadAll({
+                {
+                    segment.fd,
+                    entry.offset,
+                    entry.length
+                }
+            }, [ & ](size_t, const char * data) {
+                ScopedSpan parse("parse", entry.length);
+                ok = data && ParseValue(data, entry.length, value);
+            });
+            return ok;
+        }
+    }
+
+    // Reads the current values of several keys like Get, with the reads of
+    // records that aren't mapped handed to the I/O backend as one batch.
+    // values gets one value per key, in order.
+    bool GetAll(const std::vector < std::string > & keys, std::vector < std::string > * values) {
+        values -> assign(keys.size(), std::string());
+        // Holding the snapshot keeps the descriptors of every segment in it
+        // open until the batch is done, even if compaction drops one.
+        std::shared_ptr < const SegmentMap > segments = std::atomic_load( & this -> segments);
+        std::vector < IoRead > reads;
+        std::vector < size_t > readKeys;
+
+        // With --mmap this includes copying the mapped values out.
+        ScopedSpan lookup("index lookup", keys.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            IndexEntry entry;
+            if (!this -> hashindex.Find(keys[i], & entry) || entry.deleted) {
+                continue;
+            }
+            auto found = segments -> find(entry.segment);
+            if (found == segments -> end()) {
+                // Sealed or compacted since the snapshot, Get looks again.
+                if (!this -> Get(keys[i], & ( * values)[i])) {
+                    return false;
+                }
+                continue;
+            }
+            const Segment & segment = * found -> second;
+
+            std::shared_ptr < LogMapping > mapping = std::atomic_load( & segment.mapping);
+            if (mapping) {
+                if (entry.offset + entry.length > segment.size.load() ||
+                    !ParseValue(mapping -> data + entry.offset, entry.length, & ( * values)[i])) {
+                    return false;
+                }
+                continue;
+            }
+            reads.push_back({
+                segment.fd,
+                entry.offset,
+                entry.length
+            });
+            readKeys.push_back(i);
+        }
+
+        lookup.End();
+        bool ok = true;
+        ScopedSpan read("read", reads.size());
+        this -> options.io -> ReadAll(reads, [ & ](size_t index, const char * data) {
+            ok = ok && data && ParseValue(data, reads[index].length, & ( * values)[readKeys[index]]);
+        });
+        return ok;
+    }
+
+    // Seals the active segment and has the compactor compact every segment
+    // with anything dead in it. Returns once it has been asked, without
+    // waiting for the merges.
+    bool CompactAll() {
+        {
+            absl::MutexLock lock( & this -> appendMutex);
+            if (this -> closed || !this -> Seal()) {
+                return false;
+            }
+        }
+        absl::MutexLock lock( & this -> queueMutex);
+        this -> compactWanted = true;
+        this -> compactAllWanted = true;
+        return true;
+    }
+
+    LogStats GetStats() const {
+        LogStats stats = {
+            0,
+            0,
+            0,
+            0,
+            0,
+            this -> compactions.load(),
+            this -> compactionMicros.load() / 1e6
+        };
+        this -> hashindex.Measure( & stats.keys, & stats.indexBytes);
+        std::shared_ptr < const SegmentMap > segments = std::atomic_load( & this -> segments);
+        for (const auto & entry: * segments) {
+            ++stats.segments;
+            stats.bytes += entry.second -> size.load();
+            stats.deadBytes += entry.second -> deadBytes.load();
+        }
+        return stats;
+    }
+
+    // Fails everything still queued or submitted later and stops the writer
+    // and the compactor, then writes the hints that are missing so the next
+    // Open has nothing to replay. The files are closed once the last reader
+    // lets go.
+    void Close() {
+        {
+            absl::MutexLock lock( & this -> appendMutex);
+            this -> closed = true;
+            this -> Stop();
+        }
+        this -> WriteHints(true);
+    }
+
+    private: LogFile(const std::string & filename, LogOptions options): filename(filename),
+    options(options),
+    segments(std::make_shared < SegmentMap > ()) {}
+
+    void Stop() {
+        absl::MutexLock lock( & this -> queueMutex);
+        this -> stopping = true;
+    }
+
+    // Checks the record an index entry points at and copies its value out.
+    static bool ParseValue(const char * data, size_t length, std::string * value) {
+        LogRecord record;
+        size_t parsed = ParseLogRecord(data, length, & record);
+        if (parsed == 0 || parsed != length) {
+            return false;
+        }
+        value -> assign(record.value, record.valueLength);
+        return true;
+    }
+
+    // The ranges of the segments on disk, oldest first. Leftovers of
+    // compactions that didn't finish, or finished but didn't get to remove
+    // their inputs, are deleted.
+    std::vector < std::pair < uint64_t, uint64_t >> ListSegments() {
+        size_t slash = this -> filename.rfind('/');
+        std::string directory = slash == std::string::npos ? "." : this -> filename.substr(0, slash);
+        std::string prefix = (slash == std::string::npos ? this -> filename : this -> filename.substr(slash + 1)) + ".";
+
+        std::vector < std::pair < uint64_t, uint64_t >> ranges;
+        std::vector < std::pair < uint64_t, uint64_t >> hints;
+        DIR * listing = opendir(directory.c_str());
+        if (!listing) {
+            return ranges;
+        }
+        while (dirent * entry = readdir(listing)) {
+            std::string name = entry -> d_name;
+            if (name.compare(0, prefix.size(), prefix) != 0) {
+                continue;
+            }
+            unsigned long long first, last;
+            int length = 0;
+            if (sscanf(name.c_str() + prefix.size(), "%llu-%llu%n", & first, & last, & length) != 2) {
+                continue;
+            }
+            std::string rest = name.substr(prefix.size() + length);
+            if (rest == ".tmp" || rest == ".hint.tmp") {
+                unlink((directory + "/" + name).c_str());
+            } else if (rest == ".hint") {
+                hints.push_back({
+                    first,
+                    last
+                });
+            } else if (rest.empty() && first <= last) {
+                ranges.push_back({
+                    first,
+                    last
+                });
+            }
+        }
+        closedir(listing);
+
+        // Widest range first among equal starts, so contained ones follow it.
+        std::sort(ranges.begin(), ranges.end(), [](const std::pair < uint64_t, uint64_t > & a,
+            const std::pair < uint64_t, uint64_t > & b) {
+            return a.first != b.first ? a.first < b.first : a.second > b.second;
+        });
+        std::vector < std::pair < uint64_t, uint64_t >> kept;
+        for (const auto & range: ranges) {
+            if (!kept.empty() && range.second <= kept.back().second) {
+                unlink(SegmentPath(this -> filename, range.first, range.second).c_str());
+                continue;
+            }
+            kept.push_back(range);
+        }
+        for (const auto & hint: hints) {
+            if (std::find(kept.begin(), kept.end(), hint) == kept.end()) {
+                unlink((SegmentPath(this -> filename, hint.first, hint.second) + ".hint").c_str());
+            }
+        }
+        return kept;
+    }
+
+    // Opens a segment, starting it with the file header if it is new.
+    std::shared_ptr < Segment > OpenSegment(uint64_t first, uint64_t last) {
+        std::string path = SegmentPath(this -> filename, first, last);
+        int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            return nullptr;
+        }
+        auto segment = std::make_shared < Segment > (this -> nextSegmentId++, fd, path, first, last);
+        struct stat info;
+        segment -> size.store(fstat(fd, & info) == 0 ? info.st_size : 0);
+        if (segment -> size.load() == 0) {
+            std::string header = LogFileHeader();
+            if (!WriteFully(fd, header.data(), header.size())) {
+                return nullptr;
+            }
+            segment -> size.store(header.size());
+        }
+        segment -> Remap(this -> options.useMmap);
+        return segment;
+    }
+
+    // Rewrites a segment still in the text format in the binary one, numbering
+    // its records after everything replayed so far. Its hint, if any, listed
+    // offsets of lines and goes too.
+    bool ConvertSegment(const std::string & path) {
+        char header[LOG_FILE_HEADER];
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        ssize_t bytesRead = pread(fd, header, sizeof(header), 0);
+        close(fd);
+        if (bytesRead <= 0 || IsLogFileHeader(header, bytesRead)) {
+            return bytesRead >= 0;
+        }
+
+        std::string temporary = path + ".tmp";
+        bool ok = ConvertTextLog(path, temporary, & this -> nextSequence);
+        fd = open(temporary.c_str(), O_RDONLY);
+        ok = ok && fd >= 0 && fdatasync(fd) == 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+        unlink((path + ".hint").c_str());
+        if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+            unlink(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Reads `size` bytes of a segment from `offset` on.
+    static bool ReadAt(int fd, size_t offset, size_t size, std::string * contents) {
+        contents -> resize(size);
+        size_t bytesRead = 0;
+        while (bytesRead < size) {
+            ssize_t result = pread(fd, & ( * contents)[bytesRead], size - bytesRead, offset + bytesRead);
+            if (result <= 0) {
+                return false;
+            }
+            bytesRead += result;
+        }
+        return true;
+    }
+
+    // Adds every record of a segment to the index, counting what it
+    // overwrites as dead: first whatever its hint covers, then the records
+    // written after that. The records of a write only go in once its last
+    // one is read. A record that is cut off or fails its checksum is skipped
+    // up to the next one that parses, along with the rest of its write, and
+    // counted as dead so compaction drops it. Sets `end` to where the last
+    // intact write ends; past it there is nothing that parses. Returns false
+    // if the segment can't be read.
+    bool Replay(Segment & segment, size_t * end) {
+        size_t position = std::max(this -> LoadHint(segment), LOG_FILE_HEADER);
+        size_t size = segment.size.load();
+        * end = std::min(position, size);
+        std::string contents;
+        if (position >= size) {
+            return true;
+        }
+        if (!ReadAt(segment.fd, position, size - position, & contents)) {
+            return false;
+        }
+
+        std::vector < std::pair < std::string, IndexEntry >> pending;
+        size_t offset = 0;
+        size_t intact = 0;
+        LogRecord record;
+        while (offset < contents.size()) {
+            size_t length = ParseLogRecord(contents.data() + offset, contents.size() - offset, & record);
+            if (length == 0) {
+                size_t next = offset + 1;
+                while (next < contents.size() &&
+                    ParseLogRecord(contents.data() + next, contents.size() - next, & record) == 0) {
+                    ++next;
+                }
+                if (next == contents.size()) {
+                    break;
+                }
+                std::cerr << absl::StrFormat("%s: skipped %d unreadable bytes at offset %d", segment.path,
+                    next - intact, position + intact) << std::endl;
+                segment.deadBytes += next - intact;
+                pending.clear();
+                offset = next;
+                intact = next;
+                continue;
+            }
+            pending.push_back({
+                std::string(record.key, record.keyLength),
+                {
+                    segment.id,
+                    (record.flags & LOG_TOMBSTONE) != 0,
+                    static_cast < off_t > (position + offset),
+                    length
+                }
+            });
+            this -> nextSequence = std::max(this -> nextSequence, record.sequence + 1);
+            offset += length;
+            if (record.flags & LOG_CONTINUED) {
+                continue;
+            }
+            for (const auto & entry: pending) {
+                IndexEntry replaced;
+                if (this -> hashindex.Put(entry.first, entry.second, & replaced)) {
+                    this -> CountDead(replaced);
+                }
+            }
+            pending.clear();
+            intact = offset;
+        }
+        * end = position + intact;
+        return true;
+    }
+
+    // Loads a segment's hint into the index and returns how many bytes of the
+    // segment it covers, 0 if there is no usable hint.
+    size_t LoadHint(Segment & segment) {
+        std::ifstream hint(segment.path + ".hint", std::ios::binary);
+        std::string contents((std::istreambuf_iterator < char > (hint)), std::istreambuf_iterator < char > ());
+        if (contents.size() < HINT_HEADER_BYTES) {
+            return 0;
+        }
+        uint32_t magic, version;
+        uint64_t count, coveredBytes, sequence;
+        memcpy( & magic, contents.data(), 4);
+        memcpy( & version, contents.data() + 4, 4);
+        memcpy( & count, contents.data() + 8, 8);
+        memcpy( & coveredBytes, contents.data() + 16, 8);
+        memcpy( & sequence, contents.data() + 24, 8);
+        if (magic != HINT_MAGIC || version != HINT_VERSION || coveredBytes > segment.size.load()) {
+            return 0;
+        }
+
+        // Check the whole hint before the index sees any of it.
+        std::vector < std::pair < std::string, IndexEntry >> entries;
+        entries.reserve(count);
+        size_t position = HINT_HEADER_BYTES;
+        size_t liveBytes = 0;
+        for (uint64_t i = 0; i < count; ++i) {
+            uint32_t keyLength, length;
+            uint64_t offset;
+            if (position + HINT_ENTRY_BYTES > contents.size()) {
+                return 0;
+            }
+            memcpy( & keyLength, contents.data() + position, 4);
+            memcpy( & length, contents.data() + position + 4, 4);
+            memcpy( & offset, contents.data() + position + 8, 8);
+            bool deleted = contents[position + 16] != 0;
+            position += HINT_ENTRY_BYTES;
+            // Every record lies inside the covered bytes.
+            if (position + keyLength > contents.size() || offset < LOG_FILE_HEADER ||
+                length < LOG_RECORD_HEADER || offset + length > coveredBytes) {
+                return 0;
+            }
+            entries.push_back({
+                contents.substr(position, keyLength),
+                {
+                    segment.id,
+                    deleted,
+                    static_cast < off_t > (offset),
+                    length
+                }
+            });
+            position += keyLength;
+            liveBytes += length;
+        }
+        if (position != contents.size() || liveBytes > coveredBytes) {
+            return 0;
+        }
+
+        for (const auto & entry: entries) {
+            IndexEntry replaced;
+            if (this -> hashindex.Put(entry.first, entry.second, & replaced)) {
+                this -> CountDead(replaced);
+            }
+        }
+        this -> nextSequence = std::max(this -> nextSequence, sequence);
+        segment.deadBytes += coveredBytes - liveBytes;
+        segment.hintedBytes.store(coveredBytes);
+        return coveredBytes;
+    }
+
+    // Where the last record of each key in the first `size` bytes of a
+    // segment is, and the sequence number after the newest of them.
+    bool ReadEntries(const Segment & segment, size_t size,
+        std::vector < std::pair < std::string, IndexEntry >> * entries, uint64_t * sequence) {
+        std::string contents;
+        if (!ReadAt(segment.fd, 0, size, & contents)) {
+            return false;
+        }
+
+        std::unordered_map < std::string, IndexEntry > latest;
+        size_t position = LOG_FILE_HEADER;
+        LogRecord record;
+        * sequence = 0;
+        while (position < size) {
+            size_t length = ParseLogRecord(contents.data() + position, size - position, & record);
+            if (length == 0) {
+                return false;
+            }
+            latest[std::string(record.key, record.keyLength)] = {
+                segment.id,
+                (record.flags & LOG_TOMBSTONE) != 0,
+                static_cast < off_t > (position),
+                length
+            };
+            * sequence = std::max( * sequence, record.sequence + 1);
+            position += length;
+        }
+        entries -> assign(latest.begin(), latest.end());
+        return true;
+    }
+
+    // Replaces a segment's hint with one listing `entries`, which must cover
+    // its first `coveredBytes`, whose records are all numbered below `sequence`.
+    bool WriteHint(Segment & segment, size_t coveredBytes,
+        const std::vector < std::pair < std::string, IndexEntry >> & entries, uint64_t sequence) {
+        std::string buffer(HINT_HEADER_BYTES, '\0');
+        uint64_t count = entries.size();
+        uint64_t covered = coveredBytes;
+        memcpy( & buffer[0], & HINT_MAGIC, 4);
+        memcpy( & buffer[4], & HINT_VERSION, 4);
+        memcpy( & buffer[8], & count, 8);
+        memcpy( & buffer[16], & covered, 8);
+        memcpy( & buffer[24], & sequence, 8);
+        for (const auto & entry: entries) {
+            uint32_t keyLength = entry.first.size();
+            uint32_t length = entry.second.length;
+            uint64_t offset = entry.second.offset;
+            char deleted = entry.second.deleted ? 1 : 0;
+            buffer.append(reinterpret_cast < const char * > ( & keyLength), 4);
+            buffer.append(reinterpret_cast < const char * > ( & length), 4);
+            buffer.append(reinterpret_cast < const char * > ( & offset), 8);
+            buffer.append( & deleted, 1);
+            buffer.append(entry.first);
+        }
+
+        std::string path = segment.path + ".hint";
+        std::string temporary = path + ".tmp";
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = WriteFully(fd, buffer.data(), buffer.size()) && fdatasync(fd) == 0;
+        close(fd);
+        if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+            unlink(temporary.c_str());
+            return false;
+        }
+        segment.hintedBytes.store(coveredBytes);
+        return true;
+    }
+
+    // Gives every sealed segment, and with `includeActive` the active one
+    // too, a hint covering all of it.
+    void WriteHints(bool includeActive) {
+        absl::MutexLock compactLock( & this -> compactMutex);
+        ScopedSpan span("write hints");
+        std::shared_ptr < const SegmentMap > segments = std::atomic_load( & this -> segments);
+        uint64_t newest = 0;
+        for (const auto & entry: * segments) {
+            newest = std::max(newest, entry.second -> first);
+        }
+        for (const auto & entry: * segments) {
+            Segment & segment = * entry.second;
+            size_t size = segment.size.load();
+            if ((segment.first == newest && !includeActive) || size <= LOG_FILE_HEADER || segment.hintedBytes.load() == size) {
+                continue;
+            }
+            std::vector < std::pair < std::string, IndexEntry >> entries;
+            uint64_t sequence;
+            if (this -> ReadEntries(segment, size, & entries, & sequence)) {
+                this -> WriteHint(segment, size, entries, sequence);
+            }
+        }
+    }
+
+    void CountDead(const IndexEntry & entry) {
+        std::shared_ptr < const SegmentMap > segments = std::atomic_load( & this -> segments);
+        auto found = segments -> find(entry.segment);
+        if (found != segments -> end()) {
+            found -> second -> deadBytes += entry.length;
+        }
+    }
+
+    void Publish(const std::vector < std::shared_ptr < Segment >> & added,
+        const std::vector < std::shared_ptr < Segment >> & removed) {
+        absl::MutexLock lock( & this -> segmentsMutex);
+        auto segments = std::make_shared < SegmentMap > ( * std::atomic_load( & this -> segments));
+        for (const auto & segment: added) {
+            ( * segments)[segment -> id] = segment;
+        }
+        for (const auto & segment: removed) {
+            segments -> erase(segment -> id);
+        }
+        std::atomic_store( & this -> segments, std::shared_ptr < const SegmentMap > (segments));
+    }
+
+    // Starts a new active segment. Called with appendMutex held.
+    bool Seal() {
+        if (this -> active -> size.load() <= LOG_FILE_HEADER) {
+            return true;
+        }
+        ScopedSpan span("seal");
+        std::shared_ptr < Segment > next = this -> OpenSegment(this -> nextNumber, this -> nextNumber);
+        if (!next) {
+            return false;
+        }
+        ++this -> nextNumber;
+        if (this -> options.durability.mode != Durability::NONE) {
+            this -> options.io -> Sync(this -> active -> fd);
+        }
+        this -> Publish({
+            next
+        }, {});
+        this -> active = next;
+        return true;
+    }
+
+    void WriteLoop() {
+        const Durability & durability = this -> options.durability;
+        bool dirty = false;
+        auto lastSync = std::chrono::steady_clock::now();
+
+        while (true) {
+            std::vector < PendingAppend > batch;
+            bool stopped;
+            {
+                absl::MutexLock lock( & this -> queueMutex);
+                auto ready = [this]() {
+                    this -> queueMutex.AssertHeld();
+                    return !this -> queue.empty() || this -> stopping;
+                };
+                if (durability.mode == Durability::INTERVAL && dirty) {
+                    this -> queueMutex.AwaitWithTimeout(absl::Condition( & ready),
+                        absl::Milliseconds(durability.intervalMs));
+                } else {
+                    this -> queueMutex.Await(absl::Condition( & ready));
+                }
+                batch.swap(this -> queue);
+                stopped = this -> stopping;
+            }
+
+            if (!batch.empty()) {
+                dirty = this -> Commit(batch) || dirty;
+            }
+
+            if (dirty && durability.mode == Durability::INTERVAL &&
+                (stopped || std::chrono::steady_clock::now() - lastSync >= std::chrono::milliseconds(durability.intervalMs))) {
+                absl::MutexLock lock( & this -> appendMutex);
+                ScopedSpan span("flush");
+                this -> options.io -> Sync(this -> active -> fd);
+                dirty = false;
+                lastSync = std::chrono::steady_clock::now();
+            }
+
+            if (stopped && batch.empty()) {
+                return;
+            }
+        }
+    }
+
+    // Writes one batch and acknowledges it. Returns whether anything was
+    // written that still needs an fdatasync.
+    bool Commit(std::vector < PendingAppend > & batch) {
+        ScopedSpan span("commit", batch.size());
+        absl::MutexLock lock( & this -> appendMutex);
+        bool ok = !this -> closed;
+        if (ok && this -> active -> size.load() >= this -> options.segmentBytes) {
+            ok = this -> Seal();
+            absl::MutexLock compactLock( & this -> queueMutex);
+            this -> compactWanted = true;
+        }
+        if (!ok) {
+            for (auto & record: batch) {
+                if (record.done) {
+                    record.done(false);
+                }
+            }
+            return false;
+        }
+
+        thread_local std::string buffer;
+        thread_local std::vector < size_t > lengths;
+        buffer.clear();
+        lengths.clear();
+        {
+            ScopedSpan encode("encode", batch.size());
+            for (const auto & record: batch) {
+                uint8_t flags = (record.deleted ? LOG_TOMBSTONE : 0) | (record.done ? 0 : LOG_CONTINUED);
+                lengths.push_back(AppendLogRecord( & buffer, this -> nextSequence++, flags, record.key, record.value));
+            }
+        }
+
+        Segment & segment = * this -> active;
+        size_t offset = segment.size.load();
+        {
+            bool sync = this -> options.durability.mode == Durability::BATCH;
+            ScopedSpan append(sync ? "append and flush" : "append", buffer.size());
+            ok = this -> options.io -> Write(segment.fd, buffer.data(), buffer.size(), offset, sync);
+        }
+        if (!ok) {
+            for (auto & record: batch) {
+                if (record.done) {
+                    record.done(false);
+                }
+            }
+            return false;
+        }
+
+        // Publish the new size before the index entries so a reader that
+        // finds an entry also sees bytes covering it. The whole batch becomes
+        // visible at once, which is what makes a WriteBatch atomic to readers.
+        ScopedSpan publish("index update", batch.size());
+        segment.Extend(offset + buffer.size(), this -> options.useMmap);
+        std::vector < std::pair < std::string, IndexEntry >> entries;
+        entries.reserve(batch.size());
+        for (size_t i = 0; i < batch.size(); ++i) {
+            entries.push_back({
+                batch[i].key,
+                {
+                    segment.id,
+                    batch[i].deleted,
+                    static_cast < off_t > (offset),
+                    lengths[i]
+                }
+            });
+            offset += lengths[i];
+        }
+        std::vector < IndexEntry > replaced;
+        this -> hashindex.PutAll(entries, & replaced);
+        for (const IndexEntry & entry: replaced) {
+            this -> CountDead(entry);
+        }
+        publish.End();
+
+        ScopedSpan acknowledge("acknowledge", batch.size());
+        for (auto & record: batch) {
+            if (record.done) {
+                record.done(true);
+            }
+        }
+        return true;
+    }
+
+    void CompactLoop() {
+        while (true) {
+            bool all;
+            {
+                absl::MutexLock lock( & this -> queueMutex);
+                auto wanted = [this]() {
+                    this -> queueMutex.AssertHeld();
+                    return this -> compactWanted || this -> stopping;
+                };
+                this -> queueMutex.AwaitWithTimeout(absl::Condition( & wanted), absl::Milliseconds(COMPACT_CHECK_MS));
+                if (this -> stopping) {
+                    return;
+                }
+                all = this -> compactAllWanted;
+                this -> compactWanted = false;
+                this -> compactAllWanted = false;
+            }
+            this -> Compact(all);
+            this -> WriteHints(false);
+        }
+    }
+
+    // Compacts the sealed segments whose dead ratio reaches compactRatio, or
+    // with `all` those with any dead bytes. Each is merged with the sealed
+    // segments after it as long as their live bytes fit in one segment.
+    bool Compact(bool all) {
+        absl::MutexLock compactLock( & this -> compactMutex);
+        // Only segments that exist now, so writes going on meanwhile can't
+        // keep this going forever.
+        uint32_t newest = this -> nextSegmentId.load();
+
+        while (true) {
+            std::shared_ptr < const SegmentMap > segments = std::atomic_load( & this -> segments);
+            std::vector < std::shared_ptr < Segment >> sealed;
+            for (const auto & entry: * segments) {
+                sealed.push_back(entry.second);
+            }
+            std::sort(sealed.begin(), sealed.end(), [](const std::shared_ptr < Segment > & a,
+                const std::shared_ptr < Segment > & b) {
+                return a -> first < b -> first;
+            });
+            // The newest segment is the active one.
+            sealed.pop_back();
+
+            size_t start = 0;
+            while (start < sealed.size() && (sealed[start] -> id >= newest ||
+                    (all ? sealed[start] -> deadBytes.load() == 0 : sealed[start] -> DeadRatio() < this -> options.compactRatio))) {
+                ++start;
+            }
+            if (start == sealed.size()) {
+                return true;
+            }
+
+            size_t end = start + 1;
+            size_t live = sealed[start] -> size.load() - sealed[start] -> deadBytes.load();
+            while (end < sealed.size() && sealed[end] -> id < newest) {
+                size_t more = sealed[end] -> size.load() - sealed[end] -> deadBytes.load();
+                if (live + more > this -> options.segmentBytes) {
+                    break;
+                }
+                live += more;
+                ++end;
+            }
+
+            std::vector < std::shared_ptr < Segment >> run(sealed.begin() + start, sealed.begin() + end);
+            if (!this -> Merge(run, start == 0)) {
+                return false;
+            }
+        }
+    }
+
+    // Writes the records of `run` the index still points at into one new
+    // segment covering the run's range, then switches the index over to it.
+    // Tombstones are only dropped when there is nothing older for them to hide.
+    bool Merge(const std::vector < std::shared_ptr < Segment >> & run, bool dropTombstones) {
+        auto start = std::chrono::steady_clock::now();
+        ScopedSpan span("compact merge", run.size());
+        uint64_t first = run.front() -> first;
+        uint64_t last = run.back() -> last;
+        std::string path = SegmentPath(this -> filename, first, last);
+        std::string temporary = path + ".tmp";
+        int out = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            return false;
+        }
+
+        uint32_t id = this -> nextSegmentId++;
+        std::vector < IndexMove > moves;
+        std::string buffer = LogFileHeader();
+        size_t written = 0;
+        uint64_t sequence = 0;
+        bool ok = true;
+        for (const auto & segment: run) {
+            std::string contents;
+            {
+                ScopedSpan read("compact read", segment -> size.load());
+                if (!ReadAt(segment -> fd, 0, segment -> size.load(), & contents)) {
+                    ok = false;
+                    break;
+                }
+            }
+
+            ScopedSpan copy("compact copy", contents.size());
+            size_t position = LOG_FILE_HEADER;
+            LogRecord record;
+            while (size_t length = ParseLogRecord(contents.data() + position, contents.size() - position, & record)) {
+                std::string key(record.key, record.keyLength);
+                IndexEntry entry;
+                if (this -> hashindex.Find(key, & entry) &&
+                    entry.segment == segment -> id && entry.offset == static_cast < off_t > (position)) {
+                    if (entry.deleted && dropTombstones) {
+                        moves.push_back({
+                            key,
+                            entry,
+                            entry,
+                            true
+                        });
+                    } else {
+                        moves.push_back({
+                            key,
+                            entry,
+                            {
+                                id,
+                                entry.deleted,
+                                static_cast < off_t > (written + buffer.size()),
+                                length
+                            },
+                            false
+                        });
+                        // The rest of its write may not survive the merge,
+                        // so a copy always stands on its own.
+                        if (record.flags & LOG_CONTINUED) {
+                            AppendLogRecord( & buffer, record.sequence, record.flags & ~LOG_CONTINUED,
+                                key, std::string(record.value, record.valueLength));
+                        } else {
+                            buffer.append(contents, position, length);
+                        }
+                        sequence = std::max(sequence, record.sequence + 1);
+                    }
+                }
+                position += length;
+            }
+            copy.End();
+
+            if (buffer.size() >= COMPACT_BUFFER_BYTES) {
+                ScopedSpan write("compact write", buffer.size());
+                ok = WriteFully(out, buffer.data(), buffer.size());
+                written += buffer.size();
+                buffer.clear();
+            }
+            if (!ok) {
+                break;
+            }
+        }
+        {
+            ScopedSpan write("compact write and flush", buffer.size());
+            ok = ok && WriteFully(out, buffer.data(), buffer.size()) && fdatasync(out) == 0;
+        }
+        written += buffer.size();
+        close(out);
+        // A hint left from what used to have this name would not match.
+        unlink((path + ".hint").c_str());
+        if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+            unlink(temporary.c_str());
+            return false;
+        }
+
+        int fd = open(path.c_str(), O_RDWR);
+        if (fd < 0) {
+            return false;
+        }
+        auto merged = std::make_shared < Segment > (id, fd, path, first, last);
+        merged -> size.store(written);
+        merged -> Remap(this -> options.useMmap);
+
+        std::vector < std::pair < std::string, IndexEntry >> hint;
+        for (const IndexMove & move: moves) {
+            if (!move.erase) {
+                hint.push_back({
+                    move.key,
+                    move.to
+                });
+            }
+        }
+        this -> WriteHint( * merged, written, hint, sequence);
+
+        ScopedSpan publish("compact index update", moves.size());
+        this -> Publish({
+            merged
+        }, {});
+        merged -> deadBytes += this -> hashindex.MoveAll(moves);
+        this -> Publish({}, run);
+        publish.End();
+        for (const auto & segment: run) {
+            if (segment -> path != path) {
+                unlink(segment -> path.c_str());
+                unlink((segment -> path + ".hint").c_str());
+            }
+        }
+        ++this -> compactions;
+        this -> compactionMicros += std::chrono::duration_cast < std::chrono::microseconds > (
+            std::chrono::steady_clock::now() - start).count();
+        return true;
+    }
+
+    const std::string filename;
+    const LogOptions options;
+    std::thread writer;
+    std::thread compactor;
+
+    ShardedIndex hashindex;
+    std::atomic < uint32_t > nextSegmentId {
+        0
+    };
+    // Only accessed through std::atomic_load / std::atomic_store, replaced
+    // under segmentsMutex.
+    std::shared_ptr < const SegmentMap > segments;
+    absl::Mutex segmentsMutex;
+
+    // Held by the log writer for every batch.
+    absl::Mutex appendMutex;
+    std::shared_ptr < Segment > active;
+    uint64_t nextNumber = 0;
+    uint64_t nextSequence = 0;
+    bool closed = false;
+
+    absl::Mutex compactMutex;
+    // Merges done, and the time they took.
+    std::atomic < uint64_t > compactions {
+        0
+    };
+    std::atomic < uint64_t > compactionMicros {
+        0
+    };
+
+    absl::Mutex queueMutex;
+    std::vector < PendingAppend > queue;
+    bool stopping = false;
+    bool compactWanted = false;
+    // Set by CompactAll, for the compactor to take any dead bytes at all.
+    bool compactAllWanted = false;
+};
+
+// Reads the current value of a key from an opened file, "" if it has none.
+// Returns false only if the file could not be read.
+typedef std::function < bool(const std::string & key, std::string * value) > KeyReader;
+
+// Reads several keys at once like a KeyReader, one value per key in order.
+typedef std::function < bool(const std::vector < std::string > & keys, std::vector < std::string > * values) > KeysReader;
+
+const size_t SCAN_BATCH_RECORDS = 1000;
+const size_t SCAN_BATCH_BYTES = 1 << 20;
+
+const size_t BULK_LOAD_CHUNK_BYTES = 4 << 20;
+const int BULK_LOAD_CHUNKS_IN_FLIGHT = 4;
+
+// One BulkLoad stream. Records are gathered into chunks of about
+// BULK_LOAD_CHUNK_BYTES that go to the log writer whole, so each chunk is one
+// large sequential write and one index update. Reading the stream pauses
+// while BULK_LOAD_CHUNKS_IN_FLIGHT chunks are waiting to be committed.
+struct BulkLoadState {
+    bool HasRoom() const {
+        return this -> inFlight < BULK_LOAD_CHUNKS_IN_FLIGHT;
+    }
+
+    bool Drained() const {
+        return this -> inFlight == 0;
+    }
+
+    // Only touched by whoever is reading the stream.
+    std::string filename;
+    std::vector < PendingAppend > chunk;
+    size_t chunkBytes = 0;
+
+    absl::Mutex mutex;
+    int inFlight = 0;
+    uint64_t loaded = 0;
+    bool failed = false;
+    // Runs after every committed chunk, the async server resumes from it.
+    std::function < void() > onCommitted;
+};
+
+// Records the latency of a method that started at `start`, and its span when
+// tracing.
+void RecordMethod(StatsMethod method, std::chrono::steady_clock::time_point start, bool ok) {
+    ServerStats::Get().RecordLatency(method, start, ok);
+    if (Tracer::Get().Enabled()) {
+        uint64_t startNanos = std::chrono::duration_cast < std::chrono::nanoseconds > (start.time_since_epoch()).count();
+        Tracer::Get().Record(STATS_METHOD_NAMES[method], startNanos, TraceNow(), 0);
+    }
+}
+
+// Records the latency of a unary handler as it returns, as an error unless it
+// replied "ok".
+template < typename Response >
+    class HandlerTimer {
+        public: HandlerTimer(StatsMethod method,
+            const Response * reply): method(method),
+        reply(reply),
+        start(std::chrono::steady_clock::now()) {}
+
+        ~HandlerTimer() {
+            RecordMethod(this -> method, this -> start, this -> reply -> status() == "ok");
+        }
+
+        private: StatsMethod method;
+        const Response * reply;
+        std::chrono::steady_clock::time_point start;
+    };
+
+// Logic and data behind the server's behavior. With useLsm every file is an
+// LsmStore directory instead of a log, and writes go through its writer
+// thread rather than a log writer.
 class StoreServiceImpl final: public Store::Service {
-    public: Status Open(ServerContext * context,
+    public: StoreServiceImpl(LogOptions logOptions, bool useLsm, LsmOptions lsmOptions, size_t cacheBytes): logOptions(logOptions),
+    useLsm(useLsm),
+    lsmOptions(lsmOptions),
+    cache(cacheBytes > 0 ? new ValueCache(cacheBytes) : nullptr) {}
+
+    Status Open(ServerContext * context,
         const OpenRequest * request,
             OpenResponse * reply) {
 
-        this -> opened.insert(request -> filename());
-        if (this -> hashindex.find(request -> filename()) == this -> hashindex.end()) {
-            std::ifstream file(request -> filename());
-            if (!file) {
-                std::ofstream createFile(request -> filename());
-                createFile.close();
-                file.open(request -> filename());
+        HandlerTimer < OpenResponse > timer(STATS_OPEN, reply);
+        absl::MutexLock loadLock( & this -> loadMutex);
+        if (this -> useLsm) {
+            if (!this -> FindLsm(request -> filename())) {
+                std::shared_ptr < LsmStore > store = LsmStore::Open(request -> filename(), this -> lsmOptions);
+                if (!store) {
+                    reply -> set_status("not ok");
+                    return Status::OK;
+                }
+                absl::WriterMutexLock lock( & this -> openedMutex);
+                this -> lsmOpened.emplace(request -> filename(), store);
+            }
+            reply -> set_status("ok");
+            return Status::OK;
+        }
+
+        if (this -> Find(request -> filename())) {
+            reply -> set_status("ok");
+            return Status::OK;
+        }
+
+        std::shared_ptr < LogFile > file = LogFile::Open(request -> filename(), this -> logOptions);
+        if (!file) {
+            reply -> set_status("not ok");
+            return Status::OK;
+        }
+
+        {
+            absl::WriterMutexLock lock( & this -> openedMutex);
+            this -> opened.emplace(request -> filename(), file);
+        }
+
+        reply -> set_status("ok");
+        return Status::OK;
+    }
+
+    Status GetKey(ServerContext * context,
+        const GetRequest * request,
+            GetResponse * reply) {
+
+        HandlerTimer < GetResponse > timer(STATS_GET_KEY, reply);
+        KeyReader read = this -> ReaderFor(request -> filename());
+        if (!read) {
+            reply -> set_status("not ok");
+            reply -> set_value("");
+            return Status::OK;
+        }
+
+        std::string value;
+        if (!read(request -> key(), & value)) {
+            reply -> set_value("");
+            reply -> set_status("not ok");
+            return Status::OK;
+        }
+
+        ServerStats::Get().AddBytesRead(value.size());
+        reply -> set_value(value);
+        reply -> set_status("ok");
+        return Status::OK;
+    }
+
+    Status MultiGet(ServerContext * context,
+        const MultiGetRequest * request,
+            MultiGetResponse * reply) {
+
+        HandlerTimer < MultiGetResponse > timer(STATS_MULTI_GET, reply);
+        KeysReader read = this -> KeysReaderFor(request -> filename());
+        if (!read) {
+            reply -> set_status("not ok");
+            return Status::OK;
+        }
+
+        std::vector < std::string > keys(request -> keys().begin(), request -> keys().end());
+        std::vector < std::string > values;
+        if (!read(keys, & values)) {
+            reply -> set_status("not ok");
+            return Status::OK;
+        }
+
+        size_t bytes = 0;
+        for (std::string & value: values) {
+            bytes += value.size();
+            reply -> add_values(std::move(value));
+        }
+        ServerStats::Get().AddBytesRead(bytes);
+        reply -> set_status("ok");
+        return Status::OK;
+    }
+
+    Status SetKey(ServerContext * context,
+        const SetRequest * request,
+            SetResponse * reply) {
+
+        absl::Notification committed;
+        this -> StartSetKey(request, reply, [ & committed]() {
+            committed.Notify();
+        });
+        committed.WaitForNotification();
+        return Status::OK;
+    }
+
+    Status DeleteKey(ServerContext * context,
+        const DeleteRequest * request,
+            DeleteResponse * reply) {
+
+        absl::Notification committed;
+        this -> StartDeleteKey(request, reply, [ & committed]() {
+            committed.Notify();
+        });
+        committed.WaitForNotification();
+        return Status::OK;
+    }
+
+    Status WriteBatch(ServerContext * context,
+        const WriteBatchRequest * request,
+            WriteBatchResponse * reply) {
+
+        absl::Notification committed;
+        this -> StartWriteBatch(request, reply, [ & committed]() {
+            committed.Notify();
+        });
+        committed.WaitForNotification();
+        return Status::OK;
+    }
+
+    Status BulkLoad(ServerContext * context,
+        grpc::ServerReader < BulkLoadRequest > * reader,
+            BulkLoadResponse * reply) {
+
+        auto load = std::make_shared < BulkLoadState > ();
+        BulkLoadRequest request;
+        while (reader -> Read( & request)) {
+            this -> AddToBulkLoad(load, request);
+
+            absl::MutexLock lock( & load -> mutex);
+            load -> mutex.Await(absl::Condition(load.get(), & BulkLoadState::HasRoom));
+        }
+        this -> FlushBulkLoad(load);
+
+        absl::MutexLock lock( & load -> mutex);
+        load -> mutex.Await(absl::Condition(load.get(), & BulkLoadState::Drained));
+        reply -> set_status(load -> failed ? "not ok" : "ok");
+        reply -> set_loaded(load -> loaded);
+        return Status::OK;
+    }
+
+    void AddToBulkLoad(const std::shared_ptr < BulkLoadState > & load,
+        const BulkLoadRequest & request) {
+
+        if (load -> filename.empty()) {
+            load -> filename = request.filename();
+        }
+        for (const KeyValue & record: request.records()) {
+            load -> chunk.push_back({
+                record.key(),
+                record.value(),
+                false,
+                nullptr
+            });
+            load -> chunkBytes += record.key().size() + record.value().size() + 2;
+            if (load -> chunkBytes >= BULK_LOAD_CHUNK_BYTES) {
+                this -> FlushBulkLoad(load);
             }
+        }
+    }
 
-            std::string line;
-            std::streampos position = 0;
-            while (std::getline(file, line)) {
-                std::istringstream lineStream(line);
-                std::string key, value;
-                if (lineStream >> key >> value) {
-                    this -> hashindex[request -> filename()][key] = position;
+    // Hands the gathered chunk to the log writer as one submission.
+    void FlushBulkLoad(const std::shared_ptr < BulkLoadState > & load) {
+        if (load -> chunk.empty()) {
+            return;
+        }
+
+        {
+            absl::MutexLock lock( & load -> mutex);
+            ++load -> inFlight;
+        }
+        size_t count = load -> chunk.size();
+        size_t bytes = 0;
+        for (const PendingAppend & record: load -> chunk) {
+            bytes += record.key.size() + record.value.size();
+        }
+        load -> chunk.back().done = [load, count, bytes](bool ok) {
+            if (ok) {
+                ServerStats::Get().AddBytesWritten(bytes);
+            }
+            std::function < void() > onCommitted;
+            {
+                absl::MutexLock lock( & load -> mutex);
+                --load -> inFlight;
+                if (ok) {
+                    load -> loaded += count;
+                } else {
+                    load -> failed = true;
                 }
-                position = file.tellg();
+                onCommitted = load -> onCommitted;
+            }
+            if (onCommitted) {
+                onCommitted();
+            }
+        };
+        this -> Append(load -> filename, load -> chunk);
+        load -> chunk.clear();
+        load -> chunkBytes = 0;
+    }
+
+    // Writes finish on the log writer thread: `done` runs once the record has
+    // been committed and the reply filled in. The sync handlers above block on
+    // it, the async server replies straight from the callback. Either way the
+    // latency recorded is up to the commit.
+    void StartSetKey(const SetRequest * request,
+        SetResponse * reply,
+        std::function < void() > done) {
+
+        auto start = std::chrono::steady_clock::now();
+        size_t bytes = request -> key().size() + request -> value().size();
+        std::vector < PendingAppend > records;
+        records.push_back({
+            request -> key(),
+            request -> value(),
+            false,
+            [reply, done, start, bytes](bool ok) {
+                reply -> set_status(ok ? "ok" : "not ok");
+                RecordWrite(STATS_SET_KEY, start, bytes, ok);
+                done();
+            }
+        });
+        this -> Append(request -> filename(), records);
+    }
+
+    // The operations are queued together, so the log writer commits them in
+    // one write and publishes their index entries at once.
+    void StartWriteBatch(const WriteBatchRequest * request,
+        WriteBatchResponse * reply,
+        std::function < void() > done) {
+
+        auto start = std::chrono::steady_clock::now();
+        size_t bytes = 0;
+        std::vector < PendingAppend > records;
+        for (const WriteOperation & operation: request -> operations()) {
+            records.push_back({
+                operation.key(),
+                operation.value(),
+                operation.is_delete(),
+                nullptr
+            });
+            bytes += operation.key().size() + operation.value().size();
+        }
+        if (records.empty()) {
+            reply -> set_status("ok");
+            RecordWrite(STATS_WRITE_BATCH, start, 0, true);
+            done();
+            return;
+        }
+        records.back().done = [reply, done, start, bytes](bool ok) {
+            reply -> set_status(ok ? "ok" : "not ok");
+            RecordWrite(STATS_WRITE_BATCH, start, bytes, ok);
+            done();
+        };
+        this -> Append(request -> filename(), records);
+    }
+
+    void StartDeleteKey(const DeleteRequest * request,
+        DeleteResponse * reply,
+        std::function < void() > done) {
+
+        auto start = std::chrono::steady_clock::now();
+        size_t bytes = request -> key().size();
+        std::vector < PendingAppend > records;
+        records.push_back({
+            request -> key(),
+            "",
+            true,
+            [reply, done, start, bytes](bool ok) {
+                reply -> set_status(ok ? "ok" : "not ok");
+                RecordWrite(STATS_DELETE_KEY, start, bytes, ok);
+                done();
             }
-            file.close();
+        });
+        this -> Append(request -> filename(), records);
+    }
+
+    Status Scan(ServerContext * context,
+        const ScanRequest * request,
+            grpc::ServerWriter < ScanResponse > * writer) {
+
+        uint64_t remaining;
+        std::unique_ptr < LsmIterator > records = this -> StartScan(request, & remaining);
+        ScanResponse reply;
+        if (!records) {
+            reply.set_status("not ok");
+            writer -> Write(reply);
+            return Status::OK;
         }
 
-        reply -> set_status("ok");
+        bool more = true;
+        while (more) {
+            reply.Clear();
+            more = this -> FillScanBatch( * records, & remaining, & reply);
+            if (!writer -> Write(reply)) {
+                break;
+            }
+        }
         return Status::OK;
     }
 
-    Status GetKey(ServerContext * context,
-        const GetRequest * request,
-            GetResponse * reply) {
+    // The records a Scan walks, nullptr if the file isn't opened by the lsm
+    // engine. `remaining` is how many may still be sent.
+    std::unique_ptr < LsmIterator > StartScan(const ScanRequest * request, uint64_t * remaining) {
+        std::shared_ptr < LsmStore > store = this -> FindLsm(request -> filename());
+        if (!store) {
+            return nullptr;
+        }
+        * remaining = request -> limit() > 0 ? request -> limit() : UINT64_MAX;
+        return store -> Scan(request -> start(), request -> end());
+    }
 
-        if (this -> opened.find(request -> filename()) == this -> opened.end()) {
+    // Fills one reply of up to SCAN_BATCH_RECORDS records or about
+    // SCAN_BATCH_BYTES. Returns whether there is more to send after it.
+    bool FillScanBatch(LsmIterator & records, uint64_t * remaining, ScanResponse * reply) {
+        size_t bytes = 0;
+        while (records.Valid() && * remaining > 0 &&
+            static_cast < size_t > (reply -> records_size()) < SCAN_BATCH_RECORDS && bytes < SCAN_BATCH_BYTES) {
+            KeyValue * record = reply -> add_records();
+            record -> set_key(records.key());
+            record -> set_value(records.value());
+            bytes += records.key().size() + records.value().size();
+            -- * remaining;
+            records.Next();
+        }
+        ServerStats::Get().AddBytesRead(bytes);
+        if (!records.ok()) {
             reply -> set_status("not ok");
-            reply -> set_value("");
-            return Status::OK;
+            return false;
         }
+        reply -> set_status("ok");
+        return records.Valid() && * remaining > 0;
+    }
 
-        std::ifstream file(request -> filename());
-        std::streampos position = this -> hashindex[request -> filename()][request -> key()];
-        file.seekg(position);
-        std::string line;
+    Status Compact(ServerContext * context,
+        const CompactRequest * request,
+            CompactResponse * reply) {
 
-        std::getline(file, line);
-        std::istringstream lineStream(line);
-        std::string storedKey, value;
-        if (lineStream >> storedKey >> value) {
-            reply -> set_status("ok");
-            reply -> set_value(value);
+        HandlerTimer < CompactResponse > timer(STATS_COMPACT, reply);
+        if (this -> useLsm) {
+            std::shared_ptr < LsmStore > store = this -> FindLsm(request -> filename());
+            reply -> set_status(store && store -> CompactAll() ? "ok" : "not ok");
             return Status::OK;
         }
-        file.close();
 
-        reply -> set_value("");
-        reply -> set_status("ok");
+        // Segments are compacted in the background as they collect dead
+        // records, this just asks for all of them now and doesn't wait for it.
+        std::shared_ptr < LogFile > file = this -> Find(request -> filename());
+        reply -> set_status(file && file -> CompactAll() ? "ok" : "not ok");
         return Status::OK;
     }
 
-    Status SetKey(ServerContext * context,
-        const SetRequest * request,
-            SetResponse * reply) {
+    Status Close(ServerContext * context,
+        const CloseRequest * request,
+            CloseResponse * reply) {
 
-        if (this -> opened.find(request -> filename()) == this -> opened.end()) {
-            reply -> set_status("not ok");
+        HandlerTimer < CloseResponse > timer(STATS_CLOSE, reply);
+        if (this -> useLsm) {
+            // The store shuts down once the last in-flight request lets go.
+            std::shared_ptr < LsmStore > store;
+            {
+                absl::WriterMutexLock lock( & this -> openedMutex);
+                auto found = this -> lsmOpened.find(request -> filename());
+                if (found == this -> lsmOpened.end()) {
+                    reply -> set_status("not ok");
+                    return Status::OK;
+                }
+                store = found -> second;
+                this -> lsmOpened.erase(found);
+            }
+            reply -> set_status("ok");
             return Status::OK;
         }
 
-        std::fstream file(request -> filename(), std::ios::in | std::ios::out);
+        std::shared_ptr < LogFile > file;
+        {
+            absl::WriterMutexLock lock( & this -> openedMutex);
+            auto found = this -> opened.find(request -> filename());
+            if (found == this -> opened.end()) {
+                reply -> set_status("not ok");
+                return Status::OK;
+            }
+            file = found -> second;
+            this -> opened.erase(found);
+        }
 
-        file.seekg(0, std::ios::end);
-        this -> hashindex[request -> filename()][request -> key()] = file.tellg();
-        file << request -> key() << " " << request -> value() << std::endl;
-        file.close();
+        // The descriptors are closed once the last in-flight reader lets go,
+        // appends still queued on it fail.
+        file -> Close();
 
         reply -> set_status("ok");
         return Status::OK;
     }
 
-    Status DeleteKey(ServerContext * context,
-        const DeleteRequest * request,
-            DeleteResponse * reply) {
+    // Merges the latencies every thread has recorded and measures the opened
+    // files, or just the one asked for.
+    Status GetStats(ServerContext * context,
+        const StatsRequest * request,
+            StatsResponse * reply) {
 
-        if (this -> opened.find(request -> filename()) == this -> opened.end()) {
-            reply -> set_status("not ok");
-            return Status::OK;
+        StatsSnapshot snapshot;
+        ServerStats::Get().Read( & snapshot);
+        for (int method = 0; method < STATS_METHODS; ++method) {
+            const Histogram & histogram = snapshot.latencies[method];
+            if (histogram.total == 0) {
+                continue;
+            }
+            MethodStats * stats = reply -> add_methods();
+            stats -> set_method(STATS_METHOD_NAMES[method]);
+            stats -> set_count(histogram.total);
+            stats -> set_errors(histogram.errors);
+            stats -> set_mean_micros(histogram.Mean());
+            stats -> set_p50_micros(histogram.Percentile(50));
+            stats -> set_p99_micros(histogram.Percentile(99));
+            stats -> set_p999_micros(histogram.Percentile(99.9));
+            stats -> set_max_micros(histogram.Percentile(100));
+            for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+                if (histogram.counts[bucket] > 0) {
+                    LatencyBucket * latency = stats -> add_buckets();
+                    latency -> set_micros(HistogramValue(bucket));
+                    latency -> set_count(histogram.counts[bucket]);
+                }
+            }
         }
+        reply -> set_bytes_read(snapshot.bytesRead);
+        reply -> set_bytes_written(snapshot.bytesWritten);
 
-        std::fstream file(request -> filename(), std::ios::in | std::ios::out);
+        std::vector < std::pair < std::string, std::shared_ptr < LogFile >>> logs;
+        std::vector < std::pair < std::string, std::shared_ptr < LsmStore >>> stores;
+        {
+            absl::ReaderMutexLock lock( & this -> openedMutex);
+            for (const auto & entry: this -> opened) {
+                if (request -> filename().empty() || entry.first == request -> filename()) {
+                    logs.push_back(entry);
+                }
+            }
+            for (const auto & entry: this -> lsmOpened) {
+                if (request -> filename().empty() || entry.first == request -> filename()) {
+                    stores.push_back(entry);
+                }
+            }
+        }
+        for (const auto & log: logs) {
+            LogStats stats = log.second -> GetStats();
+            FileStats * file = reply -> add_files();
+            file -> set_filename(log.first);
+            file -> set_engine("log");
+            file -> set_keys(stats.keys);
+            file -> set_index_bytes(stats.indexBytes);
+            file -> set_files(stats.segments);
+            file -> set_disk_bytes(stats.bytes);
+            file -> set_dead_bytes(stats.deadBytes);
+            file -> set_dead_ratio(stats.bytes == 0 ? 0 : static_cast < double > (stats.deadBytes) / stats.bytes);
+            file -> set_compactions(stats.compactions);
+            file -> set_compaction_seconds(stats.compactionSeconds);
+        }
+        for (const auto & store: stores) {
+            LsmStats stats = store.second -> GetStats();
+            FilterStats filter = store.second -> GetFilterStats();
+            FileStats * file = reply -> add_files();
+            file -> set_filename(store.first);
+            file -> set_engine("lsm");
+            file -> set_keys(stats.records);
+            file -> set_index_bytes(stats.memoryBytes);
+            file -> set_files(stats.tables);
+            file -> set_disk_bytes(stats.tableBytes);
+            file -> set_compactions(stats.merges);
+            file -> set_compaction_seconds(stats.mergeSeconds);
+            file -> set_filter_negatives(filter.negatives);
+            file -> set_filter_false_positives(filter.falsePositives);
+        }
 
-        file.seekg(0, std::ios::end);
-        this -> hashindex[request -> filename()][request -> key()] = file.tellg();
-        file << request -> key() << " deleted" << std::endl;
-        file.close();
+        if (this -> cache) {
+            CacheStats stats = this -> cache -> Stats();
+            reply -> set_cache_hits(stats.hits);
+            reply -> set_cache_misses(stats.misses);
+            reply -> set_cache_evictions(stats.evictions);
+            reply -> set_cache_bytes(stats.bytes);
+        }
 
-        reply -> set_status("ok");
+        bool found = request -> filename().empty() || reply -> files_size() > 0;
+        reply -> set_status(found ? "ok" : "not ok");
         return Status::OK;
     }
 
-    Status Compact(ServerContext * context,
-        const DeleteRequest * request,
-            DeleteResponse * reply) {
+    // Writes the spans still in every thread's ring to a file on the server.
+    Status DumpTrace(ServerContext * context,
+        const TraceRequest * request,
+            TraceResponse * reply) {
 
-        if (this -> opened.find(request -> filename()) == this -> opened.end()) {
+        size_t spans;
+        if (request -> path().empty() || !Tracer::Get().Dump(request -> path(), & spans)) {
             reply -> set_status("not ok");
             return Status::OK;
         }
+        reply -> set_spans(spans);
+        reply -> set_status("ok");
+        return Status::OK;
+    }
+
+    private: static void RecordWrite(StatsMethod method, std::chrono::steady_clock::time_point start, size_t bytes, bool ok) {
+        RecordMethod(method, start, ok);
+        if (ok) {
+            ServerStats::Get().AddBytesWritten(bytes);
+        }
+    }
+
+    std::shared_ptr < LogFile > Find(const std::string & filename) {
+        ScopedSpan span("file lookup");
+        absl::ReaderMutexLock lock( & this -> openedMutex);
+        auto found = this -> opened.find(filename);
+        return found == this -> opened.end() ? nullptr : found -> second;
+    }
+
+    std::shared_ptr < LsmStore > FindLsm(const std::string & filename) {
+        ScopedSpan span("file lookup");
+        absl::ReaderMutexLock lock( & this -> openedMutex);
+        auto found = this -> lsmOpened.find(filename);
+        return found == this -> lsmOpened.end() ? nullptr : found -> second;
+    }
+
+    // How to read keys of an opened file, through the value cache if there is
+    // one. nullptr if the file isn't opened.
+    KeyReader ReaderFor(const std::string & filename) {
+        KeyReader read = this -> EngineReaderFor(filename);
+        if (!read || !this -> cache) {
+            return read;
+        }
+        ValueCache * cache = this -> cache.get();
+        return [cache, filename, read](const std::string & key, std::string * value) {
+            std::string cacheKey = CacheKey(filename, key);
+            ScopedSpan lookup("cache lookup");
+            if (cache -> Lookup(cacheKey, value)) {
+                return true;
+            }
+            lookup.End();
+            // Taken before the read, so a write landing meanwhile keeps what
+            // we read out of the cache.
+            uint64_t token = cache -> Token(cacheKey);
+            if (!read(key, value)) {
+                return false;
+            }
+            cache -> Insert(cacheKey, * value, token);
+            return true;
+        };
+    }
+
+    // ReaderFor for a batch of keys. Only the keys the cache misses are read,
+    // together.
+    KeysReader KeysReaderFor(const std::string & filename) {
+        KeysReader read = this -> EngineKeysReaderFor(filename);
+        if (!read || !this -> cache) {
+            return read;
+        }
+        ValueCache * cache = this -> cache.get();
+        return [cache, filename, read](const std::vector < std::string > & keys, std::vector < std::string > * values) {
+            values -> assign(keys.size(), std::string());
+            std::vector < std::string > missedKeys;
+            std::vector < size_t > missed;
+            std::vector < uint64_t > tokens;
+            ScopedSpan lookup("cache lookup", keys.size());
+            for (size_t i = 0; i < keys.size(); ++i) {
+                std::string cacheKey = CacheKey(filename, keys[i]);
+                if (!cache -> Lookup(cacheKey, & ( * values)[i])) {
+                    tokens.push_back(cache -> Token(cacheKey));
+                    missedKeys.push_back(keys[i]);
+                    missed.push_back(i);
+                }
+            }
+            lookup.End();
+            if (missed.empty()) {
+                return true;
+            }
+
+            std::vector < std::string > missedValues;
+            if (!read(missedKeys, & missedValues)) {
+                return false;
+            }
+            for (size_t i = 0; i < missed.size(); ++i) {
+                cache -> Insert(CacheKey(filename, missedKeys[i]), missedValues[i], tokens[i]);
+                ( * values)[missed[i]] = std::move(missedValues[i]);
+            }
+            return true;
+        };
+    }
+
+    static std::string CacheKey(const std::string & filename, const std::string & key) {
+        std::string cacheKey;
+        cacheKey.reserve(filename.size() + 1 + key.size());
+        cacheKey.append(filename);
+        cacheKey.push_back('\0');
+        cacheKey.append(key);
+        return cacheKey;
+    }
+
+    // How to read keys of an opened file with whichever engine is in use,
+    // nullptr if it isn't opened.
+    KeyReader EngineReaderFor(const std::string & filename) {
+        if (this -> useLsm) {
+            std::shared_ptr < LsmStore > store = this -> FindLsm(filename);
+            if (!store) {
+                return nullptr;
+            }
+            return [store](const std::string & key, std::string * value) {
+                return store -> Get(key, value);
+            };
+        }
+
+        std::shared_ptr < LogFile > file = this -> Find(filename);
+        if (!file) {
+            return nullptr;
+        }
+        return [file](const std::string & key, std::string * value) {
+            return file -> Get(key, value);
+        };
+    }
+
+    // EngineReaderFor for a batch of keys. The log engine batches the reads,
+    // the LSM engine reads one key after the other.
+    KeysReader EngineKeysReaderFor(const std::string & filename) {
+        if (this -> useLsm) {
+            KeyReader read = this -> EngineReaderFor(filename);
+            if (!read) {
+                return nullptr;
+            }
+            return [read](const std::vector < std::string > & keys, std::vector < std::string > * values) {
+                values -> assign(keys.size(), std::string());
+                for (size_t i = 0; i < keys.size(); ++i) {
+                    if (!read(keys[i], & ( * values)[i])) {
+                        return false;
+                    }
+                }
+                return true;
+            };
+        }
+
+        std::shared_ptr < LogFile > file = this -> Find(filename);
+        if (!file) {
+            return nullptr;
+        }
+        return [file](const std::vector < std::string > & keys, std::vector < std::string > * values) {
+            return file -> GetAll(keys, values);
+        };
+    }
+
+    // Hands records to the log writer of the file. If the file was compacted
+    // or closed before they could be queued, they go to whatever is opened
+    // under the name now.
+    void Append(const std::string & filename,
+        std::vector < PendingAppend > & records) {
+
+        if (this -> cache) {
+            this -> EraseOnCommit(filename, records);
+        }
 
-        std::ifstream file(request -> filename());
-        std::unordered_map < std::string, std::string > reduced;
+        if (this -> useLsm) {
+            this -> AppendLsm(filename, records);
+            return;
+        }
+
+        while (true) {
+            std::shared_ptr < LogFile > file = this -> Find(filename);
+            if (!file) {
+                for (auto & record: records) {
+                    if (record.done) {
+                        record.done(false);
+                    }
+                }
+                return;
+            }
 
-        std::string line;
-        while (std::getline(file, line)) {
-            std::istringstream lineStream(line);
-            std::string key, value;
-            if (lineStream >> key >> value) {
-                reduced[key] = value;
+            if (file -> Submit(records)) {
+                return;
             }
         }
-        file.close();
+    }
 
-        std::fstream new_file(request -> filename() + "_compacted", std::ios::out);
+    // Makes each write drop the keys it wrote from the cache once it is
+    // visible to reads, whether or not it succeeded.
+    void EraseOnCommit(const std::string & filename,
+        std::vector < PendingAppend > & records) {
 
-        for (const auto & pair: reduced) {
-            if (pair.second == "deleted") {
+        auto keys = std::make_shared < std::vector < std::string >> ();
+        for (auto & record: records) {
+            keys -> push_back(CacheKey(filename, record.key));
+            if (!record.done) {
                 continue;
             }
-            this -> hashindex[request -> filename()][pair.first] = new_file.tellg();
-            new_file << pair.first << " " << pair.second << std::endl;
+            ValueCache * cache = this -> cache.get();
+            AppendDone done = std::move(record.done);
+            record.done = [cache, keys, done](bool ok) {
+                for (const std::string & key: * keys) {
+                    cache -> Erase(key);
+                }
+                done(ok);
+            };
+            keys = std::make_shared < std::vector < std::string >> ();
         }
+    }
 
-        new_file.close();
-        remove(request -> filename().c_str());
-        rename((request -> filename() + "_compacted").c_str(), request -> filename().c_str());
-        reply -> set_status("ok");
-        return Status::OK;
+    // Queues records on an LsmStore, its writer commits them together with
+    // whatever else is queued and calls their `done` from there.
+    void AppendLsm(const std::string & filename,
+        std::vector < PendingAppend > & records) {
+
+        std::shared_ptr < LsmStore > store = this -> FindLsm(filename);
+        if (!store) {
+            for (auto & record: records) {
+                if (record.done) {
+                    record.done(false);
+                }
+            }
+            records.clear();
+            return;
+        }
+
+        std::vector < Mutation > mutations;
+        mutations.reserve(records.size());
+        auto dones = std::make_shared < std::vector < AppendDone >> ();
+        for (auto & record: records) {
+            mutations.push_back({
+                std::move(record.key),
+                std::move(record.value),
+                record.deleted
+            });
+            if (record.done) {
+                dones -> push_back(std::move(record.done));
+            }
+        }
+        records.clear();
+        store -> Submit(std::move(mutations), [dones](bool ok) {
+            for (const AppendDone & done: * dones) {
+                done(ok);
+            }
+        });
     }
-    private: std::unordered_set < std::string > opened;
+
+    LogOptions logOptions;
+    bool useLsm;
+    LsmOptions lsmOptions;
+    // Held while a file is being opened, so it is never opened twice at once.
+    absl::Mutex loadMutex;
+    absl::Mutex openedMutex;
     std::unordered_map < std::string,
+    std::shared_ptr < LogFile >> opened;
     std::unordered_map < std::string,
-    std::streampos >> hashindex;
+    std::shared_ptr < LsmStore >> lsmOpened;
+    // Values read by key, nullptr without --cache_bytes. Keys are the
+    // filename and the key with a NUL between them.
+    std::unique_ptr < ValueCache > cache;
+
+};
+
+// Threads that run the async server's slow handlers, the ones that open,
+// sync or close files, so the polling threads keep serving reads and
+// writes meanwhile.
+class WorkerPool {
+    public: explicit WorkerPool(int threads) {
+        for (int i = 0; i < threads; ++i) {
+            this -> threads.emplace_back( & WorkerPool::Work, this);
+        }
+    }
+
+    ~WorkerPool() {
+        this -> Stop();
+    }
+
+    void Run(std::function < void() > job) {
+        absl::MutexLock lock( & this -> mutex);
+        this -> jobs.push_back(std::move(job));
+    }
+
+    // Runs whatever is still queued, then joins the threads.
+    void Stop() {
+        {
+            absl::MutexLock lock( & this -> mutex);
+            this -> stopping = true;
+        }
+        for (auto & thread: this -> threads) {
+            thread.join();
+        }
+        this -> threads.clear();
+    }
+
+    private: void Work() {
+        while (true) {
+            std::function < void() > job;
+            {
+                absl::MutexLock lock( & this -> mutex);
+                auto ready = [this]() {
+                    this -> mutex.AssertHeld();
+                    return !this -> jobs.empty() || this -> stopping;
+                };
+                this -> mutex.Await(absl::Condition( & ready));
+                if (this -> jobs.empty()) {
+                    return;
+                }
+                job = std::move(this -> jobs.front());
+                this -> jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    absl::Mutex mutex;
+    std::deque < std::function < void() >> jobs;
+    bool stopping = false;
+    std::vector < std::thread > threads;
+};
+
+// A call in flight on a completion queue, the tag handed to gRPC for it.
+class AsyncCall {
+    public: virtual ~AsyncCall() {}
+    virtual void Proceed(bool ok) = 0;
+};
+
+// How to wait for and serve one unary method on a completion queue.
+template < typename Request, typename Response >
+    struct AsyncMethod {
+        void(Store::AsyncService:: * request)(ServerContext * ,
+            Request * ,
+            grpc::ServerAsyncResponseWriter < Response > * ,
+            grpc::CompletionQueue * ,
+            grpc::ServerCompletionQueue * ,
+            void * );
+        Status(StoreServiceImpl:: * handle)(ServerContext * ,
+            const Request * ,
+                Response * );
+        // Set for writes, which reply from the log writer instead.
+        void(StoreServiceImpl:: * start)(const Request * ,
+            Response * ,
+                std::function < void() > );
+        // Whether handle opens, syncs or closes files and runs on a worker.
+        bool slow;
+    };
+
+// One unary RPC on a completion queue. As soon as it is matched with a client
+// it asks for the next call of the same method, so every queue always has a
+// call waiting per method, and then runs the request on the polling thread.
+// Writes only start there; they finish from the log writer once committed.
+// Slow methods are handed to a worker, which replies once it is done.
+template < typename Request, typename Response >
+    class AsyncUnaryCall final: public AsyncCall {
+        public: AsyncUnaryCall(Store::AsyncService * service,
+            StoreServiceImpl * impl,
+            WorkerPool * workers,
+            grpc::ServerCompletionQueue * cq,
+            const AsyncMethod < Request, Response > * method): service(service),
+        impl(impl),
+        workers(workers),
+        cq(cq),
+        method(method),
+        responder( & context) {
+            (service ->* (method -> request))( & context, & request, & responder, cq, cq, this);
+        }
+
+        void Proceed(bool ok) override {
+            if (finished || !ok) {
+                delete this;
+                return;
+            }
+
+            new AsyncUnaryCall(service, impl, workers, cq, method);
+            finished = true;
+            if (method -> start) {
+                (impl ->* (method -> start))( & request, & reply, [this]() {
+                    responder.Finish(reply, Status::OK, this);
+                });
+                return;
+            }
+            if (method -> slow) {
+                workers -> Run([this]() {
+                    Status status = (impl ->* (method -> handle))( & context, & request, & reply);
+                    responder.Finish(reply, status, this);
+                });
+                return;
+            }
+            Status status = (impl ->* (method -> handle))( & context, & request, & reply);
+            responder.Finish(reply, status, this);
+        }
+
+        private: Store::AsyncService * service;
+        StoreServiceImpl * impl;
+        WorkerPool * workers;
+        grpc::ServerCompletionQueue * cq;
+        const AsyncMethod < Request, Response > * method;
+
+        ServerContext context;
+        Request request;
+        Response reply;
+        grpc::ServerAsyncResponseWriter < Response > responder;
+        bool finished = false;
+    };
+
+const AsyncMethod < OpenRequest, OpenResponse > ASYNC_OPEN = {
+    & Store::AsyncService::RequestOpen,
+    & StoreServiceImpl::Open,
+    nullptr,
+    true
+};
+const AsyncMethod < GetRequest, GetResponse > ASYNC_GET_KEY = {
+    & Store::AsyncService::RequestGetKey,
+    & StoreServiceImpl::GetKey,
+    nullptr,
+    false
+};
+const AsyncMethod < SetRequest, SetResponse > ASYNC_SET_KEY = {
+    & Store::AsyncService::RequestSetKey,
+    & StoreServiceImpl::SetKey,
+    & StoreServiceImpl::StartSetKey,
+    false
+};
+const AsyncMethod < DeleteRequest, DeleteResponse > ASYNC_DELETE_KEY = {
+    & Store::AsyncService::RequestDeleteKey,
+    & StoreServiceImpl::DeleteKey,
+    & StoreServiceImpl::StartDeleteKey,
+    false
+};
+const AsyncMethod < MultiGetRequest, MultiGetResponse > ASYNC_MULTI_GET = {
+    & Store::AsyncService::RequestMultiGet,
+    & StoreServiceImpl::MultiGet,
+    nullptr,
+    false
+};
+const AsyncMethod < WriteBatchRequest, WriteBatchResponse > ASYNC_WRITE_BATCH = {
+    & Store::AsyncService::RequestWriteBatch,
+    & StoreServiceImpl::WriteBatch,
+    & StoreServiceImpl::StartWriteBatch,
+    false
+};
+const AsyncMethod < CompactRequest, CompactResponse > ASYNC_COMPACT = {
+    & Store::AsyncService::RequestCompact,
+    & StoreServiceImpl::Compact,
+    nullptr,
+    true
+};
+const AsyncMethod < CloseRequest, CloseResponse > ASYNC_CLOSE = {
+    & Store::AsyncService::RequestClose,
+    & StoreServiceImpl::Close,
+    nullptr,
+    true
+};
+const AsyncMethod < StatsRequest, StatsResponse > ASYNC_GET_STATS = {
+    & Store::AsyncService::RequestGetStats,
+    & StoreServiceImpl::GetStats,
+    nullptr,
+    false
+};
+const AsyncMethod < TraceRequest, TraceResponse > ASYNC_DUMP_TRACE = {
+    & Store::AsyncService::RequestDumpTrace,
+    & StoreServiceImpl::DumpTrace,
+    nullptr,
+    false
+};
+
+// A BulkLoad stream on a completion queue. The next message is only read
+// while the log writer has room for more chunks, a committed chunk resumes
+// reading, and the reply goes out once the client has finished sending and
+// every chunk is committed.
+//
+// Commits call back from the log writer while the poller may be finishing
+// the call, so once started the call owns itself through `self` and a
+// callback only reaches it through a weak pointer it holds for as long as it
+// runs. Whichever of the two lets go last deletes it.
+class AsyncBulkLoadCall final: public AsyncCall {
+    public: AsyncBulkLoadCall(Store::AsyncService * service,
+        StoreServiceImpl * impl,
+        grpc::ServerCompletionQueue * cq): service(service),
+    impl(impl),
+    cq(cq),
+    reader( & context),
+    load(std::make_shared < BulkLoadState > ()) {
+        service -> RequestBulkLoad( & context, & reader, cq, cq, this);
+    }
+
+    void Proceed(bool ok) override {
+        bool finished;
+        {
+            absl::MutexLock lock( & this -> load -> mutex);
+            finished = this -> finished;
+        }
+        if (finished) {
+            std::shared_ptr < AsyncBulkLoadCall > last = std::move(this -> self);
+            return;
+        }
+
+        if (!this -> started) {
+            if (!ok) {
+                delete this;
+                return;
+            }
+            this -> started = true;
+            new AsyncBulkLoadCall(service, impl, cq);
+            this -> self.reset(this);
+            std::weak_ptr < AsyncBulkLoadCall > call = this -> self;
+            this -> load -> onCommitted = [call]() {
+                if (std::shared_ptr < AsyncBulkLoadCall > alive = call.lock()) {
+                    alive -> Pump();
+                }
+            };
+            this -> Pump();
+            return;
+        }
+
+        // A read completed, it fails once the client is done sending.
+        if (ok) {
+            this -> impl -> AddToBulkLoad(this -> load, this -> request);
+        } else {
+            this -> impl -> FlushBulkLoad(this -> load);
+        }
+        {
+            absl::MutexLock lock( & this -> load -> mutex);
+            this -> reading = false;
+            this -> streamEnded = !ok;
+        }
+        this -> Pump();
+    }
+
+    private: void Pump() {
+        bool read = false;
+        bool finish = false;
+        {
+            absl::MutexLock lock( & this -> load -> mutex);
+            if (this -> streamEnded) {
+                if (this -> load -> Drained() && !this -> finished) {
+                    this -> finished = true;
+                    finish = true;
+                    this -> reply.set_status(this -> load -> failed ? "not ok" : "ok");
+                    this -> reply.set_loaded(this -> load -> loaded);
+                }
+            } else if (!this -> reading && this -> load -> HasRoom()) {
+                this -> reading = true;
+                read = true;
+            }
+        }
+        if (read) {
+            this -> reader.Read( & this -> request, this);
+        }
+        if (finish) {
+            this -> reader.Finish(this -> reply, Status::OK, this);
+        }
+    }
+
+    Store::AsyncService * service;
+    StoreServiceImpl * impl;
+    grpc::ServerCompletionQueue * cq;
+
+    ServerContext context;
+    BulkLoadRequest request;
+    BulkLoadResponse reply;
+    grpc::ServerAsyncReader < BulkLoadResponse, BulkLoadRequest > reader;
+    std::shared_ptr < BulkLoadState > load;
+    std::shared_ptr < AsyncBulkLoadCall > self;
+
+    bool started = false;
+    // Guarded by load->mutex.
+    bool reading = false;
+    bool streamEnded = false;
+    bool finished = false;
+};
+
+// A Scan on a completion queue. Each batch is written once the previous one
+// has gone out, so a slow reader only holds its iterator, never a thread.
+class AsyncScanCall final: public AsyncCall {
+    public: AsyncScanCall(Store::AsyncService * service,
+        StoreServiceImpl * impl,
+        grpc::ServerCompletionQueue * cq): service(service),
+    impl(impl),
+    cq(cq),
+    writer( & context) {
+        service -> RequestScan( & context, & request, & writer, cq, cq, this);
+    }
+
+    void Proceed(bool ok) override {
+        if (this -> finished) {
+            delete this;
+            return;
+        }
+
+        if (!this -> started) {
+            if (!ok) {
+                delete this;
+                return;
+            }
+            this -> started = true;
+            new AsyncScanCall(service, impl, cq);
+            this -> records = this -> impl -> StartScan( & this -> request, & this -> remaining);
+        } else if (!ok || !this -> more) {
+            // The client went away, or the last batch is out.
+            this -> finished = true;
+            this -> writer.Finish(Status::OK, this);
+            return;
+        }
+
+        this -> reply.Clear();
+        if (this -> records) {
+            this -> more = this -> impl -> FillScanBatch( * this -> records, & this -> remaining, & this -> reply);
+        } else {
+            this -> reply.set_status("not ok");
+            this -> more = false;
+        }
+        this -> writer.Write(this -> reply, this);
+    }
+
+    private: Store::AsyncService * service;
+    StoreServiceImpl * impl;
+    grpc::ServerCompletionQueue * cq;
 
+    ServerContext context;
+    ScanRequest request;
+    ScanResponse reply;
+    grpc::ServerAsyncWriter < ScanResponse > writer;
+    std::unique_ptr < LsmIterator > records;
+    uint64_t remaining = 0;
+
+    bool started = false;
+    bool more = true;
+    bool finished = false;
 };
 
+// Drives one completion queue until the server shuts it down.
+void Poll(Store::AsyncService * service, StoreServiceImpl * impl, WorkerPool * workers,
+    grpc::ServerCompletionQueue * cq) {
+    new AsyncUnaryCall < OpenRequest, OpenResponse > (service, impl, workers, cq, & ASYNC_OPEN);
+    new AsyncUnaryCall < GetRequest, GetResponse > (service, impl, workers, cq, & ASYNC_GET_KEY);
+    new AsyncUnaryCall < SetRequest, SetResponse > (service, impl, workers, cq, & ASYNC_SET_KEY);
+    new AsyncUnaryCall < DeleteRequest, DeleteResponse > (service, impl, workers, cq, & ASYNC_DELETE_KEY);
+    new AsyncUnaryCall < MultiGetRequest, MultiGetResponse > (service, impl, workers, cq, & ASYNC_MULTI_GET);
+    new AsyncUnaryCall < WriteBatchRequest, WriteBatchResponse > (service, impl, workers, cq, & ASYNC_WRITE_BATCH);
+    new AsyncBulkLoadCall(service, impl, cq);
+    new AsyncScanCall(service, impl, cq);
+    new AsyncUnaryCall < CompactRequest, CompactResponse > (service, impl, workers, cq, & ASYNC_COMPACT);
+    new AsyncUnaryCall < CloseRequest, CloseResponse > (service, impl, workers, cq, & ASYNC_CLOSE);
+    new AsyncUnaryCall < StatsRequest, StatsResponse > (service, impl, workers, cq, & ASYNC_GET_STATS);
+    new AsyncUnaryCall < TraceRequest, TraceResponse > (service, impl, workers, cq, & ASYNC_DUMP_TRACE);
+
+    void * tag;
+    bool ok;
+    while (cq -> Next( & tag, & ok)) {
+        static_cast < AsyncCall * > (tag) -> Proceed(ok);
+    }
+}
+
 // magic
 void RunServer(uint16_t port) {
     std::string server_address = absl::StrFormat("0.0.0.0:%d", port);
-    StoreServiceImpl service;
+    Durability durability;
+    if (!ParseDurability(absl::GetFlag(FLAGS_durability), & durability)) {
+        std::cerr << "--durability must be none, batch or every-N-ms" << std::endl;
+        return;
+    }
+    std::string engine = absl::GetFlag(FLAGS_engine);
+    if (engine != "log" && engine != "lsm") {
+        std::cerr << "--engine must be log or lsm" << std::endl;
+        return;
+    }
+    if (absl::GetFlag(FLAGS_lsm_fanout) < 2) {
+        std::cerr << "--lsm_fanout must be at least 2" << std::endl;
+        return;
+    }
+    if (absl::GetFlag(FLAGS_bloom_bits_per_key) < 0 || absl::GetFlag(FLAGS_bloom_bits_per_key) > 64) {
+        std::cerr << "--bloom_bits_per_key must be between 0 and 64" << std::endl;
+        return;
+    }
+    LsmOptions lsmOptions = {
+        std::max < size_t > (absl::GetFlag(FLAGS_memtable_bytes), 1),
+        static_cast < size_t > (absl::GetFlag(FLAGS_lsm_fanout)),
+        durability.mode == Durability::BATCH,
+        durability.mode == Durability::INTERVAL ? durability.intervalMs : 0,
+        absl::GetFlag(FLAGS_bloom_bits_per_key)
+    };
+    std::string ioName = absl::GetFlag(FLAGS_io);
+    if (ioName != "blocking" && ioName != "io_uring") {
+        std::cerr << "--io must be blocking or io_uring" << std::endl;
+        return;
+    }
+    if (absl::GetFlag(FLAGS_io_uring_depth) < static_cast < int > (URING_MIN_DEPTH) ||
+        absl::GetFlag(FLAGS_io_uring_depth) > 4096) {
+        std::cerr << "--io_uring_depth must be between 2 and 4096" << std::endl;
+        return;
+    }
+    if (absl::GetFlag(FLAGS_workers) < 1 || absl::GetFlag(FLAGS_workers) > 1024) {
+        std::cerr << "--workers must be between 1 and 1024" << std::endl;
+        return;
+    }
+    if (absl::GetFlag(FLAGS_trace_spans) < 0 || absl::GetFlag(FLAGS_trace_spans) > (1 << 24)) {
+        std::cerr << "--trace_spans must be between 0 and 16777216" << std::endl;
+        return;
+    }
+    Tracer::Get().Start(absl::GetFlag(FLAGS_trace_spans));
+    // Outlives the service, whose logs use it until they are closed.
+    std::unique_ptr < IoBackend > io;
+    unsigned depth = absl::GetFlag(FLAGS_io_uring_depth);
+    if (ioName == "io_uring" && UringIo::Available(depth)) {
+        io.reset(new UringIo(depth));
+    } else {
+        if (ioName == "io_uring") {
+            std::cerr << "io_uring is not available, falling back to --io=blocking" << std::endl;
+        }
+        io.reset(new BlockingIo());
+    }
+    LogOptions logOptions = {
+        absl::GetFlag(FLAGS_mmap),
+        io.get(),
+        durability,
+        std::max < size_t > (absl::GetFlag(FLAGS_segment_bytes), 1),
+        absl::GetFlag(FLAGS_compact_ratio)
+    };
+    StoreServiceImpl service(logOptions, engine == "lsm", lsmOptions, absl::GetFlag(FLAGS_cache_bytes));
+    Store::AsyncService asyncService;
 
     grpc::EnableDefaultHealthCheckService(true);
     grpc::reflection::InitProtoReflectionServerBuilderPlugin();
     ServerBuilder builder;
     // Listen on the given address without any authentication mechanism.
     builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-    // Register "service" as the instance through which we'll communicate with
-    // clients. In this case it corresponds to an *synchronous* service.
-    builder.RegisterService( & service);
-    // Finally assemble the server.
+
+    if (!absl::GetFlag(FLAGS_async)) {
+        // Register "service" as the instance through which we'll communicate with
+        // clients. In this case it corresponds to an *synchronous* service.
+        builder.RegisterService( & service);
+        // Finally assemble the server.
+        std::unique_ptr < Server > server(builder.BuildAndStart());
+        std::cout << "Server listening on " << server_address << std::endl;
+
+        // Wait for the server to shutdown. Note that some other thread must be
+        // responsible for shutting down the server for this call to ever return.
+        server -> Wait();
+        return;
+    }
+
+    // In async mode calls don't hold a thread while they wait, each polling
+    // thread serves whatever its completion queue hands it.
+    int pollers = absl::GetFlag(FLAGS_pollers);
+    if (pollers <= 0) {
+        pollers = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    WorkerPool workers(absl::GetFlag(FLAGS_workers));
+    builder.RegisterService( & asyncService);
+    std::vector < std::unique_ptr < grpc::ServerCompletionQueue >> cqs;
+    for (int i = 0; i < pollers; ++i) {
+        cqs.push_back(builder.AddCompletionQueue());
+    }
     std::unique_ptr < Server > server(builder.BuildAndStart());
-    std::cout << "Server listening on " << server_address << std::endl;
+    std::cout << "Server listening on " << server_address << " with " << pollers << " pollers" << std::endl;
+
+    std::vector < std::thread > threads;
+    for (auto & cq: cqs) {
+        threads.emplace_back(Poll, & asyncService, & service, & workers, cq.get());
+    }
 
-    // Wait for the server to shutdown. Note that some other thread must be
-    // responsible for shutting down the server for this call to ever return.
     server -> Wait();
+    // Workers still reply to the queues, so they stop first.
+    workers.Stop();
+    for (auto & cq: cqs) {
+        cq -> Shutdown();
+    }
+    for (auto & thread: threads) {
+        thread.join();
+    }
 }
 
 int main(int argc, char ** argv) {
@@ -0,0 +1,212 @@
+#ifndef VALUE_CACHE_H_
+#define VALUE_CACHE_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+
+const size_t CACHE_SHARDS = 64;
+// Charged per entry on top of its key and value, roughly what the map node
+// and the slot cost.
+const size_t CACHE_ENTRY_OVERHEAD = 96;
+
+struct CacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t bytes;
+};
+
+// Values by key, bounded by bytes and striped over independently locked
+// shards. Each shard evicts with CLOCK: entries sit in a ring of slots, a hit
+// only sets the slot's referenced bit, and the hand sweeping for a victim
+// clears bits until it finds one that wasn't hit since its last pass. Hits
+// take only a reader lock.
+//
+// Filling the cache races with writes: a reader that missed may be holding
+// a value a writer has replaced since. So a reader takes a Token before it
+// reads the value, and Insert drops the value if anything in the shard was
+// erased after that token was taken.
+class ValueCache {
+    public: explicit ValueCache(size_t capacityBytes): shardCapacity(capacityBytes / CACHE_SHARDS) {}
+
+    bool Lookup(const std::string & key, std::string * value) {
+        Shard & shard = this -> ShardFor(key);
+        {
+            absl::ReaderMutexLock lock( & shard.mutex);
+            auto found = shard.entries.find(key);
+            if (found != shard.entries.end()) {
+                Slot & slot = shard.slots[found -> second];
+                slot.referenced.store(true, std::memory_order_relaxed);
+                * value = slot.value;
+                shard.hits.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        shard.misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    uint64_t Token(const std::string & key) {
+        return this -> ShardFor(key).erased.load();
+    }
+
+    // Caches a value read after `token` was taken, unless the shard has seen
+    // an Erase since or the value is too big to be worth a slot.
+    void Insert(const std::string & key, const std::string & value, uint64_t token) {
+        size_t charge = key.size() + value.size() + CACHE_ENTRY_OVERHEAD;
+        Shard & shard = this -> ShardFor(key);
+        if (charge > this -> shardCapacity) {
+            return;
+        }
+
+        absl::WriterMutexLock lock( & shard.mutex);
+        if (shard.erased.load() != token) {
+            return;
+        }
+        auto found = shard.entries.find(key);
+        if (found != shard.entries.end()) {
+            Slot & slot = shard.slots[found -> second];
+            shard.bytes -= slot.charge;
+            slot.value = value;
+            slot.charge = charge;
+            shard.bytes += charge;
+        } else {
+            while (shard.bytes + charge > this -> shardCapacity) {
+                shard.Evict();
+            }
+            size_t index = shard.TakeSlot();
+            auto inserted = shard.entries.emplace(key, index).first;
+            Slot & slot = shard.slots[index];
+            slot.key = & inserted -> first;
+            slot.value = value;
+            slot.charge = charge;
+            slot.referenced.store(false, std::memory_order_relaxed);
+            shard.bytes += charge;
+        }
+        // Big values can leave the shard over budget until the next insert.
+        while (shard.bytes > this -> shardCapacity) {
+            shard.Evict();
+        }
+    }
+
+    // Drops a key that was just written, and turns away values of the shard
+    // read before now.
+    void Erase(const std::string & key) {
+        Shard & shard = this -> ShardFor(key);
+        absl::WriterMutexLock lock( & shard.mutex);
+        ++shard.erased;
+        auto found = shard.entries.find(key);
+        if (found != shard.entries.end()) {
+            size_t index = found -> second;
+            shard.entries.erase(found);
+            shard.Free(index);
+        }
+    }
+
+    CacheStats Stats() const {
+        CacheStats stats = {
+            0,
+            0,
+            0,
+            0
+        };
+        for (const Shard & shard: this -> shards) {
+            stats.hits += shard.hits.load();
+            stats.misses += shard.misses.load();
+            stats.evictions += shard.evictions.load();
+            absl::ReaderMutexLock lock( & shard.mutex);
+            stats.bytes += shard.bytes;
+        }
+        return stats;
+    }
+
+    private: struct Slot {
+        // Points at the key of the entry in `entries`, nullptr if free.
+        const std::string * key = nullptr;
+        std::string value;
+        size_t charge = 0;
+        std::atomic < bool > referenced {
+            false
+        };
+    };
+
+    struct Shard {
+        // Sweeps the hand to the first slot not referenced since the last
+        // pass and frees it. Called with the mutex held and entries present.
+        void Evict() {
+            while (true) {
+                Slot & slot = this -> slots[this -> hand];
+                size_t index = this -> hand;
+                this -> hand = (this -> hand + 1) % this -> slots.size();
+                if (!slot.key) {
+                    continue;
+                }
+                if (slot.referenced.exchange(false, std::memory_order_relaxed)) {
+                    continue;
+                }
+                this -> entries.erase(this -> entries.find( * slot.key));
+                this -> Free(index);
+                this -> evictions.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+
+        // Frees the slot of an entry that was just erased.
+        void Free(size_t index) {
+            Slot & slot = this -> slots[index];
+            this -> bytes -= slot.charge;
+            slot.key = nullptr;
+            slot.value = std::string();
+            slot.charge = 0;
+            this -> freeSlots.push_back(index);
+        }
+
+        size_t TakeSlot() {
+            if (!this -> freeSlots.empty()) {
+                size_t index = this -> freeSlots.back();
+                this -> freeSlots.pop_back();
+                return index;
+            }
+            // A deque, so growing never moves the slots already handed out.
+            this -> slots.emplace_back();
+            return this -> slots.size() - 1;
+        }
+
+        mutable absl::Mutex mutex;
+        std::unordered_map < std::string, size_t > entries;
+        std::deque < Slot > slots;
+        std::vector < size_t > freeSlots;
+        size_t hand = 0;
+        size_t bytes = 0;
+        std::atomic < uint64_t > erased {
+            0
+        };
+        std::atomic < uint64_t > hits {
+            0
+        };
+        std::atomic < uint64_t > misses {
+            0
+        };
+        std::atomic < uint64_t > evictions {
+            0
+        };
+    };
+
+    Shard & ShardFor(const std::string & key) {
+        return this -> shards[std::hash < std::string > ()(key) % CACHE_SHARDS];
+    }
+
+    const size_t shardCapacity;
+    std::array < Shard, CACHE_SHARDS > shards;
+};
+
+#endif // VALUE_CACHE_H_
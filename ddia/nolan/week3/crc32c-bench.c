@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc32c.h"
+#include "hash.h"
+
+/**
+ * Compares the old Hash checksum against both CRC-32C
+ * implementations over record-sized and large buffers,
+ * after checking that the implementations agree.
+ *
+ * Build: cc -O2 crc32c-bench.c crc32c.c hash.c -o crc32c-bench
+ */
+
+typedef __checksum_t (*Checksum)(const char *bytes, size_t len);
+
+static __checksum_t _hash(const char *bytes, size_t len)
+{
+    return Hash((char *)bytes, len);
+}
+
+static __checksum_t _software(const char *bytes, size_t len)
+{
+    return Crc32cSoftware(0, bytes, len);
+}
+
+static __checksum_t _hardware(const char *bytes, size_t len)
+{
+    return Crc32cHardware(0, bytes, len);
+}
+
+static double _now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Checksums 256MB worth of the buffer, best of three,
+ * and returns GB/s.
+ */
+static double _measure(Checksum checksum, const char *buffer, size_t len)
+{
+    const size_t target = 1UL << 28;
+    const size_t rounds = target / len < 16 ? 16 : target / len;
+    volatile __checksum_t sink = 0;
+
+    double best = 0;
+    for (int attempt = 0; attempt < 3; ++attempt)
+    {
+        const double start = _now();
+        for (size_t round = 0; round < rounds; ++round)
+        {
+            sink ^= checksum(buffer, len);
+        }
+        const double rate = (double)rounds * len / (_now() - start) / 1e9;
+        best = rate > best ? rate : best;
+    }
+    (void)sink;
+    return best;
+}
+
+static int _check()
+{
+    const char *vector = "123456789";
+    if (Crc32c(vector, strlen(vector)) != 0xe3069283U)
+    {
+        fprintf(stderr, "Crc32c(\"123456789\") is %08x, expected e3069283\n", Crc32c(vector, strlen(vector)));
+        return 1;
+    }
+
+    const size_t size = 1UL << 17;
+    char *buffer = malloc(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        buffer[i] = rand();
+    }
+
+    int failures = 0;
+    for (int trial = 0; trial < 2000; ++trial)
+    {
+        const size_t offset = rand() % 64;
+        const size_t len = trial < 1000 ? (size_t)(rand() % 1024) : rand() % (size - offset);
+        const __checksum_t expected = Crc32cSoftware(0, buffer + offset, len);
+        if (Crc32c(buffer + offset, len) != expected)
+        {
+            ++failures;
+        }
+
+        // Checksumming in two pieces gives the same answer
+        const size_t split = len ? rand() % len : 0;
+        if (Crc32cExtend(Crc32c(buffer + offset, split), buffer + offset + split, len - split) != expected)
+        {
+            ++failures;
+        }
+    }
+
+    free(buffer);
+    if (failures)
+    {
+        fprintf(stderr, "%d mismatches between implementations\n", failures);
+    }
+    return failures != 0;
+}
+
+int main()
+{
+    if (_check())
+    {
+        return 1;
+    }
+
+    const size_t sizes[] = {16UL, 64UL, 256UL, 4096UL, 65536UL, 1UL << 20, 16UL << 20};
+    const size_t largest = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    char *buffer = malloc(largest);
+    for (size_t i = 0; i < largest; ++i)
+    {
+        buffer[i] = rand();
+    }
+
+    const bool hardware = Crc32cHardwareAvailable();
+    printf("%10s %12s %12s %12s\n", "bytes", "Hash GB/s", "slice8 GB/s", hardware ? "sse4.2 GB/s" : "");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        printf("%10zu %12.2f %12.2f", sizes[i], _measure(_hash, buffer, sizes[i]), _measure(_software, buffer, sizes[i]));
+        if (hardware)
+        {
+            printf(" %12.2f", _measure(_hardware, buffer, sizes[i]));
+        }
+        printf("\n");
+    }
+
+    free(buffer);
+    return 0;
+}
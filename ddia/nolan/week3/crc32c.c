@@ -0,0 +1,278 @@
+#include "crc32c.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+// Reflected CRC-32C polynomial
+const __uint32_t CRC32C_POLY = 0x82f63b78U;
+
+/**
+ * The hardware path runs three independent crc32 streams
+ * over adjacent blocks to hide the instruction's latency,
+ * then folds them together by shifting a CRC over a block
+ * of zeros. Shifting is a 32x32 bit matrix product, which
+ * is precomputed into four byte tables per block size.
+ */
+#define CRC32C_LONG 8192UL
+#define CRC32C_SHORT 256UL
+
+static __uint32_t _slicingTable[8][256];
+static __uint32_t _longShift[4][256];
+static __uint32_t _shortShift[4][256];
+
+static __checksum_t (*_crc32cImplementation)(__checksum_t, const char *, size_t);
+
+static __uint32_t _gf2MatrixTimes(const __uint32_t *matrix, __uint32_t vector)
+{
+    __uint32_t sum = 0;
+    while (vector)
+    {
+        if (vector & 1)
+        {
+            sum ^= *matrix;
+        }
+        vector >>= 1;
+        ++matrix;
+    }
+    return sum;
+}
+
+static void _gf2MatrixSquare(__uint32_t *square, const __uint32_t *matrix)
+{
+    for (int n = 0; n < 32; ++n)
+    {
+        square[n] = _gf2MatrixTimes(matrix, matrix[n]);
+    }
+}
+
+/**
+ * Builds the tables that advance a CRC over len zero bytes,
+ * len being a power of two.
+ */
+static void _buildShiftTables(__uint32_t tables[4][256], size_t len)
+{
+    __uint32_t even[32];
+    __uint32_t odd[32];
+
+    // Operator for one zero bit
+    odd[0] = CRC32C_POLY;
+    __uint32_t row = 1;
+    for (int n = 1; n < 32; ++n)
+    {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    // Two zero bits, then four
+    _gf2MatrixSquare(even, odd);
+    _gf2MatrixSquare(odd, even);
+
+    // Every square doubles, the first one gets to a byte
+    __uint32_t *result = even;
+    while (true)
+    {
+        _gf2MatrixSquare(even, odd);
+        result = even;
+        len >>= 1;
+        if (!len)
+        {
+            break;
+        }
+        _gf2MatrixSquare(odd, even);
+        result = odd;
+        len >>= 1;
+        if (!len)
+        {
+            break;
+        }
+    }
+
+    for (__uint32_t n = 0; n < 256; ++n)
+    {
+        tables[0][n] = _gf2MatrixTimes(result, n);
+        tables[1][n] = _gf2MatrixTimes(result, n << 8);
+        tables[2][n] = _gf2MatrixTimes(result, n << 16);
+        tables[3][n] = _gf2MatrixTimes(result, n << 24);
+    }
+}
+
+static inline __uint32_t _shift(__uint32_t tables[4][256], __uint32_t crc)
+{
+    return tables[0][crc & 0xff] ^ tables[1][(crc >> 8) & 0xff] ^
+           tables[2][(crc >> 16) & 0xff] ^ tables[3][crc >> 24];
+}
+
+__checksum_t Crc32cSoftware(__checksum_t crc, const char *bytes, size_t len)
+{
+    const unsigned char *next = (const unsigned char *)bytes;
+    crc = ~crc;
+
+    while (len && ((uintptr_t)next & 7))
+    {
+        crc = _slicingTable[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+        --len;
+    }
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Eight table lookups per 8 bytes instead of a dependent chain of eight
+    while (len >= 8)
+    {
+        __uint64_t word;
+        memcpy(&word, next, sizeof(word));
+        word ^= crc;
+        crc = _slicingTable[7][word & 0xff] ^
+              _slicingTable[6][(word >> 8) & 0xff] ^
+              _slicingTable[5][(word >> 16) & 0xff] ^
+              _slicingTable[4][(word >> 24) & 0xff] ^
+              _slicingTable[3][(word >> 32) & 0xff] ^
+              _slicingTable[2][(word >> 40) & 0xff] ^
+              _slicingTable[1][(word >> 48) & 0xff] ^
+              _slicingTable[0][word >> 56];
+        next += 8;
+        len -= 8;
+    }
+#endif
+
+    while (len)
+    {
+        crc = _slicingTable[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+        --len;
+    }
+
+    return ~crc;
+}
+
+#ifdef CRC32C_X86
+
+static inline __uint64_t _load64(const unsigned char *bytes)
+{
+    __uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+/**
+ * Runs three streams over 3 * blockSize bytes and folds
+ * them into crc.
+ */
+__attribute__((target("sse4.2"))) static inline __uint64_t _threeWay(
+    __uint64_t crc0, const unsigned char *next, size_t blockSize, __uint32_t shiftTables[4][256])
+{
+    __uint64_t crc1 = 0;
+    __uint64_t crc2 = 0;
+    const unsigned char *end = next + blockSize;
+    while (next < end)
+    {
+        crc0 = _mm_crc32_u64(crc0, _load64(next));
+        crc1 = _mm_crc32_u64(crc1, _load64(next + blockSize));
+        crc2 = _mm_crc32_u64(crc2, _load64(next + 2 * blockSize));
+        next += 8;
+    }
+    crc0 = _shift(shiftTables, (__uint32_t)crc0) ^ crc1;
+    return _shift(shiftTables, (__uint32_t)crc0) ^ crc2;
+}
+
+__attribute__((target("sse4.2"))) __checksum_t Crc32cHardware(__checksum_t crc, const char *bytes, size_t len)
+{
+    const unsigned char *next = (const unsigned char *)bytes;
+    __uint64_t crc0 = ~crc;
+
+    while (len && ((uintptr_t)next & 7))
+    {
+        crc0 = _mm_crc32_u8((__uint32_t)crc0, *next++);
+        --len;
+    }
+
+    while (len >= 3 * CRC32C_LONG)
+    {
+        crc0 = _threeWay(crc0, next, CRC32C_LONG, _longShift);
+        next += 3 * CRC32C_LONG;
+        len -= 3 * CRC32C_LONG;
+    }
+
+    while (len >= 3 * CRC32C_SHORT)
+    {
+        crc0 = _threeWay(crc0, next, CRC32C_SHORT, _shortShift);
+        next += 3 * CRC32C_SHORT;
+        len -= 3 * CRC32C_SHORT;
+    }
+
+    while (len >= 8)
+    {
+        crc0 = _mm_crc32_u64(crc0, _load64(next));
+        next += 8;
+        len -= 8;
+    }
+
+    while (len)
+    {
+        crc0 = _mm_crc32_u8((__uint32_t)crc0, *next++);
+        --len;
+    }
+
+    return ~(__uint32_t)crc0;
+}
+
+bool Crc32cHardwareAvailable()
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+
+#else
+
+__checksum_t Crc32cHardware(__checksum_t crc, const char *bytes, size_t len)
+{
+    return Crc32cSoftware(crc, bytes, len);
+}
+
+bool Crc32cHardwareAvailable()
+{
+    return false;
+}
+
+#endif
+
+/**
+ * Builds the tables and picks the implementation before main runs,
+ * so Crc32c never has to check whether that happened.
+ */
+__attribute__((constructor)) static void _crc32cInit()
+{
+    for (__uint32_t n = 0; n < 256; ++n)
+    {
+        __uint32_t crc = n;
+        for (int bit = 0; bit < 8; ++bit)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        _slicingTable[0][n] = crc;
+    }
+    for (__uint32_t n = 0; n < 256; ++n)
+    {
+        for (int slice = 1; slice < 8; ++slice)
+        {
+            const __uint32_t previous = _slicingTable[slice - 1][n];
+            _slicingTable[slice][n] = (previous >> 8) ^ _slicingTable[0][previous & 0xff];
+        }
+    }
+
+    _buildShiftTables(_longShift, CRC32C_LONG);
+    _buildShiftTables(_shortShift, CRC32C_SHORT);
+
+    _crc32cImplementation = Crc32cHardwareAvailable() ? Crc32cHardware : Crc32cSoftware;
+}
+
+__checksum_t Crc32cExtend(__checksum_t crc, const char *bytes, size_t len)
+{
+    return _crc32cImplementation(crc, bytes, len);
+}
+
+__checksum_t Crc32c(const char *bytes, size_t len)
+{
+    return _crc32cImplementation(0, bytes, len);
+}
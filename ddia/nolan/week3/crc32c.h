@@ -0,0 +1,30 @@
+#ifndef CRC32C_H_
+#define CRC32C_H_
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef __uint32_t __checksum_t;
+
+/**
+ * CRC-32C (Castagnoli) of len bytes. Uses the SSE4.2 crc32
+ * instruction when the CPU has it and a slicing-by-8 table
+ * otherwise, picked once when the program loads.
+ */
+__checksum_t Crc32c(const char *bytes, size_t len);
+
+/**
+ * Continues a CRC-32C over more bytes, so
+ * Crc32cExtend(Crc32c(a, n), b, m) is the CRC of a followed by b.
+ */
+__checksum_t Crc32cExtend(__checksum_t crc, const char *bytes, size_t len);
+
+/**
+ * The two implementations, for benchmarks and tests.
+ * Crc32cHardware may only be called when Crc32cHardwareAvailable.
+ */
+__checksum_t Crc32cSoftware(__checksum_t crc, const char *bytes, size_t len);
+__checksum_t Crc32cHardware(__checksum_t crc, const char *bytes, size_t len);
+bool Crc32cHardwareAvailable();
+
+#endif
@@ -0,0 +1,222 @@
+#include <benchmark/benchmark.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "file-index-map.h"
+#include "hash.h"
+
+    /**
+     * main.c has no header, these are the parts of its API
+     * the benchmarks use. The error enums are unsigned ints.
+     */
+    typedef struct DB DB;
+    DB *DBopenParallel(char *handle, size_t threadCount, unsigned int *error);
+    void DBClose(DB *db);
+    void DBSet(DB *db, char *key, Buffer value, unsigned int *error);
+}
+
+/**
+ * Microbenchmarks for the file index, the hashes and
+ * recovering a DB from its file, parameterized by key
+ * count, key length and value size.
+ *
+ * Results go to JSON for comparing commits with
+ * google-benchmark's compare.py:
+ *   db-bench --benchmark_out=before.json --benchmark_out_format=json
+ *
+ * Build: cc -O2 -c main.c crc32c.c indicator-scan.c file-index-map.c hash.c &&
+ *        c++ -O2 db-bench.cc main.o crc32c.o indicator-scan.o file-index-map.o hash.o
+ *            -lbenchmark -lpthread -o db-bench
+ */
+
+/**
+ * Makes count distinct keys of exactly len bytes, a counter
+ * padded out so they differ early like real keys do.
+ */
+static std::vector<std::string> _keys(size_t count, size_t len)
+{
+    std::vector<std::string> keys;
+    keys.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        std::string key = "user:" + std::to_string(i) + ":";
+        key.resize(len > key.size() ? len : key.size(), 'k');
+        keys.push_back(key);
+    }
+    return keys;
+}
+
+static std::vector<size_t> _shuffled(size_t count)
+{
+    std::vector<size_t> order(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937_64(1));
+    return order;
+}
+
+static void _mapArgs(benchmark::internal::Benchmark *benchmark)
+{
+    benchmark->ArgNames({"keys", "key_len"})->ArgsProduct({{1000, 100000, 1000000}, {16, 64}});
+}
+
+static void BM_FileIndexSet(benchmark::State &state)
+{
+    const std::vector<std::string> keys = _keys(state.range(0), state.range(1));
+    for (auto _ : state)
+    {
+        FileIndexHashMap *map = FileIndexCreate();
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            FileIndexSet(map, (char *)keys[i].c_str(), {i, i + 1});
+        }
+        state.PauseTiming();
+        FileIndexClose(map);
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_FileIndexSet)->Apply(_mapArgs)->Unit(benchmark::kMillisecond);
+
+static void BM_FileIndexGet(benchmark::State &state)
+{
+    const std::vector<std::string> keys = _keys(state.range(0), state.range(1));
+    const std::vector<size_t> order = _shuffled(keys.size());
+    FileIndexHashMap *map = FileIndexCreate();
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        FileIndexSet(map, (char *)keys[i].c_str(), {i, i + 1});
+    }
+
+    // Random order, so the lookups don't get cache locality for free
+    size_t next = 0;
+    for (auto _ : state)
+    {
+        bool found;
+        benchmark::DoNotOptimize(FileIndexGet(map, (char *)keys[order[next]].c_str(), &found));
+        next = next + 1 == order.size() ? 0 : next + 1;
+    }
+    state.SetItemsProcessed(state.iterations());
+    FileIndexClose(map);
+}
+BENCHMARK(BM_FileIndexGet)->Apply(_mapArgs);
+
+static void BM_FileIndexDelete(benchmark::State &state)
+{
+    const std::vector<std::string> keys = _keys(state.range(0), state.range(1));
+    const std::vector<size_t> order = _shuffled(keys.size());
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        FileIndexHashMap *map = FileIndexCreate();
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            FileIndexSet(map, (char *)keys[i].c_str(), {i, i + 1});
+        }
+        state.ResumeTiming();
+
+        for (size_t i : order)
+        {
+            FileIndexDelete(map, (char *)keys[i].c_str());
+        }
+
+        state.PauseTiming();
+        FileIndexClose(map);
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_FileIndexDelete)->Apply(_mapArgs)->Unit(benchmark::kMillisecond);
+
+static void BM_Hash(benchmark::State &state)
+{
+    std::string key = _keys(1, state.range(0))[0];
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(Hash(&key[0], key.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * key.size());
+}
+BENCHMARK(BM_Hash)->ArgName("key_len")->RangeMultiplier(4)->Range(4, 4096);
+
+static void BM_Hash64(benchmark::State &state)
+{
+    std::string key = _keys(1, state.range(0))[0];
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(Hash64(key.data(), key.size(), 0x9e3779b97f4a7c15UL));
+    }
+    state.SetBytesProcessed(state.iterations() * key.size());
+}
+BENCHMARK(BM_Hash64)->ArgName("key_len")->RangeMultiplier(4)->Range(4, 4096);
+
+/**
+ * Writes a DB of keys, each set twice so recovery also
+ * replaces entries, and returns its path.
+ */
+static std::string _generateDB(size_t keyCount, size_t keyLen, size_t valueSize)
+{
+    char path[] = "/tmp/db-bench-XXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+
+    unsigned int error = 0;
+    DB *db = DBopenParallel(path, 1, &error);
+    const std::vector<std::string> keys = _keys(keyCount, keyLen);
+    std::string value(valueSize, 'v');
+    for (int round = 0; round < 2; ++round)
+    {
+        for (const std::string &key : keys)
+        {
+            value[0] = 'a' + round;
+            DBSet(db, (char *)key.c_str(), {&value[0], value.size()}, &error);
+        }
+    }
+    DBClose(db);
+    return path;
+}
+
+static void BM_DBopen(benchmark::State &state)
+{
+    std::string path = _generateDB(state.range(0), state.range(1), state.range(2));
+    const size_t threads = state.range(3);
+    FILE *file = fopen(path.c_str(), "r");
+    fseek(file, 0, SEEK_END);
+    const long fileSize = ftell(file);
+    fclose(file);
+
+    for (auto _ : state)
+    {
+        unsigned int error = 0;
+        DB *db = DBopenParallel(&path[0], threads, &error);
+        if (!db)
+        {
+            state.SkipWithError("DBopen failed");
+            break;
+        }
+        state.PauseTiming();
+        DBClose(db);
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(state.iterations() * fileSize);
+    state.SetItemsProcessed(state.iterations() * state.range(0) * 2);
+    unlink(path.c_str());
+}
+BENCHMARK(BM_DBopen)
+    ->ArgNames({"keys", "key_len", "value_size", "threads"})
+    ->ArgsProduct({{10000, 100000}, {16, 64}, {100, 1000}, {1, 4}})
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
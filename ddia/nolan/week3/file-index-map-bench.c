@@ -0,0 +1,328 @@
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "file-index-map.h"
+#include "hash.h"
+
+/**
+ * Compares FileIndexHashMap against the chained buckets it
+ * replaced: inserts, hits and misses per second over keys
+ * shaped like user:<n>:profile, heap bytes per key, and the
+ * latency percentiles of single inserts, where a resize that
+ * rehashes everything at once shows up. Both maps are checked
+ * against each other first.
+ *
+ * The chained map is the old file-index-map.c with the bugs
+ * that kept it from running fixed (buckets copied by value,
+ * the inverted strcmp in Get, the uncopied keys).
+ *
+ * Build: cc -O2 file-index-map-bench.c file-index-map.c hash.c -o file-index-map-bench
+ * Usage: file-index-map-bench [keys]
+ */
+
+typedef struct ChainedNode
+{
+    char *key;
+    FileIndex fileIndex;
+} ChainedNode;
+
+typedef struct ChainedBucket
+{
+    size_t nodeCount;
+    size_t nodeCapacity;
+    ChainedNode *nodes;
+} ChainedBucket;
+
+typedef struct ChainedMap
+{
+    size_t size;
+    size_t bucketCount;
+    ChainedBucket *buckets;
+} ChainedMap;
+
+static ChainedBucket *_chainedBuckets(size_t bucketCount)
+{
+    ChainedBucket *buckets = malloc(sizeof(ChainedBucket) * bucketCount);
+    for (size_t i = 0; i < bucketCount; ++i)
+    {
+        buckets[i].nodeCount = 0;
+        buckets[i].nodeCapacity = 4;
+        buckets[i].nodes = malloc(sizeof(ChainedNode) * buckets[i].nodeCapacity);
+    }
+    return buckets;
+}
+
+static ChainedMap *_chainedCreate()
+{
+    ChainedMap *map = malloc(sizeof(ChainedMap));
+    map->size = 0;
+    map->bucketCount = 1;
+    map->buckets = _chainedBuckets(map->bucketCount);
+    return map;
+}
+
+static void _chainedClose(ChainedMap *map)
+{
+    for (size_t i = 0; i < map->bucketCount; ++i)
+    {
+        for (size_t j = 0; j < map->buckets[i].nodeCount; ++j)
+        {
+            free(map->buckets[i].nodes[j].key);
+        }
+        free(map->buckets[i].nodes);
+    }
+    free(map->buckets);
+    free(map);
+}
+
+static FileIndex _chainedGet(ChainedMap *map, char *key, bool *found)
+{
+    ChainedBucket *bucket = &map->buckets[Hash(key, strlen(key) + 1) % map->bucketCount];
+    for (size_t i = 0; i < bucket->nodeCount; ++i)
+    {
+        if (strcmp(bucket->nodes[i].key, key) == 0)
+        {
+            *found = true;
+            return bucket->nodes[i].fileIndex;
+        }
+    }
+    *found = false;
+    return (FileIndex){0, 0};
+}
+
+static void _chainedPut(ChainedMap *map, char *key, FileIndex index)
+{
+    ChainedBucket *bucket = &map->buckets[Hash(key, strlen(key) + 1) % map->bucketCount];
+    if (bucket->nodeCount == bucket->nodeCapacity)
+    {
+        bucket->nodeCapacity *= 2;
+        bucket->nodes = realloc(bucket->nodes, sizeof(ChainedNode) * bucket->nodeCapacity);
+    }
+    bucket->nodes[bucket->nodeCount++] = (ChainedNode){key, index};
+}
+
+static void _chainedSet(ChainedMap *map, char *key, FileIndex index)
+{
+    ChainedBucket *bucket = &map->buckets[Hash(key, strlen(key) + 1) % map->bucketCount];
+    for (size_t i = 0; i < bucket->nodeCount; ++i)
+    {
+        if (strcmp(bucket->nodes[i].key, key) == 0)
+        {
+            bucket->nodes[i].fileIndex = index;
+            return;
+        }
+    }
+
+    _chainedPut(map, strdup(key), index);
+    ++map->size;
+
+    if (map->size / map->bucketCount > 3)
+    {
+        const size_t oldBucketCount = map->bucketCount;
+        ChainedBucket *oldBuckets = map->buckets;
+        map->bucketCount *= 2;
+        map->buckets = _chainedBuckets(map->bucketCount);
+        for (size_t i = 0; i < oldBucketCount; ++i)
+        {
+            for (size_t j = 0; j < oldBuckets[i].nodeCount; ++j)
+            {
+                _chainedPut(map, oldBuckets[i].nodes[j].key, oldBuckets[i].nodes[j].fileIndex);
+            }
+            free(oldBuckets[i].nodes);
+        }
+        free(oldBuckets);
+    }
+}
+
+static double _now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Big blocks are mmapped and counted apart from the heap
+static size_t _heapInUse()
+{
+    const struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+static __uint64_t _nowNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+static int _compareLatencies(const void *a, const void *b)
+{
+    const __uint64_t left = *(const __uint64_t *)a;
+    const __uint64_t right = *(const __uint64_t *)b;
+    return (left > right) - (left < right);
+}
+
+/**
+ * Sorts the latencies and prints their percentiles in
+ * microseconds. A resize that stops the world shows up
+ * past p99.99 and in the max.
+ */
+static void _printLatencies(const char *name, __uint64_t *latencies, size_t count)
+{
+    qsort(latencies, count, sizeof(__uint64_t), _compareLatencies);
+    const double percentiles[] = {0.5, 0.99, 0.999, 0.9999};
+    printf("%-10s", name);
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i)
+    {
+        printf(" %10.2f", latencies[(size_t)(percentiles[i] * (count - 1))] / 1e3);
+    }
+    printf(" %10.2f\n", latencies[count - 1] / 1e3);
+}
+
+static void _shuffle(size_t *order, size_t count)
+{
+    for (size_t i = count - 1; i > 0; --i)
+    {
+        const size_t j = ((size_t)rand() << 16 ^ rand()) % (i + 1);
+        const size_t swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const size_t keyCount = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000UL;
+    const size_t keySize = 48;
+
+    // Keys laid out up front so building them isn't timed
+    char *keys = malloc(keyCount * keySize);
+    char *missingKeys = malloc(keyCount * keySize);
+    size_t *order = malloc(sizeof(size_t) * keyCount);
+    for (size_t i = 0; i < keyCount; ++i)
+    {
+        snprintf(keys + i * keySize, keySize, "user:%zu:profile", i);
+        snprintf(missingKeys + i * keySize, keySize, "user:%zu:settings", i);
+        order[i] = i;
+    }
+    _shuffle(order, keyCount);
+
+    // Both maps, built one after the other to measure their heap
+    size_t heapBefore = _heapInUse();
+    double start = _now();
+    FileIndexHashMap *map = FileIndexCreate();
+    for (size_t i = 0; i < keyCount; ++i)
+    {
+        FileIndexSet(map, keys + i * keySize, (FileIndex){i, i + 1});
+    }
+    const double flatInsert = keyCount / (_now() - start);
+    const double flatBytes = (double)(_heapInUse() - heapBefore) / keyCount;
+
+    heapBefore = _heapInUse();
+    start = _now();
+    ChainedMap *chained = _chainedCreate();
+    for (size_t i = 0; i < keyCount; ++i)
+    {
+        _chainedSet(chained, keys + i * keySize, (FileIndex){i, i + 1});
+    }
+    const double chainedInsert = keyCount / (_now() - start);
+    const double chainedBytes = (double)(_heapInUse() - heapBefore) / keyCount;
+
+    size_t failures = 0;
+    for (size_t i = 0; i < keyCount; ++i)
+    {
+        bool flatFound;
+        bool chainedFound;
+        FileIndex flatIndex = FileIndexGet(map, keys + i * keySize, &flatFound);
+        FileIndex chainedIndex = _chainedGet(chained, keys + i * keySize, &chainedFound);
+        failures += !flatFound || !chainedFound || flatIndex.start != i || chainedIndex.start != i;
+
+        FileIndexGet(map, missingKeys + i * keySize, &flatFound);
+        _chainedGet(chained, missingKeys + i * keySize, &chainedFound);
+        failures += flatFound || chainedFound;
+    }
+    // Deleting every other key leaves the rest reachable
+    for (size_t i = 0; i < keyCount; i += 2)
+    {
+        FileIndexDelete(map, keys + i * keySize);
+    }
+    for (size_t i = 0; i < keyCount; ++i)
+    {
+        bool found;
+        FileIndexGet(map, keys + i * keySize, &found);
+        failures += found != (i % 2 == 1);
+    }
+    for (size_t i = 0; i < keyCount; i += 2)
+    {
+        FileIndexSet(map, keys + i * keySize, (FileIndex){i, i + 1});
+    }
+    if (failures || map->size != keyCount)
+    {
+        fprintf(stderr, "%zu wrong lookups, %zu keys in the map\n", failures, map->size);
+        return 1;
+    }
+
+    // Random order, so neither map gets cache locality for free
+    size_t sink = 0;
+    double rates[2][2];
+    for (int hit = 0; hit < 2; ++hit)
+    {
+        const char *lookupKeys = hit ? keys : missingKeys;
+        bool found;
+
+        start = _now();
+        for (size_t i = 0; i < keyCount; ++i)
+        {
+            sink += FileIndexGet(map, (char *)lookupKeys + order[i] * keySize, &found).start + found;
+        }
+        rates[0][hit] = keyCount / (_now() - start);
+
+        start = _now();
+        for (size_t i = 0; i < keyCount; ++i)
+        {
+            sink += _chainedGet(chained, (char *)lookupKeys + order[i] * keySize, &found).start + found;
+        }
+        rates[1][hit] = keyCount / (_now() - start);
+    }
+
+    printf("%zu keys (checksum %zu)\n", keyCount, sink);
+    printf("%-10s %14s %14s %14s %12s\n", "map", "inserts/s", "hits/s", "misses/s", "bytes/key");
+    printf("%-10s %14.0f %14.0f %14.0f %12.1f\n", "flat", flatInsert, rates[0][1], rates[0][0], flatBytes);
+    printf("%-10s %14.0f %14.0f %14.0f %12.1f\n", "chained", chainedInsert, rates[1][1], rates[1][0], chainedBytes);
+
+    FileIndexClose(map);
+    _chainedClose(chained);
+
+    // Every insert timed on its own, into fresh maps
+    __uint64_t *latencies = malloc(sizeof(__uint64_t) * keyCount);
+    printf("\ninsert latency (us)\n%-10s %10s %10s %10s %10s %10s\n", "map", "p50", "p99", "p99.9", "p99.99", "max");
+
+    map = FileIndexCreate();
+    for (size_t i = 0; i < keyCount; ++i)
+    {
+        const __uint64_t before = _nowNanos();
+        FileIndexSet(map, keys + i * keySize, (FileIndex){i, i + 1});
+        latencies[i] = _nowNanos() - before;
+    }
+    FileIndexClose(map);
+    _printLatencies("flat", latencies, keyCount);
+
+    chained = _chainedCreate();
+    for (size_t i = 0; i < keyCount; ++i)
+    {
+        const __uint64_t before = _nowNanos();
+        _chainedSet(chained, keys + i * keySize, (FileIndex){i, i + 1});
+        latencies[i] = _nowNanos() - before;
+    }
+    _chainedClose(chained);
+    _printLatencies("chained", latencies, keyCount);
+
+    free(latencies);
+    free(keys);
+    free(missingKeys);
+    free(order);
+    return 0;
+}
@@ -1,181 +1,417 @@
 #include "file-index-map.h"
 
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include "hash.h"
 
-FileIndexHashMap *FileIndexCreate()
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#define FILE_INDEX_SSE2 1
+#endif
+
+#define FILE_INDEX_GROUP_WIDTH 16UL
+
+const __int8_t CONTROL_EMPTY = -128;
+const __int8_t CONTROL_DELETED = -2;
+
+// Smallest table, one group
+const size_t MIN_CAPACITY = FILE_INDEX_GROUP_WIDTH;
+
+// Arenas smaller than this aren't worth compacting
+const size_t ARENA_MIN_COMPACT = 4096;
+
+// Groups of the old table moved per Set or Delete while
+// resizing. Even one finishes long before the new table
+// fills up: a table of n groups is moved in n calls, and
+// every new table has room for at least 5n more keys.
+const size_t MIGRATE_GROUPS = 1;
+
+static size_t _hashKey(FileIndexHashMap *map, const char *key, size_t keyLen)
 {
-    FileIndexHashMap *map = malloc(sizeof(FileIndexHashMap));
+    return Hash64(key, keyLen, map->seed);
+}
 
-    map->size = 0;
-    map->bucketCount = 1;
+/**
+ * Seeds from the clock and where the map was allocated.
+ * Neither is secret, but they aren't known before the map
+ * exists, which is all that's needed to make keys chosen
+ * ahead of time collide no more than any others.
+ */
+static __uint64_t _seed(FileIndexHashMap *map)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const __uint64_t entropy[2] = {(__uint64_t)now.tv_sec * 1000000000UL + now.tv_nsec, (__uint64_t)map};
+    return Hash64((const char *)entropy, sizeof(entropy), 0);
+}
+
+static inline __int8_t _tag(size_t hash)
+{
+    return hash >> 57;
+}
+
+static inline size_t _firstGroup(FileIndexTable *table, size_t hash)
+{
+    return hash & (table->capacity / FILE_INDEX_GROUP_WIDTH - 1);
+}
+
+// Tables are kept at most 7/8 full
+static inline size_t _maxLoad(size_t capacity)
+{
+    return capacity - capacity / 8;
+}
 
-    map->buckets = malloc(
-        sizeof(FileIndexBucket) * map->bucketCount);
+/**
+ * Bit i is set when control i of the group equals value.
+ */
+#ifdef FILE_INDEX_SSE2
+static inline __uint32_t _matchGroup(const __int8_t *group, __int8_t value)
+{
+    const __m128i controls = _mm_load_si128((const __m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(controls, _mm_set1_epi8(value)));
+}
 
-    for (size_t bucketIndex = 0; bucketIndex < map->bucketCount; ++bucketIndex)
+// Empty and deleted are the only negative controls
+static inline __uint32_t _matchFree(const __int8_t *group)
+{
+    return _mm_movemask_epi8(_mm_load_si128((const __m128i *)group));
+}
+#else
+static inline __uint32_t _matchGroup(const __int8_t *group, __int8_t value)
+{
+    __uint32_t mask = 0;
+    for (size_t i = 0; i < FILE_INDEX_GROUP_WIDTH; ++i)
     {
-        FileIndexBucket bucket = map->buckets[bucketIndex];
+        mask |= (__uint32_t)(group[i] == value) << i;
+    }
+    return mask;
+}
 
-        bucket.nodeCount = 0;
-        bucket.nodeCapacity = 4;
-        bucket.nodes = malloc(
-            sizeof(FileIndexNode) * bucket.nodeCapacity);
+static inline __uint32_t _matchFree(const __int8_t *group)
+{
+    __uint32_t mask = 0;
+    for (size_t i = 0; i < FILE_INDEX_GROUP_WIDTH; ++i)
+    {
+        mask |= (__uint32_t)(group[i] < 0) << i;
     }
+    return mask;
+}
+#endif
+
+static void _allocateTable(FileIndexTable *table, size_t capacity, size_t arenaCapacity)
+{
+    table->capacity = capacity;
+    table->growthLeft = _maxLoad(capacity);
+    // Groups are loaded aligned
+    table->controls = aligned_alloc(FILE_INDEX_GROUP_WIDTH, capacity);
+    memset(table->controls, CONTROL_EMPTY, capacity);
+    table->slots = malloc(sizeof(FileIndexSlot) * capacity);
+
+    table->arena.len = 0;
+    table->arena.capacity = arenaCapacity;
+    table->arena.deadBytes = 0;
+    table->arena.data = malloc(sizeof(char) * arenaCapacity);
+}
+
+static void _freeTable(FileIndexTable *table)
+{
+    free(table->controls);
+    free(table->slots);
+    free(table->arena.data);
+    table->controls = NULL;
+}
+
+FileIndexHashMap *FileIndexCreate()
+{
+    FileIndexHashMap *map = malloc(sizeof(FileIndexHashMap));
+
+    map->size = 0;
+    map->seed = _seed(map);
+    _allocateTable(&map->table, MIN_CAPACITY, 256);
+    map->old.controls = NULL;
+    map->migratedGroups = 0;
 
     return map;
 }
 
 void FileIndexClose(FileIndexHashMap *map)
 {
-    for (size_t bucketIndex = 0; bucketIndex < map->bucketCount; ++bucketIndex)
+    _freeTable(&map->table);
+    if (map->old.controls)
     {
-        FileIndexBucket bucket = map->buckets[bucketIndex];
+        _freeTable(&map->old);
+    }
+    free(map);
+}
 
-        for (size_t nodeIndex = 0; nodeIndex < bucket.nodeCapacity; ++nodeIndex)
+static size_t _appendKey(FileIndexKeyArena *arena, const char *key, size_t keyLen)
+{
+    if (arena->len + keyLen + 1 > arena->capacity)
+    {
+        while (arena->len + keyLen + 1 > arena->capacity)
         {
-            FileIndexNode node = bucket.nodes[nodeIndex];
-            free(node.key);
+            arena->capacity *= 2;
         }
-
-        free(bucket.nodes);
+        // TODO handle bad re-alloc
+        arena->data = realloc(arena->data, arena->capacity);
     }
 
-    free(map->buckets);
-    free(map);
+    const size_t offset = arena->len;
+    memcpy(arena->data + offset, key, keyLen + 1);
+    arena->len += keyLen + 1;
+    return offset;
 }
 
-FileIndex FileIndexGet(FileIndexHashMap *map, char *key, bool *found)
+/**
+ * Index of the slot holding key, or capacity if it isn't in
+ * the table. Walks the groups triangularly, which visits every
+ * group once since their count is a power of two.
+ */
+static size_t _find(FileIndexTable *table, char *key, size_t hash)
 {
-    size_t keyLen = strlen(key);
+    const size_t groupMask = table->capacity / FILE_INDEX_GROUP_WIDTH - 1;
+    const __int8_t tag = _tag(hash);
+    size_t group = _firstGroup(table, hash);
 
-    size_t bucketIndex = Hash(key, keyLen + 1) % map->bucketCount;
+    for (size_t step = 1; step <= groupMask + 1; ++step)
+    {
+        const size_t groupStart = group * FILE_INDEX_GROUP_WIDTH;
+        const __int8_t *controls = table->controls + groupStart;
 
-    FileIndexBucket bucket = map->buckets[bucketIndex];
+        for (__uint32_t match = _matchGroup(controls, tag); match; match &= match - 1)
+        {
+            const size_t slotIndex = groupStart + __builtin_ctz(match);
+            // Only slots with the same tag get here, about 1 in 128
+            if (strcmp(table->arena.data + table->slots[slotIndex].keyOffset, key) == 0)
+            {
+                return slotIndex;
+            }
+        }
 
-    for (size_t nodeIndex = 0; nodeIndex < bucket.nodeCount; ++nodeIndex)
-    {
-        FileIndexNode node = bucket.nodes[nodeIndex];
-        if (strcmp(node.key, key))
+        // A key is never placed past a group with room in it
+        if (_matchGroup(controls, CONTROL_EMPTY))
         {
-            *found = true;
-            return node.fileIndex;
+            break;
         }
+
+        group = (group + step) & groupMask;
     }
 
-    *found = false;
-    return (FileIndex){0, 0};
+    return table->capacity;
 }
 
-void _set(FileIndexHashMap *map, char *key, FileIndex index, bool copyKey)
+/**
+ * Places a key that isn't in the table yet. There is always
+ * an empty or deleted slot along its probe sequence, the
+ * table is never full.
+ */
+static void _insert(FileIndexTable *table, const char *key, size_t keyLen, size_t hash, FileIndex index)
 {
-    size_t keyLen = strlen(key);
-    size_t bucketIndex = Hash(key, keyLen + 1) % map->bucketCount;
+    const size_t groupMask = table->capacity / FILE_INDEX_GROUP_WIDTH - 1;
+    size_t group = _firstGroup(table, hash);
 
-    FileIndexBucket bucket = map->buckets[bucketIndex];
-
-    for (size_t nodeIndex = 0; nodeIndex < bucket.nodeCount; ++nodeIndex)
+    for (size_t step = 1;; ++step)
     {
-        FileIndexNode node = bucket.nodes[nodeIndex];
-        if (strcmp(node.key, key) == 0)
+        const size_t groupStart = group * FILE_INDEX_GROUP_WIDTH;
+        const __uint32_t freeSlots = _matchFree(table->controls + groupStart);
+        if (freeSlots)
         {
-            node.fileIndex = index;
+            const size_t slotIndex = groupStart + __builtin_ctz(freeSlots);
+            if (table->controls[slotIndex] == CONTROL_EMPTY)
+            {
+                --table->growthLeft;
+            }
+            table->controls[slotIndex] = _tag(hash);
+            table->slots[slotIndex] = (FileIndexSlot){
+                _appendKey(&table->arena, key, keyLen),
+                index};
             return;
         }
+        group = (group + step) & groupMask;
     }
+}
 
-    if (bucket.nodeCount == bucket.nodeCapacity)
+static void _erase(FileIndexTable *table, size_t slotIndex, size_t keyLen)
+{
+    // If the group still has an empty slot, no probe ever
+    // went past it, so this slot can be empty again too
+    const size_t groupStart = slotIndex & ~(FILE_INDEX_GROUP_WIDTH - 1);
+    if (_matchGroup(table->controls + groupStart, CONTROL_EMPTY))
     {
-        bucket.nodeCapacity *= 2;
-        // TODO handle bad re-alloc
-        bucket.nodes = realloc(bucket.nodes, bucket.nodeCapacity);
+        table->controls[slotIndex] = CONTROL_EMPTY;
+        ++table->growthLeft;
+    }
+    else
+    {
+        table->controls[slotIndex] = CONTROL_DELETED;
     }
 
-    char *nodeKey;
+    table->arena.deadBytes += keyLen + 1;
+}
 
-    if (copyKey)
+/**
+ * Moves up to groups more groups of the old table into the
+ * current one, and frees the old table once all are moved.
+ */
+static void _migrate(FileIndexHashMap *map, size_t groups)
+{
+    FileIndexTable *old = &map->old;
+    if (!old->controls)
     {
-        nodeKey = str(sizeof(char) * (keyLen + 1));
-        memcpy(key, nodeKey, keyLen + 1);
+        return;
     }
-    else
+
+    const size_t groupCount = old->capacity / FILE_INDEX_GROUP_WIDTH;
+    const size_t lastGroup = groupCount - map->migratedGroups > groups
+                                 ? map->migratedGroups + groups
+                                 : groupCount;
+
+    for (; map->migratedGroups < lastGroup; ++map->migratedGroups)
+    {
+        const size_t groupStart = map->migratedGroups * FILE_INDEX_GROUP_WIDTH;
+        for (size_t slotIndex = groupStart; slotIndex < groupStart + FILE_INDEX_GROUP_WIDTH; ++slotIndex)
+        {
+            if (old->controls[slotIndex] < 0)
+            {
+                continue;
+            }
+
+            // Copying into the new table's arena leaves the
+            // deleted keys behind
+            const char *key = old->arena.data + old->slots[slotIndex].keyOffset;
+            const size_t keyLen = strlen(key);
+            _insert(&map->table, key, keyLen, _hashKey(map, key, keyLen), old->slots[slotIndex].fileIndex);
+            _erase(old, slotIndex, keyLen);
+        }
+    }
+
+    if (map->migratedGroups == groupCount)
     {
-        nodeKey = key;
+        _freeTable(old);
     }
+}
+
+/**
+ * Starts moving every entry into a table of the given
+ * capacity, finishing any resize still under way first.
+ */
+static void _startResize(FileIndexHashMap *map, size_t capacity)
+{
+    _migrate(map, SIZE_MAX);
 
-    bucket.nodes[bucket.nodeCount] = (FileIndexNode){
-        nodeKey,
-        index};
+    map->old = map->table;
+    map->migratedGroups = 0;
 
-    ++bucket.nodeCount;
-    ++map->size;
+    // Room for as many keys of today's average length as the
+    // table takes, so the arena isn't copied by a realloc
+    // halfway to the next resize
+    const FileIndexKeyArena *arena = &map->old.arena;
+    const size_t keyBytes = map->size ? (arena->len - arena->deadBytes) / map->size + 1 : 16;
+    _allocateTable(&map->table, capacity, keyBytes * _maxLoad(capacity) + 256);
 }
 
-void _resizeBuckets(FileIndexHashMap *map, size_t bucketCount)
+FileIndex FileIndexGet(FileIndexHashMap *map, char *key, bool *found)
 {
-    size_t oldBucketCount = map->bucketCount;
-    map->bucketCount = bucketCount;
+    const size_t hash = _hashKey(map, key, strlen(key));
 
-    FileIndexBucket *oldBuckets = map->buckets;
-    map->buckets = malloc(
-        sizeof(FileIndexBucket) * map->bucketCount);
+    size_t slotIndex = _find(&map->table, key, hash);
+    if (slotIndex != map->table.capacity)
+    {
+        *found = true;
+        return map->table.slots[slotIndex].fileIndex;
+    }
 
-    for (size_t bucketIndex = 0; bucketIndex < oldBucketCount; ++bucketIndex)
+    if (map->old.controls)
     {
-        const FileIndexBucket oldBucket = oldBuckets[bucketIndex];
-        for (size_t nodeIndex = 0; nodeIndex < oldBucket.nodeCount; ++nodeIndex)
+        slotIndex = _find(&map->old, key, hash);
+        if (slotIndex != map->old.capacity)
         {
-            const FileIndexNode node = oldBucket.nodes[nodeIndex];
-            _set(map, node.key, node.fileIndex, false);
+            *found = true;
+            return map->old.slots[slotIndex].fileIndex;
         }
-
-        free(oldBucket.nodes);
     }
 
-    free(oldBuckets);
+    *found = false;
+    return (FileIndex){0, 0};
 }
 
 void FileIndexSet(FileIndexHashMap *map, char *key, FileIndex index)
 {
-    _set(map, key, index, true);
+    _migrate(map, MIGRATE_GROUPS);
+
+    const size_t keyLen = strlen(key);
+    const size_t hash = _hashKey(map, key, keyLen);
+
+    const size_t existing = _find(&map->table, key, hash);
+    if (existing != map->table.capacity)
+    {
+        map->table.slots[existing].fileIndex = index;
+        return;
+    }
 
-    if (map->size / map->bucketCount > 3)
+    // A key not moved yet moves now, new keys only ever go
+    // into the current table
+    bool moved = false;
+    if (map->old.controls)
     {
-        _resizeBuckets(map, map->bucketCount * 2);
+        const size_t oldIndex = _find(&map->old, key, hash);
+        if (oldIndex != map->old.capacity)
+        {
+            _erase(&map->old, oldIndex, keyLen);
+            moved = true;
+        }
+    }
+
+    // Deletes can free slots without ever needing a resize,
+    // so the arena is cleaned up once it's mostly dead keys
+    const FileIndexKeyArena *arena = &map->table.arena;
+    const bool compact = !map->old.controls && arena->deadBytes > arena->len / 2 && arena->len > ARENA_MIN_COMPACT;
+
+    if (compact || !map->table.growthLeft)
+    {
+        // Mostly deleted slots means cleaning up is enough
+        const bool grow = map->size >= _maxLoad(map->table.capacity) / 2;
+        _startResize(map, grow ? map->table.capacity * 2 : map->table.capacity);
+    }
+
+    _insert(&map->table, key, keyLen, hash, index);
+
+    if (!moved)
+    {
+        ++map->size;
     }
 }
 
 void FileIndexDelete(FileIndexHashMap *map, char *key)
 {
-    size_t keyLen = strlen(key);
-    size_t bucketIndex = Hash(key, keyLen + 1) % map->bucketCount;
+    _migrate(map, MIGRATE_GROUPS);
 
-    FileIndexBucket bucket = map->buckets[bucketIndex];
+    const size_t keyLen = strlen(key);
+    const size_t hash = _hashKey(map, key, keyLen);
 
-    bool foundNode = false;
-    for (size_t nodeIndex = 0; nodeIndex < bucket.nodeCount; ++nodeIndex)
+    size_t slotIndex = _find(&map->table, key, hash);
+    if (slotIndex != map->table.capacity)
     {
-        FileIndexNode node = bucket.nodes[nodeIndex];
-        if (strcmp(node.key, key) == 0)
-        {
-            foundNode = true;
-            continue;
-        }
-
-        if (foundNode)
-        {
-            bucket.nodes[nodeIndex - 1] = node;
-        }
+        _erase(&map->table, slotIndex, keyLen);
     }
-
-    if (foundNode)
+    else if (map->old.controls &&
+             (slotIndex = _find(&map->old, key, hash)) != map->old.capacity)
+    {
+        _erase(&map->old, slotIndex, keyLen);
+    }
+    else
     {
-        --bucket.nodeCount;
-        --map->size;
+        return;
     }
 
-    if (map->size / map->bucketCount < 1)
+    --map->size;
+
+    // Growing at 7/8 and shrinking at 1/8 leaves a new table
+    // between 1/4 and 7/16 full, far from either threshold,
+    // so keys coming and going around one can't thrash
+    if (!map->old.controls && map->table.capacity > MIN_CAPACITY && map->size < map->table.capacity / 8)
     {
-        _resizeBuckets(map, map->bucketCount / 2);
+        _startResize(map, map->table.capacity / 2);
     }
 }
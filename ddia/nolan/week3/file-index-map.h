@@ -16,26 +16,63 @@ typedef struct FileIndex
     size_t len;
 } FileIndex;
 
-typedef struct FileIndexNode
+/**
+ * Where a key lives in the arena, and its index.
+ */
+typedef struct FileIndexSlot
 {
-    char *key;
+    size_t keyOffset;
     FileIndex fileIndex;
-} FileIndexNode;
+} FileIndexSlot;
 
-typedef struct FileIndexBucket
+/**
+ * Every key back to back, null-terminated. Deleted keys
+ * stay until the next resize copies out the live ones.
+ */
+typedef struct FileIndexKeyArena
 {
-    size_t nodeCount;
-    size_t nodeCapacity;
-    FileIndexNode *nodes;
-} FileIndexBucket;
+    char *data;
+    size_t len;
+    size_t capacity;
+    size_t deadBytes;
+} FileIndexKeyArena;
+
+/**
+ * Open addressing in the style of a Swiss table. Slots are
+ * split into groups of 16, and every slot has a control byte
+ * that is either empty, deleted, or 7 bits of the key's hash.
+ * A probe compares a whole group of control bytes at once and
+ * only looks at slots whose tag matches, so most lookups touch
+ * one line of controls and one slot.
+ */
+typedef struct FileIndexTable
+{
+    size_t capacity;
+    // Empty slots that can still be filled before a resize
+    size_t growthLeft;
+
+    __int8_t *controls;
+    FileIndexSlot *slots;
+    FileIndexKeyArena arena;
+} FileIndexTable;
 
-// FIXME
+/**
+ * Resizing never stops the world. A resize starts a new table
+ * and every Set or Delete after that moves a few groups of the
+ * old one into it, while lookups check both. The old table is
+ * freed once it's empty.
+ */
 typedef struct FileIndexHashMap
 {
     size_t size;
-    size_t bucketCount;
+    // Picked per map, so nobody can choose keys that collide
+    __uint64_t seed;
 
-    FileIndexBucket *buckets;
+    FileIndexTable table;
+    // Only has controls while a resize is under way
+    FileIndexTable old;
+    // Groups of old that have been moved so far
+    size_t migratedGroups;
 } FileIndexHashMap;
 
 FileIndexHashMap *FileIndexCreate();
@@ -45,4 +82,4 @@ void FileIndexSet(FileIndexHashMap *map, char *key, FileIndex index);
 FileIndex FileIndexGet(FileIndexHashMap *map, char *key, bool *found);
 void FileIndexDelete(FileIndexHashMap *map, char *key);
 
-#endif
\ No newline at end of file
+#endif
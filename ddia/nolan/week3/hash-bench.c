@@ -0,0 +1,312 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+/**
+ * Checks that Hash64 spreads the kinds of keys the index sees
+ * and compares it with Hash, then measures both.
+ *
+ * For each key set:
+ *   collisions  keys whose whole hash equals an earlier key's
+ *   bucket z    chi-square of the low 16 bits over 65536
+ *               buckets, as a z-score (0 is ideal, |z| > 6
+ *               is far from uniform)
+ *   tag z       the same for the top 7 bits, the map's tags
+ * Then the avalanche: the worst bias of any output bit flipping
+ * when one input bit flips, 0 being a coin toss.
+ *
+ * Exits with 1 if Hash64 fails any of them.
+ *
+ * Build: cc -O2 hash-bench.c hash.c -lm -o hash-bench
+ */
+
+typedef __uint64_t (*KeyHash)(const char *bytes, size_t len);
+
+typedef struct KeySet
+{
+    const char *name;
+    char *keys;
+    size_t *lens;
+    size_t count;
+    size_t stride;
+} KeySet;
+
+// Seeded once per run like the map does
+static __uint64_t _seed;
+
+static __uint64_t _hash(const char *bytes, size_t len)
+{
+    return Hash((char *)bytes, len);
+}
+
+static __uint64_t _hash64(const char *bytes, size_t len)
+{
+    return Hash64(bytes, len, _seed);
+}
+
+static double _now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static __uint64_t _random64()
+{
+    return ((__uint64_t)rand() << 42) ^ ((__uint64_t)rand() << 21) ^ rand();
+}
+
+static KeySet _keySet(const char *name, size_t count, size_t stride)
+{
+    return (KeySet){name, calloc(count, stride), malloc(sizeof(size_t) * count), count, stride};
+}
+
+static KeySet _structuredKeys()
+{
+    KeySet set = _keySet("user:<n>:profile", 1000000, 32);
+    for (size_t i = 0; i < set.count; ++i)
+    {
+        set.lens[i] = snprintf(set.keys + i * set.stride, set.stride, "user:%zu:profile", i);
+    }
+    return set;
+}
+
+/**
+ * Every ordering of the same nine digits, which Hash sends
+ * to the same few values.
+ */
+static KeySet _permutedKeys()
+{
+    KeySet set = _keySet("permutations", 362880, 16);
+    char digits[] = "123456789";
+    for (size_t i = 0; i < set.count; ++i)
+    {
+        set.lens[i] = snprintf(set.keys + i * set.stride, set.stride, "user:%s", digits);
+
+        // Next permutation in lexicographic order
+        int pivot = 7;
+        while (pivot >= 0 && digits[pivot] >= digits[pivot + 1])
+        {
+            --pivot;
+        }
+        if (pivot < 0)
+        {
+            break;
+        }
+        int swap = 8;
+        while (digits[swap] <= digits[pivot])
+        {
+            --swap;
+        }
+        char held = digits[pivot];
+        digits[pivot] = digits[swap];
+        digits[swap] = held;
+        for (int left = pivot + 1, right = 8; left < right; ++left, --right)
+        {
+            held = digits[left];
+            digits[left] = digits[right];
+            digits[right] = held;
+        }
+    }
+    return set;
+}
+
+static KeySet _counterKeys()
+{
+    KeySet set = _keySet("8 byte counters", 1000000, 8);
+    for (size_t i = 0; i < set.count; ++i)
+    {
+        memcpy(set.keys + i * set.stride, &i, sizeof(i));
+        set.lens[i] = sizeof(i);
+    }
+    return set;
+}
+
+static KeySet _shortKeys()
+{
+    KeySet set = _keySet("1-2 byte keys", 256 + 65536, 2);
+    for (size_t i = 0; i < set.count; ++i)
+    {
+        const size_t value = i < 256 ? i : i - 256;
+        memcpy(set.keys + i * set.stride, &value, 2);
+        set.lens[i] = i < 256 ? 1 : 2;
+    }
+    return set;
+}
+
+static int _compareHashes(const void *a, const void *b)
+{
+    const __uint64_t left = *(const __uint64_t *)a;
+    const __uint64_t right = *(const __uint64_t *)b;
+    return (left > right) - (left < right);
+}
+
+static double _chiSquareZ(const size_t *counts, size_t buckets, size_t total)
+{
+    const double expected = (double)total / buckets;
+    double chiSquare = 0;
+    for (size_t i = 0; i < buckets; ++i)
+    {
+        chiSquare += (counts[i] - expected) * (counts[i] - expected) / expected;
+    }
+    return (chiSquare - (buckets - 1)) / sqrt(2.0 * (buckets - 1));
+}
+
+/**
+ * Prints the distribution of one hash over one key set, and
+ * whether it passes. width is how many bits the hash has.
+ */
+static bool _distribution(const char *hashName, KeyHash hash, int width, KeySet *set)
+{
+    __uint64_t *hashes = malloc(sizeof(__uint64_t) * set->count);
+    const size_t buckets = 1UL << 16;
+    size_t *bucketCounts = calloc(buckets, sizeof(size_t));
+    size_t tagCounts[128] = {0};
+
+    for (size_t i = 0; i < set->count; ++i)
+    {
+        hashes[i] = hash(set->keys + i * set->stride, set->lens[i]);
+        ++bucketCounts[hashes[i] & (buckets - 1)];
+        ++tagCounts[hashes[i] >> (width - 7)];
+    }
+
+    qsort(hashes, set->count, sizeof(__uint64_t), _compareHashes);
+    size_t collisions = 0;
+    for (size_t i = 1; i < set->count; ++i)
+    {
+        collisions += hashes[i] == hashes[i - 1];
+    }
+
+    const double bucketZ = _chiSquareZ(bucketCounts, buckets, set->count);
+    const double tagZ = _chiSquareZ(tagCounts, 128, set->count);
+    // A 64-bit hash shouldn't collide at all at these sizes
+    const bool passed = collisions == 0 && fabs(bucketZ) < 6 && fabs(tagZ) < 6;
+    printf("%-8s %-18s %8zu %12zu %12.1f %12.1f %s\n", hashName, set->name, set->count,
+           collisions, bucketZ, tagZ, passed ? "" : "FAIL");
+
+    free(hashes);
+    free(bucketCounts);
+    return passed;
+}
+
+/**
+ * Worst deviation from 1/2 of the chance that an output bit
+ * flips when one input bit does, over random keys of len
+ * bytes.
+ */
+static double _avalanche(KeyHash hash, int width, size_t len)
+{
+    const int trials = 10000;
+    const size_t inputBits = len * 8;
+    size_t *flips = calloc(inputBits * width, sizeof(size_t));
+    char *key = malloc(len);
+
+    for (int trial = 0; trial < trials; ++trial)
+    {
+        for (size_t i = 0; i < len; ++i)
+        {
+            key[i] = rand();
+        }
+        const __uint64_t original = hash(key, len);
+        for (size_t bit = 0; bit < inputBits; ++bit)
+        {
+            key[bit / 8] ^= 1 << (bit % 8);
+            const __uint64_t changed = hash(key, len) ^ original;
+            key[bit / 8] ^= 1 << (bit % 8);
+            for (int out = 0; out < width; ++out)
+            {
+                flips[bit * width + out] += (changed >> out) & 1;
+            }
+        }
+    }
+
+    double worst = 0;
+    for (size_t i = 0; i < inputBits * width; ++i)
+    {
+        const double bias = fabs((double)flips[i] / trials - 0.5);
+        worst = bias > worst ? bias : worst;
+    }
+
+    free(flips);
+    free(key);
+    return worst;
+}
+
+/**
+ * Hashes len byte keys at shifting offsets of a buffer and
+ * returns nanoseconds per hash, best of three.
+ */
+static double _measure(KeyHash hash, const char *buffer, size_t len)
+{
+    const size_t target = 1UL << 27;
+    const size_t rounds = target / len < 1000000 ? 1000000 : target / len;
+    volatile __uint64_t sink = 0;
+
+    double best = 0;
+    for (int attempt = 0; attempt < 3; ++attempt)
+    {
+        __uint64_t folded = 0;
+        const double start = _now();
+        for (size_t round = 0; round < rounds; ++round)
+        {
+            folded ^= hash(buffer + (round & 63), len);
+        }
+        const double nanos = (_now() - start) * 1e9 / rounds;
+        best = !best || nanos < best ? nanos : best;
+        sink ^= folded;
+    }
+    (void)sink;
+    return best;
+}
+
+int main()
+{
+    srand(time(NULL));
+    _seed = _random64();
+
+    KeySet sets[] = {_structuredKeys(), _permutedKeys(), _counterKeys(), _shortKeys()};
+    const size_t setCount = sizeof(sets) / sizeof(sets[0]);
+
+    bool passed = true;
+    printf("%-8s %-18s %8s %12s %12s %12s\n", "hash", "keys", "count", "collisions", "bucket z", "tag z");
+    for (size_t i = 0; i < setCount; ++i)
+    {
+        _distribution("Hash", _hash, 32, &sets[i]);
+        passed &= _distribution("Hash64", _hash64, 64, &sets[i]);
+        free(sets[i].keys);
+        free(sets[i].lens);
+    }
+
+    printf("\n%-8s %18s %18s\n", "avalanche", "16 byte keys", "40 byte keys");
+    printf("%-8s %18.3f %18.3f\n", "Hash", _avalanche(_hash, 32, 16), _avalanche(_hash, 32, 40));
+    const double avalanche16 = _avalanche(_hash64, 64, 16);
+    const double avalanche40 = _avalanche(_hash64, 64, 40);
+    // Sampling noise alone reaches about 0.025
+    const bool avalanched = avalanche16 < 0.05 && avalanche40 < 0.05;
+    printf("%-8s %18.3f %18.3f %s\n", "Hash64", avalanche16, avalanche40, avalanched ? "" : "FAIL");
+    passed &= avalanched;
+
+    const size_t sizes[] = {4UL, 8UL, 16UL, 24UL, 32UL, 64UL, 256UL, 4096UL};
+    char *buffer = malloc(4096 + 64);
+    for (size_t i = 0; i < 4096 + 64; ++i)
+    {
+        buffer[i] = rand();
+    }
+
+    printf("\n%10s %14s %14s %14s %14s\n", "bytes", "Hash ns", "Hash64 ns", "Hash GB/s", "Hash64 GB/s");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        const double hashNanos = _measure(_hash, buffer, sizes[i]);
+        const double hash64Nanos = _measure(_hash64, buffer, sizes[i]);
+        printf("%10zu %14.2f %14.2f %14.2f %14.2f\n", sizes[i], hashNanos, hash64Nanos,
+               sizes[i] / hashNanos, sizes[i] / hash64Nanos);
+    }
+
+    free(buffer);
+    return passed ? 0 : 1;
+}
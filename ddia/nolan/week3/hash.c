@@ -1,6 +1,7 @@
 #include "hash.h"
 
 #include <limits.h>
+#include <string.h>
 
 __hash_t Hash(char *bytes, size_t len)
 {
@@ -13,4 +14,104 @@ __hash_t Hash(char *bytes, size_t len)
     }
 
     return hash;
-};
\ No newline at end of file
+};
+// Odd constants with about half their bits set, from wyhash
+static const __uint64_t HASH64_SECRET[4] = {
+    0xa0761d6478bd642fUL,
+    0xe7037ed1a0b428dbUL,
+    0x8ebc6af09c88c6e3UL,
+    0x589965cc75374cc3UL};
+
+/**
+ * Full 128 bit product of a and b, low half in a and
+ * high half in b.
+ */
+static inline void _multiply(__uint64_t *a, __uint64_t *b)
+{
+    const __uint128_t product = (__uint128_t)*a * *b;
+    *a = (__uint64_t)product;
+    *b = (__uint64_t)(product >> 64);
+}
+
+static inline __uint64_t _mix(__uint64_t a, __uint64_t b)
+{
+    _multiply(&a, &b);
+    return a ^ b;
+}
+
+static inline __uint64_t _read64(const unsigned char *bytes)
+{
+    __uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static inline __uint64_t _read32(const unsigned char *bytes)
+{
+    __uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+__hash64_t Hash64(const char *bytes, size_t len, __uint64_t seed)
+{
+    const unsigned char *next = (const unsigned char *)bytes;
+    seed ^= _mix(seed ^ HASH64_SECRET[0], HASH64_SECRET[1]);
+
+    __uint64_t a;
+    __uint64_t b;
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            // Two overlapping pairs of 4 byte reads cover 4 to 16 bytes
+            const size_t middle = (len >> 3) << 2;
+            a = (_read32(next) << 32) | _read32(next + middle);
+            b = (_read32(next + len - 4) << 32) | _read32(next + len - 4 - middle);
+        }
+        else if (len > 0)
+        {
+            a = ((__uint64_t)next[0] << 16) | ((__uint64_t)next[len >> 1] << 8) | next[len - 1];
+            b = 0;
+        }
+        else
+        {
+            a = 0;
+            b = 0;
+        }
+    }
+    else
+    {
+        size_t remaining = len;
+        if (remaining > 48)
+        {
+            __uint64_t lane1 = seed;
+            __uint64_t lane2 = seed;
+            do
+            {
+                seed = _mix(_read64(next) ^ HASH64_SECRET[1], _read64(next + 8) ^ seed);
+                lane1 = _mix(_read64(next + 16) ^ HASH64_SECRET[2], _read64(next + 24) ^ lane1);
+                lane2 = _mix(_read64(next + 32) ^ HASH64_SECRET[3], _read64(next + 40) ^ lane2);
+                next += 48;
+                remaining -= 48;
+            } while (remaining > 48);
+            seed ^= lane1 ^ lane2;
+        }
+
+        while (remaining > 16)
+        {
+            seed = _mix(_read64(next) ^ HASH64_SECRET[1], _read64(next + 8) ^ seed);
+            next += 16;
+            remaining -= 16;
+        }
+
+        // The last 16 bytes, overlapping what was already mixed
+        a = _read64(next + remaining - 16);
+        b = _read64(next + remaining - 8);
+    }
+
+    a ^= HASH64_SECRET[1];
+    b ^= seed;
+    _multiply(&a, &b);
+    return _mix(a ^ HASH64_SECRET[0] ^ len, b ^ HASH64_SECRET[1]);
+}
@@ -6,4 +6,15 @@
 typedef __uint32_t __hash_t;
 __hash_t Hash(char *bytes, size_t len);
 
-#endif
\ No newline at end of file
+typedef __uint64_t __hash64_t;
+
+/**
+ * 64-bit seeded hash for the file index, built like wyhash:
+ * 16 bytes per step, each folded in with a 64x64->128 bit
+ * multiply, three independent lanes for long keys. Every
+ * output bit depends on every input bit, and a different
+ * seed gives an unrelated function.
+ */
+__hash64_t Hash64(const char *bytes, size_t len, __uint64_t seed);
+
+#endif
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "indicator-scan.h"
+
+/**
+ * Scans synthetic corrupted data for indicators with every
+ * implementation, first checking that they agree with the
+ * byte-at-a-time scan and that IndicatorSeek lands just past
+ * every indicator planted in a file, including ones that
+ * straddle its reads.
+ *
+ * Build: cc -O2 indicator-scan-bench.c indicator-scan.c -o indicator-scan-bench
+ * Usage: indicator-scan-bench [file MB]
+ */
+
+const __indicator_t BENCH_INDICATOR = 0x1725394551607083UL;
+
+typedef size_t (*Find)(const char *bytes, size_t len, __indicator_t indicator);
+
+static double _now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void _fillRandom(char *buffer, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        buffer[i] = rand();
+    }
+}
+
+/**
+ * The worst case for candidate filtering: indicators with
+ * a middle byte flipped, so every 8th offset passes the
+ * first and last byte compare and has to be verified.
+ */
+static void _fillNearMisses(char *buffer, size_t len)
+{
+    __indicator_t nearMiss = BENCH_INDICATOR ^ (0xffUL << 24);
+    for (size_t i = 0; i + sizeof(__indicator_t) <= len; i += sizeof(__indicator_t))
+    {
+        memcpy(buffer + i, &nearMiss, sizeof(__indicator_t));
+    }
+}
+
+/**
+ * Scans the whole buffer, restarting past every indicator
+ * found, and returns GB/s.
+ */
+static double _measure(Find find, const char *buffer, size_t len)
+{
+    const size_t target = 1UL << 28;
+    const size_t rounds = target / len < 4 ? 4 : target / len;
+    volatile size_t sink = 0;
+
+    double best = 0;
+    for (int attempt = 0; attempt < 3; ++attempt)
+    {
+        const double start = _now();
+        for (size_t round = 0; round < rounds; ++round)
+        {
+            size_t offset = 0;
+            while (offset < len)
+            {
+                offset += find(buffer + offset, len - offset, BENCH_INDICATOR) + 1;
+                sink += offset;
+            }
+        }
+        const double rate = (double)rounds * len / (_now() - start) / 1e9;
+        best = rate > best ? rate : best;
+    }
+    (void)sink;
+    return best;
+}
+
+static int _checkFind()
+{
+    const size_t size = 4096;
+    char *buffer = malloc(size);
+    Find implementations[] = {IndicatorFindSse2, IndicatorFindAvx2, IndicatorFind};
+    const int count = IndicatorAvx2Available() ? 3 : 1;
+
+    int failures = 0;
+    for (int trial = 0; trial < 20000; ++trial)
+    {
+        if (trial % 2)
+        {
+            _fillRandom(buffer, size);
+        }
+        else
+        {
+            _fillNearMisses(buffer, size);
+        }
+
+        const size_t len = rand() % size;
+        // Zero to three indicators, sometimes cut off by the end
+        for (int planted = rand() % 4; planted > 0 && len >= sizeof(__indicator_t); --planted)
+        {
+            const size_t at = rand() % (len - sizeof(__indicator_t) / 2);
+            memcpy(buffer + at, &BENCH_INDICATOR,
+                   at + sizeof(__indicator_t) <= size ? sizeof(__indicator_t) : size - at);
+        }
+
+        const size_t expected = IndicatorFindScalar(buffer, len, BENCH_INDICATOR);
+        for (int i = 0; i < count; ++i)
+        {
+            if (implementations[i](buffer, len, BENCH_INDICATOR) != expected)
+            {
+                ++failures;
+            }
+        }
+    }
+
+    free(buffer);
+    if (failures)
+    {
+        fprintf(stderr, "%d mismatches with the scalar scan\n", failures);
+    }
+    return failures != 0;
+}
+
+/**
+ * Writes len random bytes with indicators at the given
+ * offsets, which must be ascending and not overlap.
+ */
+static FILE *_corruptedFile(size_t len, const size_t *offsets, size_t offsetCount)
+{
+    FILE *file = tmpfile();
+    const size_t chunkSize = 1UL << 20;
+    char *chunk = malloc(chunkSize);
+
+    for (size_t written = 0; written < len; written += chunkSize)
+    {
+        const size_t chunkLen = len - written < chunkSize ? len - written : chunkSize;
+        _fillRandom(chunk, chunkLen);
+        fwrite(chunk, sizeof(char), chunkLen, file);
+    }
+    for (size_t i = 0; i < offsetCount; ++i)
+    {
+        fseek(file, offsets[i], SEEK_SET);
+        fwrite(&BENCH_INDICATOR, sizeof(__indicator_t), 1, file);
+    }
+
+    free(chunk);
+    fflush(file);
+    return file;
+}
+
+/**
+ * Seeks from the start through every indicator in file,
+ * counting the ones that aren't where they should be.
+ */
+static int _seekAll(FILE *file, const size_t *offsets, size_t offsetCount)
+{
+    int failures = 0;
+    rewind(file);
+    for (size_t i = 0; i < offsetCount; ++i)
+    {
+        if (IndicatorSeek(file, BENCH_INDICATOR) != 0 ||
+            ftell(file) != (long)(offsets[i] + sizeof(__indicator_t)))
+        {
+            ++failures;
+            fseek(file, offsets[i] + sizeof(__indicator_t), SEEK_SET);
+        }
+    }
+    if (IndicatorSeek(file, BENCH_INDICATOR) != -1)
+    {
+        ++failures;
+    }
+    return failures;
+}
+
+int main(int argc, char **argv)
+{
+    if (_checkFind())
+    {
+        return 1;
+    }
+
+    const size_t sizes[] = {256UL, 4096UL, 65536UL, 1UL << 20, 64UL << 20};
+    const size_t largest = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    char *random = malloc(largest);
+    char *nearMisses = malloc(largest);
+    _fillRandom(random, largest);
+    _fillNearMisses(nearMisses, largest);
+
+    const bool avx2 = IndicatorAvx2Available();
+    printf("%10s %-12s %12s %12s %12s\n", "bytes", "data", "scalar GB/s", "sse2 GB/s", avx2 ? "avx2 GB/s" : "");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        for (int data = 0; data < 2; ++data)
+        {
+            const char *buffer = data ? nearMisses : random;
+            printf("%10zu %-12s %12.2f %12.2f", sizes[i], data ? "near misses" : "random",
+                   _measure(IndicatorFindScalar, buffer, sizes[i]),
+                   _measure(IndicatorFindSse2, buffer, sizes[i]));
+            if (avx2)
+            {
+                printf(" %12.2f", _measure(IndicatorFindAvx2, buffer, sizes[i]));
+            }
+            printf("\n");
+        }
+    }
+    free(random);
+    free(nearMisses);
+
+    // A file that's garbage apart from a few indicators, some
+    // across the 64KB reads IndicatorSeek makes
+    const size_t fileSize = (argc > 1 ? strtoul(argv[1], NULL, 10) : 256UL) << 20;
+    const size_t offsets[] = {0UL, 65533UL, 3UL << 16, (fileSize / 2) - 4, fileSize - sizeof(__indicator_t)};
+    const size_t offsetCount = sizeof(offsets) / sizeof(offsets[0]);
+    FILE *file = _corruptedFile(fileSize, offsets, offsetCount);
+
+    int failures = _seekAll(file, offsets, offsetCount);
+    if (failures)
+    {
+        fprintf(stderr, "IndicatorSeek missed %d indicators\n", failures);
+        fclose(file);
+        return 1;
+    }
+
+    double best = 0;
+    for (int attempt = 0; attempt < 3; ++attempt)
+    {
+        const double start = _now();
+        _seekAll(file, offsets, offsetCount);
+        const double rate = fileSize / (_now() - start) / 1e9;
+        best = rate > best ? rate : best;
+    }
+    printf("IndicatorSeek through a %zuMB corrupted file: %.2f GB/s\n", fileSize >> 20, best);
+
+    fclose(file);
+    return 0;
+}
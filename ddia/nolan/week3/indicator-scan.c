@@ -0,0 +1,223 @@
+#include "indicator-scan.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define INDICATOR_X86 1
+#endif
+
+/**
+ * The vector paths compare a block of bytes against the
+ * indicator's first byte and, shifted by seven, against its
+ * last byte. Only offsets matching both are candidates, and
+ * each candidate is verified with a full 8 byte compare.
+ * On corrupted data that leaves almost nothing to verify.
+ */
+const size_t INDICATOR_LAST_BYTE = sizeof(__indicator_t) - 1;
+
+// Bytes read per refill in IndicatorSeek
+const size_t INDICATOR_READ_SIZE = 1UL << 16;
+
+static size_t (*_indicatorFindImplementation)(const char *, size_t, __indicator_t);
+
+static inline bool _isIndicator(const char *bytes, __indicator_t indicator)
+{
+    __indicator_t testBytes;
+    memcpy(&testBytes, bytes, sizeof(__indicator_t));
+    return testBytes == indicator;
+}
+
+size_t IndicatorFindScalar(const char *bytes, size_t len, __indicator_t indicator)
+{
+    if (len < sizeof(__indicator_t))
+    {
+        return len;
+    }
+
+    for (size_t i = 0; i <= len - sizeof(__indicator_t); ++i)
+    {
+        if (_isIndicator(bytes + i, indicator))
+        {
+            return i;
+        }
+    }
+
+    return len;
+}
+
+#ifdef INDICATOR_X86
+
+/**
+ * Checks every candidate offset in mask, lowest first,
+ * relative to bytes. Returns the first real indicator's
+ * offset or SIZE_MAX.
+ */
+static inline size_t _verifyCandidates(const char *bytes, __uint32_t mask, __indicator_t indicator)
+{
+    while (mask)
+    {
+        const size_t candidate = __builtin_ctz(mask);
+        if (_isIndicator(bytes + candidate, indicator))
+        {
+            return candidate;
+        }
+        mask &= mask - 1;
+    }
+    return SIZE_MAX;
+}
+
+/**
+ * Inlined into the AVX2 path too, so its tail stays in VEX
+ * encoded instructions instead of paying for a switch back.
+ */
+static inline __attribute__((always_inline)) size_t _findSse2(const char *bytes, size_t len, __indicator_t indicator)
+{
+    const __m128i first = _mm_set1_epi8((char)indicator);
+    const __m128i last = _mm_set1_epi8((char)(indicator >> (CHAR_BIT * INDICATOR_LAST_BYTE)));
+
+    size_t i = 0;
+    // The last byte load reads up to i + 16 + 7
+    for (; i + sizeof(__m128i) + INDICATOR_LAST_BYTE <= len; i += sizeof(__m128i))
+    {
+        const __m128i firstBytes = _mm_loadu_si128((const __m128i *)(bytes + i));
+        const __m128i lastBytes = _mm_loadu_si128((const __m128i *)(bytes + i + INDICATOR_LAST_BYTE));
+        const __uint32_t mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(firstBytes, first), _mm_cmpeq_epi8(lastBytes, last)));
+
+        const size_t found = _verifyCandidates(bytes + i, mask, indicator);
+        if (found != SIZE_MAX)
+        {
+            return i + found;
+        }
+    }
+
+    return i + IndicatorFindScalar(bytes + i, len - i, indicator);
+}
+
+size_t IndicatorFindSse2(const char *bytes, size_t len, __indicator_t indicator)
+{
+    return _findSse2(bytes, len, indicator);
+}
+
+__attribute__((target("avx2"))) size_t IndicatorFindAvx2(const char *bytes, size_t len, __indicator_t indicator)
+{
+    const __m256i first = _mm256_set1_epi8((char)indicator);
+    const __m256i last = _mm256_set1_epi8((char)(indicator >> (CHAR_BIT * INDICATOR_LAST_BYTE)));
+
+    size_t i = 0;
+    for (; i + 2 * sizeof(__m256i) + INDICATOR_LAST_BYTE <= len; i += 2 * sizeof(__m256i))
+    {
+        // Two blocks per iteration, candidates are rare enough that
+        // they're only looked at once both are in
+        const char *next = bytes + i;
+        const __m256i firstLow = _mm256_loadu_si256((const __m256i *)next);
+        const __m256i lastLow = _mm256_loadu_si256((const __m256i *)(next + INDICATOR_LAST_BYTE));
+        const __m256i firstHigh = _mm256_loadu_si256((const __m256i *)(next + sizeof(__m256i)));
+        const __m256i lastHigh = _mm256_loadu_si256((const __m256i *)(next + sizeof(__m256i) + INDICATOR_LAST_BYTE));
+
+        const __m256i matchLow = _mm256_and_si256(_mm256_cmpeq_epi8(firstLow, first), _mm256_cmpeq_epi8(lastLow, last));
+        const __m256i matchHigh = _mm256_and_si256(_mm256_cmpeq_epi8(firstHigh, first), _mm256_cmpeq_epi8(lastHigh, last));
+        if (_mm256_testz_si256(_mm256_or_si256(matchLow, matchHigh), _mm256_set1_epi8(-1)))
+        {
+            continue;
+        }
+
+        size_t found = _verifyCandidates(next, (__uint32_t)_mm256_movemask_epi8(matchLow), indicator);
+        if (found != SIZE_MAX)
+        {
+            return i + found;
+        }
+        found = _verifyCandidates(next + sizeof(__m256i), (__uint32_t)_mm256_movemask_epi8(matchHigh), indicator);
+        if (found != SIZE_MAX)
+        {
+            return i + sizeof(__m256i) + found;
+        }
+    }
+
+    return i + _findSse2(bytes + i, len - i, indicator);
+}
+
+bool IndicatorAvx2Available()
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+size_t IndicatorFindSse2(const char *bytes, size_t len, __indicator_t indicator)
+{
+    return IndicatorFindScalar(bytes, len, indicator);
+}
+
+size_t IndicatorFindAvx2(const char *bytes, size_t len, __indicator_t indicator)
+{
+    return IndicatorFindScalar(bytes, len, indicator);
+}
+
+bool IndicatorAvx2Available()
+{
+    return false;
+}
+
+#endif
+
+__attribute__((constructor)) static void _indicatorScanInit()
+{
+    _indicatorFindImplementation = IndicatorAvx2Available() ? IndicatorFindAvx2 : IndicatorFindSse2;
+}
+
+size_t IndicatorFind(const char *bytes, size_t len, __indicator_t indicator)
+{
+    return _indicatorFindImplementation(bytes, len, indicator);
+}
+
+int IndicatorSeek(FILE *file, __indicator_t indicator)
+{
+    // An indicator can straddle two reads, so the last
+    // few bytes of each read are kept for the next one
+    const size_t overlap = sizeof(__indicator_t) - 1;
+    char *buffer = malloc(sizeof(char) * (INDICATOR_READ_SIZE + overlap));
+
+    // Offset in the file of buffer[0]
+    long bufferStart = ftell(file);
+    size_t buffered = 0;
+    int result = -1;
+
+    while (bufferStart >= 0)
+    {
+        const size_t bytesRead = fread(buffer + buffered, sizeof(char), INDICATOR_READ_SIZE, file);
+
+        if (bytesRead < INDICATOR_READ_SIZE && ferror(file))
+        {
+            result = ferror(file);
+            break;
+        }
+
+        buffered += bytesRead;
+
+        const size_t found = IndicatorFind(buffer, buffered, indicator);
+        if (found < buffered)
+        {
+            // Skip directly to the key
+            result = fseek(file, bufferStart + found + sizeof(__indicator_t), SEEK_SET);
+            break;
+        }
+
+        // This should be an EOF
+        if (bytesRead < INDICATOR_READ_SIZE)
+        {
+            break;
+        }
+
+        const size_t kept = buffered < overlap ? buffered : overlap;
+        memmove(buffer, buffer + buffered - kept, kept);
+        bufferStart += buffered - kept;
+        buffered = kept;
+    }
+
+    free(buffer);
+    return result;
+}
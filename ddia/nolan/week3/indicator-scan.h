@@ -0,0 +1,35 @@
+#ifndef INDICATOR_SCAN_H_
+#define INDICATOR_SCAN_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef size_t __indicator_t;
+
+/**
+ * Offset of the first complete indicator in len bytes,
+ * or len if there is none. Uses AVX2 when the CPU has it
+ * and SSE2 otherwise, picked once when the program loads.
+ */
+size_t IndicatorFind(const char *bytes, size_t len, __indicator_t indicator);
+
+/**
+ * Reads file from its current position until an indicator,
+ * and leaves the position just past it.
+ *
+ * Returns 0 once positioned, ferror's value on a read error
+ * and -1 if the file ends first.
+ */
+int IndicatorSeek(FILE *file, __indicator_t indicator);
+
+/**
+ * The implementations, for benchmarks and tests.
+ * IndicatorFindAvx2 may only be called when IndicatorAvx2Available.
+ */
+size_t IndicatorFindScalar(const char *bytes, size_t len, __indicator_t indicator);
+size_t IndicatorFindSse2(const char *bytes, size_t len, __indicator_t indicator);
+size_t IndicatorFindAvx2(const char *bytes, size_t len, __indicator_t indicator);
+bool IndicatorAvx2Available();
+
+#endif
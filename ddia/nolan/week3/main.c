@@ -5,8 +5,16 @@
 #include <string.h>
 #include <limits.h>
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc32c.h"
 #include "file-index-map.h"
-#include "hash.h"
+#include "indicator-scan.h"
 
 /**
  * To resume course after a failed checksum,
@@ -20,7 +28,6 @@
  * Also avoid spinning up 2^64 DBs if that's possible
  *
  */
-typedef size_t __indicator_t;
 const __indicator_t INDICATOR = 0x1725394551607083UL;
 
 typedef __uint8_t __keysize_t;
@@ -35,92 +42,94 @@ const size_t PREFIX_SIZE = sizeof(__indicator_t) + sizeof(__keysize_t) + sizeof(
  * [valueSize]{sizeof(size_t)}
  * [key]{keySize}
  * [value]{valueSize}
- * [checksum]{CHECKSUM_SIZE}
+ * [checksum]{sizeof(__checksum_t)}
  * NOTE key is always a string (null-terminated)
+ * The checksum is the CRC-32C of key and value.
  **/
 
+/**
+ * A read-only shared mapping of the database file. It is
+ * reserved bigger than the file so appends show up in it
+ * without remapping, though only bytes below the file's
+ * end may be touched.
+ *
+ * The DB holds a reference while the mapping is current
+ * and every view holds one, so a mapping replaced when the
+ * file outgrows it lives until its last view is released.
+ */
+typedef struct DBMapping
+{
+    const char *data;
+    size_t size;
+    atomic_size_t references;
+} DBMapping;
+
 typedef struct DB
 {
     FileIndexHashMap *map;
     char *handle;
-    FILE *file;
+    int fd;
+    // Where the next record is written
+    size_t fileSize;
+    DBMapping *mapping;
 } DB;
 
 /**
- * Consumes a pointer to a FILE and iterates
- * through looking for bytes matching the INDICATOR.
- *
- * Returns any error codes from file operations
+ * A value inside the mapped file. data stays valid, and
+ * unchanged, until the view is passed to DBReleaseView,
+ * however much is written to the DB meanwhile.
  */
-int _seekIndicator(FILE *file)
+typedef struct DBView
 {
-    const size_t readSize = sizeof(__indicator_t) * 1024UL;
-    const size_t previousDataSize = sizeof(__indicator_t) - 1;
-    const size_t bufferSize = readSize + previousDataSize;
-    char *buffer = calloc(sizeof(char), bufferSize);
+    const char *data;
+    size_t len;
+    DBMapping *mapping;
+} DBView;
 
-    long position = 0;
+// Mappings reserve at least this much
+const size_t MIN_MAPPING_SIZE = 1UL << 20;
 
-    while (true)
+/**
+ * Maps the file with room to grow to twice its size.
+ * Returns NULL if mmap fails.
+ */
+DBMapping *_mapFile(int fd, size_t fileSize)
+{
+    const size_t size = fileSize * 2 > MIN_MAPPING_SIZE ? fileSize * 2 : MIN_MAPPING_SIZE;
+    void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
     {
-        // Copy end of previous buffer to start
-        if (position)
-        {
-            memcpy(buffer, buffer + readSize, previousDataSize);
-        }
-        size_t expectedBytesRead = position ? readSize : bufferSize;
-
-        size_t bytesRead = fread(
-            position
-                ? buffer + previousDataSize
-                : buffer,
-            sizeof(char),
-            expectedBytesRead,
-            file);
-
-        if (bytesRead < expectedBytesRead && ferror(file))
-        {
-            return ferror(file);
-        }
-
-        __indicator_t testBytes;
-        for (long i = 0L; i < bytesRead; ++i)
-        {
-            memcpy(&testBytes, buffer + i, sizeof(__indicator_t));
-
-            if (testBytes == INDICATOR)
-            {
-                long offset = position + i;
-                // Account for data from previous read
-                if (position)
-                {
-                    offset -= previousDataSize;
-                }
-                // Skip directly to the key
-                offset += sizeof(__indicator_t);
-                // Undo reading of last set of bytes
-                offset -= bytesRead;
-                return fseek(file, offset, SEEK_CUR);
-            }
-        }
+        return NULL;
+    }
 
-        // This should be an EOF
-        if (bytesRead < expectedBytesRead)
-        {
-            break;
-        }
+    DBMapping *mapping = malloc(sizeof(DBMapping));
+    mapping->data = data;
+    mapping->size = size;
+    atomic_init(&mapping->references, 1);
+    return mapping;
+}
 
-        position += bytesRead;
+void _releaseMapping(DBMapping *mapping)
+{
+    if (atomic_fetch_sub_explicit(&mapping->references, 1, memory_order_acq_rel) == 1)
+    {
+        munmap((void *)mapping->data, mapping->size);
+        free(mapping);
     }
-
-    return -1;
 }
 
 void DBClose(DB *db)
 {
     FileIndexClose(db->map);
     free(db->handle);
-    fclose(db->file);
+    if (db->mapping)
+    {
+        _releaseMapping(db->mapping);
+    }
+    if (db->fd >= 0)
+    {
+        close(db->fd);
+    }
     free(db);
 }
 
@@ -129,81 +138,344 @@ typedef enum DBOpenError
     DB_OPEN_OKAY = 0U,
     DB_OPEN_FILE_OPEN_ERROR = 1U,
     DB_OPEN_FILE_READ_ERROR = 2U,
+    DB_OPEN_OUT_OF_MEMORY_ERROR = 3U,
 } DBOpenError;
 
-DB *DBopen(char *handle, DBOpenError *error)
+/**
+ * A record found during recovery. The key is read
+ * straight out of the mapped file, so nothing is
+ * allocated per record.
+ */
+typedef struct RecoveredRecord
 {
-    DB *db = malloc(sizeof(DB));
+    size_t start;
+    size_t keySize;
+    size_t valueSize;
+} RecoveredRecord;
 
-    db->map = FileIndexCreate();
+/**
+ * A slice of the file parsed by one worker. Only
+ * records whose indicator starts in [begin, end)
+ * belong to it, though the last one may run past end.
+ */
+typedef struct RecoveryRange
+{
+    const char *data;
+    size_t fileSize;
+    size_t begin;
+    size_t end;
 
-    // FIXME initialize file index map
+    // Where the scan would pick up after the range
+    size_t frontier;
 
-    FILE *file = fopen(handle, "r");
+    RecoveredRecord *records;
+    size_t recordCount;
+    size_t recordCapacity;
 
-    if (!file)
+    // Set if records couldn't grow, the range is then incomplete
+    bool outOfMemory;
+} RecoveryRange;
+
+// Ranges smaller than this aren't worth a thread
+const size_t MIN_RECOVERY_RANGE = 1UL << 20;
+
+/**
+ * Parses the record whose indicator is at start.
+ *
+ * Returns its length, or 0 if it is cut off,
+ * its key isn't a string or its checksum fails.
+ */
+size_t _parseRecord(const char *data, size_t fileSize, size_t start, RecoveredRecord *record)
+{
+    if (fileSize - start < PREFIX_SIZE)
     {
-        *error = DB_OPEN_FILE_OPEN_ERROR;
-        goto db_open_file_open_error;
+        return 0;
     }
 
-    _seekIndicator(file);
+    __keysize_t keySize;
+    memcpy(&keySize, data + start + sizeof(__indicator_t), sizeof(__keysize_t));
+
+    size_t valueSize;
+    memcpy(&valueSize, data + start + sizeof(__indicator_t) + sizeof(__keysize_t), sizeof(size_t));
 
-    char keyValueSizes[sizeof(__keysize_t) + sizeof(size_t)];
-    long currentKeyValuePos = ftell(file);
-    while (fread(keyValueSizes, sizeof(char), sizeof(keyValueSizes), file) == sizeof(keyValueSizes))
+    // Compared against what's left so a corrupt size can't overflow
+    const size_t available = fileSize - start - PREFIX_SIZE;
+    if (keySize == 0 ||
+        available < keySize + sizeof(__checksum_t) ||
+        valueSize > available - keySize - sizeof(__checksum_t))
     {
-        __keysize_t keySize;
-        memcpy(&keySize, keyValueSizes, sizeof(keySize));
+        return 0;
+    }
 
-        size_t valueSize;
-        memcpy(&valueSize, keyValueSizes + sizeof(keySize), sizeof(size_t));
+    const char *key = data + start + PREFIX_SIZE;
+    if (key[keySize - 1] != '\0')
+    {
+        return 0;
+    }
 
-        char *keyValueData = malloc(sizeof(char) * (valueSize + keySize));
-        fread(keyValueData, sizeof(char), valueSize + keySize, file);
+    __checksum_t storedChecksum;
+    memcpy(&storedChecksum, key + keySize + valueSize, sizeof(__checksum_t));
+    if (Crc32c(key, keySize + valueSize) != storedChecksum)
+    {
+        return 0;
+    }
 
-        char *key = malloc(sizeof(char) * keySize);
-        memcpy(key, keyValueData, keySize);
+    record->start = start;
+    record->keySize = keySize;
+    record->valueSize = valueSize;
+    return PREFIX_SIZE + keySize + valueSize + sizeof(__checksum_t);
+}
 
-        const __hash_t hash = Hash(keyValueData, keySize + valueSize);
-        const __hash_t checksum;
-        fread(&checksum, sizeof(__hash_t), 1UL, file);
+/**
+ * Offset of the first indicator at or after position
+ * that starts before end, or end if there is none.
+ */
+size_t _findIndicator(const char *data, size_t fileSize, size_t position, size_t end)
+{
+    // An indicator starting just before end runs past it
+    const size_t limit = end + sizeof(__indicator_t) - 1 < fileSize
+                             ? end + sizeof(__indicator_t) - 1
+                             : fileSize;
+    if (position >= limit)
+    {
+        return end;
+    }
+
+    const size_t found = position + IndicatorFind(data + position, limit - position, INDICATOR);
+    return found < end ? found : end;
+}
 
-        if (hash == checksum)
+/**
+ * Resyncs on the first indicator in the range, then parses
+ * records one after the other, searching for the next
+ * indicator after any that doesn't check out.
+ */
+void *_recoverRange(void *argument)
+{
+    RecoveryRange *range = argument;
+    size_t position = range->begin;
+
+    while (position < range->end)
+    {
+        const size_t start = _findIndicator(range->data, range->fileSize, position, range->end);
+        if (start == range->end)
+        {
+            position = range->end;
+            break;
+        }
+
+        RecoveredRecord record;
+        const size_t recordSize = _parseRecord(range->data, range->fileSize, start, &record);
+        if (!recordSize)
         {
-            FileIndex index;
-            index.start =
-                currentKeyValuePos + PREFIX_SIZE + keySize;
-            index.len = valueSize;
+            position = start + 1;
+            continue;
+        }
 
-            if (index.len)
+        if (range->recordCount == range->recordCapacity)
+        {
+            const size_t capacity = range->recordCapacity ? range->recordCapacity * 2 : 1024;
+            RecoveredRecord *records = realloc(range->records, sizeof(RecoveredRecord) * capacity);
+            if (!records)
             {
-                FileIndexSet(db->map, key, index);
+                range->outOfMemory = true;
+                break;
             }
-            else
+            range->records = records;
+            range->recordCapacity = capacity;
+        }
+        range->records[range->recordCount++] = record;
+        position = start + recordSize;
+    }
+
+    range->frontier = position;
+    return NULL;
+}
+
+void _applyRecord(DB *db, const char *data, const RecoveredRecord *record)
+{
+    char *key = (char *)data + record->start + PREFIX_SIZE;
+    if (record->valueSize)
+    {
+        FileIndex index = {record->start + PREFIX_SIZE + record->keySize, record->valueSize};
+        FileIndexSet(db->map, key, index);
+    }
+    else
+    {
+        FileIndexDelete(db->map, key);
+    }
+}
+
+/**
+ * Applies a range's records to the index, starting from
+ * where the previous range left the scan.
+ *
+ * A worker resyncs on the first indicator it sees, which
+ * may be inside a value the previous range's last record
+ * covers. So the scan carries on here one record at a
+ * time until it reaches a record the worker also found.
+ * From there both scans are the same and the worker's
+ * records are used. Usually that is the first record.
+ *
+ * Returns where the scan picks up after the range.
+ */
+size_t _mergeRange(DB *db, const RecoveryRange *range, size_t position)
+{
+    size_t next = 0;
+
+    while (position < range->end)
+    {
+        const size_t start = _findIndicator(range->data, range->fileSize, position, range->end);
+        if (start == range->end)
+        {
+            return range->end;
+        }
+
+        while (next < range->recordCount && range->records[next].start < start)
+        {
+            ++next;
+        }
+        if (next < range->recordCount && range->records[next].start == start)
+        {
+            for (; next < range->recordCount; ++next)
             {
-                FileIndexDelete(db->map, key);
+                _applyRecord(db, range->data, range->records + next);
             }
+            return range->frontier;
+        }
+
+        RecoveredRecord record;
+        const size_t recordSize = _parseRecord(range->data, range->fileSize, start, &record);
+        if (recordSize)
+        {
+            _applyRecord(db, range->data, &record);
+            position = start + recordSize;
         }
         else
         {
-            fseek(file, currentKeyValuePos, SEEK_SET);
-            _seekIndicator(file);
+            position = start + 1;
         }
+    }
+
+    return position;
+}
+
+/**
+ * Rebuilds the index by splitting the file into up to
+ * threadCount ranges and parsing and checksumming them on
+ * as many threads. Results are applied in file order, so
+ * later writes of a key still win.
+ *
+ * DBopen is the same with one range parsed on the calling
+ * thread. Both create the file if it doesn't exist.
+ */
+DB *DBopenParallel(char *handle, size_t threadCount, DBOpenError *error)
+{
+    DB *db = malloc(sizeof(DB));
 
-        free(key);
-        free(keyValueData);
-        currentKeyValuePos = ftell(file);
+    db->map = FileIndexCreate();
+    db->handle = strdup(handle);
+    db->mapping = NULL;
+    db->fd = open(handle, O_RDWR | O_CREAT, 0644);
+
+    if (db->fd < 0)
+    {
+        *error = DB_OPEN_FILE_OPEN_ERROR;
+        goto db_open_file_open_error;
+    }
+
+    struct stat status;
+    if (fstat(db->fd, &status))
+    {
+        *error = DB_OPEN_FILE_READ_ERROR;
+        goto db_open_file_read_error;
     }
 
-    if (ferror(file))
+    const size_t fileSize = status.st_size;
+    db->fileSize = fileSize;
+    db->mapping = _mapFile(db->fd, fileSize);
+    if (!db->mapping)
     {
         *error = DB_OPEN_FILE_READ_ERROR;
         goto db_open_file_read_error;
     }
 
+    if (!fileSize)
+    {
+        return db;
+    }
+
+    const char *data = db->mapping->data;
+    madvise((void *)data, fileSize, MADV_SEQUENTIAL);
+
+    size_t rangeCount = fileSize / MIN_RECOVERY_RANGE + 1;
+    if (rangeCount > threadCount)
+    {
+        rangeCount = threadCount ? threadCount : 1;
+    }
+
+    RecoveryRange *ranges = calloc(rangeCount, sizeof(RecoveryRange));
+    pthread_t *threads = malloc(sizeof(pthread_t) * rangeCount);
+    if (!ranges || !threads)
+    {
+        free(ranges);
+        free(threads);
+        *error = DB_OPEN_OUT_OF_MEMORY_ERROR;
+        goto db_open_out_of_memory_error;
+    }
+
+    for (size_t i = 0; i < rangeCount; ++i)
+    {
+        ranges[i].data = data;
+        ranges[i].fileSize = fileSize;
+        ranges[i].begin = fileSize / rangeCount * i;
+        ranges[i].end = i + 1 == rangeCount ? fileSize : fileSize / rangeCount * (i + 1);
+    }
+
+    // The first range runs here, as does any whose thread won't start
+    size_t startedThreads = 1;
+    while (startedThreads < rangeCount &&
+           !pthread_create(&threads[startedThreads], NULL, _recoverRange, &ranges[startedThreads]))
+    {
+        ++startedThreads;
+    }
+    for (size_t i = startedThreads; i < rangeCount; ++i)
+    {
+        _recoverRange(&ranges[i]);
+    }
+    _recoverRange(&ranges[0]);
+
+    size_t position = 0;
+    bool outOfMemory = false;
+    for (size_t i = 0; i < rangeCount; ++i)
+    {
+        if (i && i < startedThreads)
+        {
+            pthread_join(threads[i], NULL);
+        }
+        // A range that ran out of memory is missing records, so
+        // an index built from it would silently lose keys
+        outOfMemory = outOfMemory || ranges[i].outOfMemory;
+        if (!outOfMemory)
+        {
+            position = _mergeRange(db, &ranges[i], position);
+        }
+        free(ranges[i].records);
+    }
+
+    free(ranges);
+    free(threads);
+    madvise((void *)data, fileSize, MADV_NORMAL);
+
+    if (outOfMemory)
+    {
+        *error = DB_OPEN_OUT_OF_MEMORY_ERROR;
+        goto db_open_out_of_memory_error;
+    }
+
     return db;
 
+db_open_out_of_memory_error:
 db_open_file_read_error:
 db_open_file_open_error:
     DBClose(db);
@@ -211,17 +483,31 @@ db_open_file_open_error:
     return NULL;
 }
 
+DB *DBopen(char *handle, DBOpenError *error)
+{
+    return DBopenParallel(handle, 1, error);
+}
+
 typedef enum DBGetError
 {
     DB_GET_OKAY = 0U,
     DB_GET_KEY_NOT_FOUND_ERROR = 1U,
     DB_GET_FILE_OPEN_ERROR = 2U,
-    DB_GET_FILE_READ_ERROR = 4U
+    DB_GET_FILE_READ_ERROR = 4U,
+    DB_GET_CHECKSUM_ERROR = 8U
 } DBGetError;
 
-Buffer *DBGet(DB *db, char *key, DBGetError *error)
+/**
+ * Looks key up and returns its value as a view into the
+ * mapped file, after checking the record's key and
+ * checksum. Nothing is allocated or copied.
+ *
+ * On error the view's data is NULL. Otherwise it must be
+ * passed to DBReleaseView once the caller is done with it.
+ */
+DBView DBGetView(DB *db, char *key, DBGetError *error)
 {
-    Buffer *buff = malloc(sizeof(Buffer));
+    DBView view = {NULL, 0, NULL};
 
     bool found;
     FileIndex index = FileIndexGet(db->map, key, &found);
@@ -229,37 +515,68 @@ Buffer *DBGet(DB *db, char *key, DBGetError *error)
     if (!found)
     {
         *error = DB_GET_KEY_NOT_FOUND_ERROR;
-        goto db_get_key_not_found_error;
+        return view;
     }
 
-    FILE *file = freopen(db->handle, "r", db->file);
+    // The key and checksum around the value are read too, so the
+    // record can be verified before handing the value out
+    const size_t keySize = strlen(key) + sizeof(char);
+    const size_t recordStart = index.start - keySize;
+    const size_t recordEnd = index.start + index.len + sizeof(__checksum_t);
+    if (index.start < keySize || recordEnd > db->fileSize)
+    {
+        *error = DB_GET_FILE_READ_ERROR;
+        return view;
+    }
 
-    if (!file)
+    const char *record = db->mapping->data + recordStart;
+    __checksum_t storedChecksum;
+    memcpy(&storedChecksum, record + keySize + index.len, sizeof(__checksum_t));
+    if (memcmp(record, key, keySize) != 0 ||
+        Crc32c(record, keySize + index.len) != storedChecksum)
     {
-        *error = DB_GET_FILE_OPEN_ERROR;
-        goto db_get_file_open_error;
+        *error = DB_GET_CHECKSUM_ERROR;
+        return view;
     }
 
-    fsetpos(file, index.start);
+    atomic_fetch_add_explicit(&db->mapping->references, 1, memory_order_relaxed);
+    view.data = record + keySize;
+    view.len = index.len;
+    view.mapping = db->mapping;
+    return view;
+}
 
-    char *data = malloc(sizeof(char) * index.len);
-    if (fread(data, sizeof(char), index.len, file) != 1)
+/**
+ * Gives up a view from DBGetView. May be called from any
+ * thread, and after the DB is closed.
+ */
+void DBReleaseView(DBView view)
+{
+    if (view.mapping)
     {
-        *error = DB_GET_FILE_READ_ERROR;
-        goto db_get_file_read_error;
+        _releaseMapping(view.mapping);
     }
+}
 
-    buff->data = data;
-    buff->len = index.len;
-
-    return buff;
+/**
+ * DBGetView, with the value copied out into a Buffer the
+ * caller owns.
+ */
+Buffer *DBGet(DB *db, char *key, DBGetError *error)
+{
+    DBView view = DBGetView(db, key, error);
+    if (!view.data)
+    {
+        return NULL;
+    }
 
-db_get_file_read_error:
-db_get_file_open_error:
-db_get_key_not_found_error:
+    Buffer *buff = malloc(sizeof(Buffer));
+    buff->data = malloc(sizeof(char) * (view.len ? view.len : 1));
+    memcpy(buff->data, view.data, view.len);
+    buff->len = view.len;
 
-    free(buff);
-    return NULL;
+    DBReleaseView(view);
+    return buff;
 }
 
 typedef enum DBSetError
@@ -268,18 +585,16 @@ typedef enum DBSetError
     DB_SET_FILE_OPEN_ERROR = 1U,
     DB_SET_FILE_WRITE_ERROR = 2U,
     DB_SET_KEY_SIZE_TOO_LARGE = 4U,
+    DB_SET_MAP_ERROR = 8U,
 } DBSetError;
 
+/**
+ * Appends a record at the end of the file with pwrite, then
+ * remaps if the file has outgrown the mapping. Views of the
+ * old mapping stay valid until released.
+ */
 void DBSet(DB *db, char *key, Buffer value, DBSetError *error)
 {
-    FILE *file = freopen(db->handle, "a", db->file);
-
-    if (!file)
-    {
-        *error = DB_SET_FILE_OPEN_ERROR;
-        goto db_set_file_open_error;
-    }
-
     const size_t uncheckedKeySize = strlen(key) + sizeof(char);
     if (uncheckedKeySize > MAX_KEY_SIZE)
     {
@@ -290,7 +605,7 @@ void DBSet(DB *db, char *key, Buffer value, DBSetError *error)
     const __keysize_t keySize = uncheckedKeySize;
 
     const size_t payloadSize = PREFIX_SIZE + keySize + value.len +
-                               sizeof(__hash_t);
+                               sizeof(__checksum_t);
 
     char *payload = malloc(sizeof(char) * payloadSize);
 
@@ -307,32 +622,57 @@ void DBSet(DB *db, char *key, Buffer value, DBSetError *error)
     memcpy(payload + bytesCopied, key, keySize);
     bytesCopied += keySize;
 
-    const size_t dataStart = ftell(file) + bytesCopied;
+    const size_t dataStart = db->fileSize + bytesCopied;
     memcpy(payload + bytesCopied, value.data, value.len);
     bytesCopied += value.len;
 
     // Just hash key and value
-    const __uint32_t hash = Hash(payload + PREFIX_SIZE, bytesCopied - PREFIX_SIZE);
-    memcpy(payload + bytesCopied, &hash, sizeof(__hash_t));
-
-    const size_t writeAmount = fwrite(payload, sizeof(char), payloadSize, file);
+    const __checksum_t checksum = Crc32c(payload + PREFIX_SIZE, bytesCopied - PREFIX_SIZE);
+    memcpy(payload + bytesCopied, &checksum, sizeof(__checksum_t));
 
-    if (writeAmount != payloadSize)
+    size_t written = 0;
+    while (written < payloadSize)
     {
-        *error = DB_SET_FILE_WRITE_ERROR;
-        goto db_set_file_write_error;
+        const ssize_t writeAmount = pwrite(db->fd, payload + written, payloadSize - written,
+                                           db->fileSize + written);
+        if (writeAmount <= 0)
+        {
+            *error = DB_SET_FILE_WRITE_ERROR;
+            goto db_set_file_write_error;
+        }
+        written += writeAmount;
     }
 
     free(payload);
+    db->fileSize += payloadSize;
 
-    FileIndex index = {dataStart, value.len};
+    if (db->fileSize > db->mapping->size)
+    {
+        DBMapping *mapping = _mapFile(db->fd, db->fileSize);
+        if (!mapping)
+        {
+            *error = DB_SET_MAP_ERROR;
+            goto db_set_map_error;
+        }
+        _releaseMapping(db->mapping);
+        db->mapping = mapping;
+    }
 
-    FileIndexSet(db->map, key, index);
+    // An empty value is a delete, as DBopen reads it
+    if (value.len)
+    {
+        FileIndex index = {dataStart, value.len};
+        FileIndexSet(db->map, key, index);
+    }
+    else
+    {
+        FileIndexDelete(db->map, key);
+    }
 
     return;
 
 db_set_file_write_error:
     free(payload);
+db_set_map_error:
 db_set_key_size_too_large:
-db_set_file_open_error:
 }